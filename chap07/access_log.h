@@ -0,0 +1,238 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * An access log written by a background thread.
+ *
+ * Each thread that serves requests owns a log_ring, a fixed array of
+ * records with one producer (that thread) and one consumer (the writer
+ * thread). Adding a record is a copy and an index update: it never
+ * takes a lock, waits or makes a system call. If the ring is full the
+ * record is dropped and counted instead.
+ *
+ * The writer thread wakes every LOG_FLUSH_MS, formats whatever the rings
+ * hold as Common Log Format lines, and writes them out with one fwrite()
+ * per batch. It reports how many records were dropped since its last
+ * batch.
+ *
+ * Rings are added with log_add_ring() before log_start() is called.
+ */
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+#define LOG_RECORDS 8192
+#define LOG_MAX_RINGS 16
+#define LOG_FLUSH_MS 20
+
+#if defined(_MSC_VER)
+/* Volatile accesses have acquire and release semantics with MSVC. */
+#define log_load(p) (*(volatile unsigned long*)(p))
+#define log_store(p, v) (*(volatile unsigned long*)(p) = (v))
+#else
+#define log_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define log_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+
+struct log_record {
+    time_t time;
+    unsigned long bytes;
+    int status;
+    char address[48];
+    char request[112];
+};
+
+/* head is only written by the writer thread and tail only by the
+ * producer, each on its own cache line. */
+struct log_ring {
+    unsigned long head;
+    char pad1[64 - sizeof(unsigned long)];
+    unsigned long tail;
+    unsigned long dropped;
+    char pad2[64 - 2 * sizeof(unsigned long)];
+    struct log_record records[LOG_RECORDS];
+};
+
+static struct log_ring *log_rings[LOG_MAX_RINGS];
+static int log_ring_count = 0;
+static FILE *log_file = 0;
+
+
+static void log_add_ring(struct log_ring *ring) {
+    memset(ring, 0, sizeof(*ring));
+    if (log_ring_count < LOG_MAX_RINGS)
+        log_rings[log_ring_count++] = ring;
+}
+
+
+/* Copies src to the end of dst, cutting it short to fit in size. */
+static char *log_copy(char *dst, const char *src, size_t size) {
+    while (*src && size > 1) {
+        *dst++ = *src++;
+        --size;
+    }
+    *dst = 0;
+    return dst;
+}
+
+
+/* Adds a record for a request to ring. Without a method, the request
+ * couldn't be parsed and is logged as "-". */
+static void log_request(struct log_ring *ring, const char *address,
+        const char *method, const char *path, int status,
+        unsigned long bytes) {
+    unsigned long tail = ring->tail;
+    if (tail - log_load(&ring->head) == LOG_RECORDS) {
+        log_store(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+
+    struct log_record *r = &ring->records[tail % LOG_RECORDS];
+    r->time = time(0);
+    r->bytes = bytes;
+    r->status = status;
+    log_copy(r->address, address, sizeof(r->address));
+    if (method) {
+        char *end = r->request + sizeof(r->request);
+        char *p = log_copy(r->request, method, end - r->request);
+        p = log_copy(p, " ", end - p);
+        log_copy(p, path, end - p);
+    } else {
+        strcpy(r->request, "-");
+    }
+
+    log_store(&ring->tail, tail + 1);
+}
+
+
+static void log_sleep(int ms) {
+#if defined(_WIN32)
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, 0);
+#endif
+}
+
+
+/* Formats and writes everything the rings hold. */
+static void log_flush() {
+    static char buffer[65536];
+    static time_t last_time = 0;
+    static char date[32];
+    static unsigned long reported[LOG_MAX_RINGS];
+    size_t length = 0;
+    unsigned long dropped = 0;
+    int i;
+
+    for (i = 0; i < log_ring_count; ++i) {
+        struct log_ring *ring = log_rings[i];
+        unsigned long head = ring->head;
+        unsigned long tail = log_load(&ring->tail);
+
+        while (head != tail) {
+            struct log_record *r = &ring->records[head % LOG_RECORDS];
+
+            if (r->time != last_time) {
+                struct tm tm;
+#if defined(_WIN32)
+                gmtime_s(&tm, &r->time);
+#else
+                gmtime_r(&r->time, &tm);
+#endif
+                strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+                last_time = r->time;
+            }
+
+            if (sizeof(buffer) - length < 256) {
+                fwrite(buffer, 1, length, log_file);
+                length = 0;
+            }
+            length += sprintf(buffer + length, "%s - - [%s] \"%s\" %d %lu\n",
+                    r->address, date, r->request, r->status, r->bytes);
+
+            log_store(&ring->head, ++head);
+        }
+
+        unsigned long d = log_load(&ring->dropped);
+        dropped += d - reported[i];
+        reported[i] = d;
+    }
+
+    if (dropped)
+        length += sprintf(buffer + length,
+                "access log: %lu records dropped\n", dropped);
+
+    if (length) {
+        fwrite(buffer, 1, length, log_file);
+        fflush(log_file);
+    }
+}
+
+
+#if defined(_WIN32)
+static DWORD WINAPI log_thread(LPVOID arg) {
+#else
+static void *log_thread(void *arg) {
+#endif
+    (void)arg;
+    while (1) {
+        log_flush();
+        log_sleep(LOG_FLUSH_MS);
+    }
+    return 0;
+}
+
+
+/* Starts the writer thread, which writes the log to file. Returns 0 on
+ * success. */
+static int log_start(FILE *file) {
+    log_file = file;
+#if defined(_WIN32)
+    HANDLE thread = CreateThread(0, 0, log_thread, 0, 0, 0);
+    if (!thread) return -1;
+    CloseHandle(thread);
+    return 0;
+#else
+    pthread_t thread;
+    if (pthread_create(&thread, 0, log_thread, 0)) return -1;
+    pthread_detach(thread);
+    return 0;
+#endif
+}
+
+#endif
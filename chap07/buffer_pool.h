@@ -0,0 +1,101 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A pool of buffers in power-of-two size classes.
+ *
+ * pool_get() hands out a block from the smallest class that fits, and
+ * pool_put() returns it to its class's free list, so a buffer that is
+ * only held while a request is in progress costs one list operation to
+ * take and give back. Each class keeps up to POOL_MAX_FREE free blocks
+ * and frees the rest, so a burst doesn't pin its peak memory for good.
+ *
+ * The pool isn't locked; it belongs to the one thread that uses it.
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdlib.h>
+
+
+#define POOL_MIN_SHIFT 12
+#define POOL_CLASSES 6
+#define POOL_MAX_FREE 256
+
+/* Sits in front of every block. The union keeps what follows aligned for
+ * any type. */
+union pool_block {
+    struct {
+        union pool_block *next;
+        int size_class;
+    } h;
+    long double align_ld;
+    void *align_p;
+};
+
+static union pool_block *pool_free[POOL_CLASSES];
+static int pool_free_count[POOL_CLASSES];
+
+
+/* Returns a block of at least size bytes, or 0 if even the largest
+ * class is too small or memory has run out. If capacity isn't 0, the block's
+ * real size is stored there. */
+static void *pool_get(size_t size, size_t *capacity) {
+    int c = 0;
+    while (c < POOL_CLASSES &&
+            ((size_t)1 << (POOL_MIN_SHIFT + c)) - sizeof(union pool_block) <
+            size)
+        ++c;
+    if (c == POOL_CLASSES) return 0;
+
+    union pool_block *b = pool_free[c];
+    if (b) {
+        pool_free[c] = b->h.next;
+        pool_free_count[c]--;
+    } else {
+        b = (union pool_block*) malloc((size_t)1 << (POOL_MIN_SHIFT + c));
+        if (!b) return 0;
+        b->h.size_class = c;
+    }
+
+    if (capacity)
+        *capacity = ((size_t)1 << (POOL_MIN_SHIFT + c)) - sizeof(*b);
+    return b + 1;
+}
+
+
+static void pool_put(void *p) {
+    union pool_block *b = (union pool_block*)p - 1;
+    int c = b->h.size_class;
+    if (pool_free_count[c] >= POOL_MAX_FREE) {
+        free(b);
+        return;
+    }
+    b->h.next = pool_free[c];
+    pool_free[c] = b;
+    pool_free_count[c]++;
+}
+
+#endif
@@ -34,10 +34,41 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && !defined(USE_SELECT)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
+#if defined(__linux__) && !defined(NO_SENDFILE)
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
+
+#if defined(__linux__) && !defined(NO_CACHE)
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#define USE_CACHE
+#endif
+
+#if defined(__linux__) && !defined(NO_IO_POOL)
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#define USE_IO_POOL
+#endif
+
+#if !defined(NO_PACK)
+#define USE_PACK
+#endif
 
 #endif
 
@@ -58,3 +89,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
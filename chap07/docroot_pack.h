@@ -0,0 +1,236 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A docroot pack: every file under a directory in one file, written by
+ * pack_docroot and mapped into memory by web_server -p.
+ *
+ * The file starts with a pack_header, then one seed per hash bucket,
+ * then one pack_entry per file, then the strings, headers and bodies the
+ * entries point at by offset. Each entry has up to PACK_VARIANTS copies
+ * of its file: as is, then each precompressed variant in the order of
+ * pack_encodings. Every variant carries its response headers ready to
+ * send, except for the Connection header.
+ *
+ * Paths are found with a perfect hash built by hash and displace: a
+ * path's bucket is pack_hash(path, 0), and the bucket's seed was chosen
+ * so that pack_hash(path, seed) sends every path in the bucket to a
+ * different entry. A lookup is two hashes and one compare.
+ *
+ * Numbers are stored in the byte order of the machine that wrote the
+ * pack, and offsets are 32-bit, so a pack is at most 4 GiB.
+ *
+ * A pack must be replaced by renaming a new file over it, as
+ * pack_docroot does, never rewritten in place: a server that has it
+ * mapped would see the change, or fault on a truncated page.
+ */
+
+#ifndef DOCROOT_PACK_H
+#define DOCROOT_PACK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+#define PACK_MAGIC "DOCPACK1"
+#define PACK_VARIANTS 3
+#define PACK_MAX_TYPE 100
+#define PACK_MAX_ETAG 64
+#define PACK_MAX_DATE 32
+
+static const char *pack_encodings[PACK_VARIANTS] = {0, "br", "gzip"};
+
+struct pack_header {
+    char magic[8];
+    uint32_t size;
+    uint32_t entry_count;
+    uint32_t bucket_count;
+    uint32_t reserved;
+};
+
+/* A variant with no headers isn't in the pack. */
+struct pack_variant {
+    uint32_t headers;
+    uint32_t headers_length;
+    uint32_t not_modified;
+    uint32_t not_modified_length;
+    uint32_t body;
+    uint32_t body_length;
+    uint32_t etag;
+    uint32_t last_modified;
+    uint32_t mtime;
+};
+
+struct pack_entry {
+    uint32_t hash;
+    uint32_t path;
+    uint32_t path_length;
+    uint32_t content_type;
+    struct pack_variant variants[PACK_VARIANTS];
+};
+
+/* A mapped pack. Responses being sent from it hold a reference, so a
+ * pack that has been replaced stays mapped until they finish. */
+struct pack {
+    const char *data;
+    size_t size;
+    const struct pack_header *header;
+    const uint32_t *seeds;
+    const struct pack_entry *entries;
+    int refs;
+};
+
+
+static uint32_t pack_hash(const char *path, size_t length, uint32_t seed) {
+    uint32_t h = 2166136261U ^ (seed * 0x9e3779b9U);
+    size_t i;
+    for (i = 0; i < length; ++i) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+
+static const struct pack_entry *pack_find(const struct pack *pack,
+        const char *path, size_t length) {
+    const struct pack_header *header = pack->header;
+    if (!header->entry_count) return 0;
+
+    uint32_t hash = pack_hash(path, length, 0);
+    uint32_t seed = pack->seeds[hash % header->bucket_count];
+    const struct pack_entry *e = &pack->entries[
+        pack_hash(path, length, seed) % header->entry_count];
+
+    if (e->hash != hash || e->path_length != length ||
+            memcmp(pack->data + e->path, path, length))
+        return 0;
+    return e;
+}
+
+
+#if !defined(_WIN32)
+/* Checks that length bytes at offset lie inside the pack. */
+static int pack_valid(const struct pack *pack, uint32_t offset, size_t length) {
+    return offset <= pack->size && length <= pack->size - offset;
+}
+
+
+/* Checks that a string shorter than max bytes starts at offset. */
+static int pack_string(const struct pack *pack, uint32_t offset, size_t max) {
+    if (offset >= pack->size) return 0;
+    if (max > pack->size - offset) max = pack->size - offset;
+    return memchr(pack->data + offset, 0, max) != 0;
+}
+
+
+static void pack_close(struct pack *pack) {
+    munmap((void*)pack->data, pack->size);
+    free(pack);
+}
+
+
+/* Maps the pack in file name and checks every offset in it, so that
+ * serving from it can trust them. Returns 0 if it can't be used. */
+static struct pack *pack_open(const char *name) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct pack_header) ||
+            st.st_size > (off_t)0xffffffffU) {
+        close(fd);
+        return 0;
+    }
+
+    int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+    flags |= MAP_POPULATE;
+#endif
+    void *map = mmap(0, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    struct pack *pack = (struct pack*) malloc(sizeof(*pack));
+    if (!pack) {
+        munmap(map, (size_t)st.st_size);
+        return 0;
+    }
+    pack->data = (const char*)map;
+    pack->size = (size_t)st.st_size;
+    pack->header = (const struct pack_header*)map;
+    pack->refs = 0;
+
+    const struct pack_header *h = pack->header;
+    size_t index = sizeof(*h) + (size_t)h->bucket_count * sizeof(uint32_t);
+    if (memcmp(h->magic, PACK_MAGIC, 8) || h->size != pack->size ||
+            (h->entry_count && !h->bucket_count) ||
+            h->bucket_count > (pack->size - sizeof(*h)) / sizeof(uint32_t) ||
+            h->entry_count >
+                (pack->size - index) / sizeof(struct pack_entry)) {
+        pack_close(pack);
+        return 0;
+    }
+    pack->seeds = (const uint32_t*)(pack->data + sizeof(*h));
+    pack->entries = (const struct pack_entry*)(pack->data + index);
+
+    uint32_t i;
+    int v;
+    for (i = 0; i < h->entry_count; ++i) {
+        const struct pack_entry *e = &pack->entries[i];
+        int ok = pack_valid(pack, e->path, e->path_length) &&
+            pack_string(pack, e->content_type, PACK_MAX_TYPE);
+        for (v = 0; ok && v < PACK_VARIANTS; ++v) {
+            const struct pack_variant *pv = &e->variants[v];
+            if (!pv->headers_length) continue;
+            ok = pack_valid(pack, pv->headers, pv->headers_length) &&
+                pack_valid(pack, pv->not_modified, pv->not_modified_length) &&
+                pack_valid(pack, pv->body, pv->body_length) &&
+                pack_string(pack, pv->etag, PACK_MAX_ETAG) &&
+                pack_string(pack, pv->last_modified, PACK_MAX_DATE);
+        }
+        if (!ok || !e->variants[0].headers_length) {
+            pack_close(pack);
+            return 0;
+        }
+    }
+
+    return pack;
+}
+#endif
+
+#endif
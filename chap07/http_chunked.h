@@ -0,0 +1,152 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Follows a chunked message body through as it arrives, to find where
+ * it ends, and optionally decodes it. Like http_parse(), it resumes
+ * where the previous call stopped, so a proxy can pass each piece of the
+ * body on as it comes and still know when the message is over, and a
+ * server can hand each piece of the data on without holding the rest.
+ */
+
+#ifndef HTTP_CHUNKED_H
+#define HTTP_CHUNKED_H
+
+#include "http_parser.h"
+
+
+enum {
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_EXTENSION,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_END,
+    HTTP_CHUNK_TRAILER,
+    HTTP_CHUNK_TRAILER_LINE,
+    HTTP_CHUNK_DONE
+};
+
+struct http_chunked {
+    int state;
+    int digits;
+    unsigned long size;   /* of the chunk being read, or left of it */
+};
+
+
+static void http_chunked_reset(struct http_chunked *ch) {
+    ch->state = HTTP_CHUNK_SIZE;
+    ch->digits = 0;
+    ch->size = 0;
+}
+
+
+/* Decodes the next length bytes of a chunked body in place: the chunk
+ * data among them is moved to the front of p, and its length stored in
+ * decoded, unless decoded is 0, when p is only read. Returns how many
+ * of the bytes belong to the body, which is fewer than length only once
+ * the body has ended (ch->state is then HTTP_CHUNK_DONE), or
+ * HTTP_PARSE_ERROR if the chunks are malformed. */
+static int http_chunked_decode(struct http_chunked *ch,
+        char *p, int length, int *decoded) {
+    char *start = p;
+    char *end = p + length;
+    const char *lf;
+    unsigned long n;
+
+    if (decoded) *decoded = 0;
+    while (p < end && ch->state != HTTP_CHUNK_DONE) {
+        switch (ch->state) {
+        case HTTP_CHUNK_SIZE: {
+            int d = -1;
+            if (*p >= '0' && *p <= '9') d = *p - '0';
+            else if (*p >= 'a' && *p <= 'f') d = *p - 'a' + 10;
+            else if (*p >= 'A' && *p <= 'F') d = *p - 'A' + 10;
+            if (d < 0) {
+                if (!ch->digits) return HTTP_PARSE_ERROR;
+                ch->state = HTTP_CHUNK_EXTENSION;
+                break;
+            }
+            if (++ch->digits > (int)(2 * sizeof(ch->size) - 1))
+                return HTTP_PARSE_ERROR;
+            ch->size = ch->size * 16 + (unsigned long)d;
+            ++p;
+            break;
+        }
+
+        case HTTP_CHUNK_EXTENSION:
+        case HTTP_CHUNK_TRAILER_LINE:
+            lf = http_find(p, end, '\n');
+            if (!lf) {
+                p = end;
+                break;
+            }
+            p = (char*)lf + 1;
+            if (ch->state == HTTP_CHUNK_TRAILER_LINE)
+                ch->state = HTTP_CHUNK_TRAILER;
+            else
+                ch->state = ch->size ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            break;
+
+        case HTTP_CHUNK_DATA:
+            n = (unsigned long)(end - p);
+            if (n > ch->size) n = ch->size;
+            if (decoded) {
+                memmove(start + *decoded, p, n);
+                *decoded += (int)n;
+            }
+            p += n;
+            ch->size -= n;
+            if (!ch->size) ch->state = HTTP_CHUNK_DATA_END;
+            break;
+
+        case HTTP_CHUNK_DATA_END:
+            if (*p == '\n') {
+                ch->state = HTTP_CHUNK_SIZE;
+                ch->digits = 0;
+            } else if (*p != '\r') {
+                return HTTP_PARSE_ERROR;
+            }
+            ++p;
+            break;
+
+        case HTTP_CHUNK_TRAILER:
+            /* Trailer fields end with a blank line, as headers do. */
+            if (*p == '\n') ch->state = HTTP_CHUNK_DONE;
+            else if (*p != '\r') ch->state = HTTP_CHUNK_TRAILER_LINE;
+            ++p;
+            break;
+        }
+    }
+
+    return (int)(p - start);
+}
+
+
+/* Follows a chunked body through the next length bytes of it, as
+ * http_chunked_decode() does, but leaves them as they are. */
+static int http_chunked_scan(struct http_chunked *ch,
+        const char *p, int length) {
+    return http_chunked_decode(ch, (char*)p, length, 0);
+}
+
+#endif
@@ -0,0 +1,307 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A resumable HTTP/1.x header parser.
+ *
+ * http_parse() is called each time more data has been appended to the
+ * request buffer. It picks up where the previous call stopped, so every
+ * byte is scanned once no matter how the request was fragmented. The
+ * method, path, version and headers are recorded as offsets into the
+ * caller's buffer; nothing is copied. Setting state to HTTP_STATUS_LINE
+ * after http_reset() parses a response's status line and headers
+ * instead.
+ *
+ * Line ends and header colons are found 16 bytes at a time with SSE2, or
+ * 32 bytes at a time with AVX2 when the compiler targets it (-mavx2).
+ */
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HTTP_PARSER_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HTTP_PARSER_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static int http_ctz(unsigned int x) {
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+}
+#else
+#define http_ctz(x) __builtin_ctz(x)
+#endif
+
+
+#define HTTP_MAX_HEADERS 32
+
+#define HTTP_PARSE_ERROR (-1)
+#define HTTP_PARSE_INCOMPLETE 0
+#define HTTP_PARSE_DONE 1
+
+enum {HTTP_REQUEST_LINE, HTTP_STATUS_LINE, HTTP_HEADER_LINES, HTTP_COMPLETE};
+
+struct http_span {
+    int offset;
+    int length;
+};
+
+struct http_header {
+    struct http_span name;
+    struct http_span value;
+};
+
+struct http_request {
+    int state;
+    int scan;         /* where the next call resumes scanning */
+    int line_start;   /* start of the line being scanned */
+    int length;       /* bytes up to and including the blank line */
+    struct http_span method;
+    struct http_span path;
+    struct http_span version;
+    int status;       /* for a response */
+    int header_count;
+    struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+
+static void http_reset(struct http_request *req) {
+    req->state = HTTP_REQUEST_LINE;
+    req->scan = 0;
+    req->line_start = 0;
+    req->length = 0;
+    req->header_count = 0;
+}
+
+
+/* Returns a pointer to the first c in [p, end), or 0. */
+static const char *http_find(const char *p, const char *end, char c) {
+#if defined(HTTP_PARSER_AVX2)
+    const __m256i c32 = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int mask = (unsigned int)
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c32));
+        if (mask) return p + http_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(HTTP_PARSER_SSE2)
+    const __m128i c16 = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned int mask = (unsigned int)
+            _mm_movemask_epi8(_mm_cmpeq_epi8(v, c16));
+        if (mask) return p + http_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        if (*p == c) return p;
+        ++p;
+    }
+    return 0;
+}
+
+
+static int http_is_token(const char *p, const char *end) {
+    if (p == end) return 0;
+    while (p < end) {
+        unsigned char c = (unsigned char)*p++;
+        if (c <= ' ' || c >= 127 || c == ':') return 0;
+    }
+    return 1;
+}
+
+
+static int http_parse_request_line(struct http_request *req,
+        const char *buf, const char *line, const char *end) {
+    const char *sp1 = http_find(line, end, ' ');
+    if (!sp1 || !http_is_token(line, sp1)) return HTTP_PARSE_ERROR;
+
+    const char *path = sp1 + 1;
+    const char *sp2 = http_find(path, end, ' ');
+    if (!sp2 || sp2 == path || *path != '/') return HTTP_PARSE_ERROR;
+
+    const char *version = sp2 + 1;
+    if (end - version != 8 || strncmp(version, "HTTP/1.", 7))
+        return HTTP_PARSE_ERROR;
+
+    req->method.offset = (int)(line - buf);
+    req->method.length = (int)(sp1 - line);
+    req->path.offset = (int)(path - buf);
+    req->path.length = (int)(sp2 - path);
+    req->version.offset = (int)(version - buf);
+    req->version.length = 8;
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+
+/* A status line is "HTTP/1.x nnn reason"; the reason may be empty. */
+static int http_parse_status_line(struct http_request *req,
+        const char *buf, const char *line, const char *end) {
+    if (end - line < 12 || strncmp(line, "HTTP/1.", 7) || line[8] != ' ')
+        return HTTP_PARSE_ERROR;
+
+    int i, status = 0;
+    for (i = 9; i < 12; ++i) {
+        if (line[i] < '0' || line[i] > '9') return HTTP_PARSE_ERROR;
+        status = status * 10 + (line[i] - '0');
+    }
+    if (end - line > 12 && line[12] != ' ') return HTTP_PARSE_ERROR;
+
+    req->version.offset = (int)(line - buf);
+    req->version.length = 8;
+    req->status = status;
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+
+static int http_parse_header_line(struct http_request *req,
+        const char *buf, const char *line, const char *end) {
+    const char *colon = http_find(line, end, ':');
+    if (!colon || !http_is_token(line, colon)) return HTTP_PARSE_ERROR;
+    if (req->header_count == HTTP_MAX_HEADERS) return HTTP_PARSE_ERROR;
+
+    const char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) ++value;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) --end;
+
+    struct http_header *h = &req->headers[req->header_count++];
+    h->name.offset = (int)(line - buf);
+    h->name.length = (int)(colon - line);
+    h->value.offset = (int)(value - buf);
+    h->value.length = (int)(end - value);
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+
+/* Parses as much of buf[0..length) as possible. Returns HTTP_PARSE_DONE
+ * once the blank line ending the headers has been seen (req->length is
+ * then the size of the header block), HTTP_PARSE_INCOMPLETE if more data
+ * is needed, or HTTP_PARSE_ERROR for a malformed request. */
+static int http_parse(struct http_request *req,
+        const char *buf, int length) {
+    const char *end = buf + length;
+
+    while (req->state != HTTP_COMPLETE) {
+        const char *lf = http_find(buf + req->scan, end, '\n');
+        if (!lf) {
+            req->scan = length;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        const char *line = buf + req->line_start;
+        const char *line_end = lf;
+        if (line_end > line && line_end[-1] == '\r') --line_end;
+
+        int r;
+        if (req->state == HTTP_REQUEST_LINE) {
+            /* Stray blank lines before a request are ignored. */
+            if (line_end == line) {
+                r = HTTP_PARSE_INCOMPLETE;
+            } else {
+                r = http_parse_request_line(req, buf, line, line_end);
+                req->state = HTTP_HEADER_LINES;
+            }
+        } else if (req->state == HTTP_STATUS_LINE) {
+            r = http_parse_status_line(req, buf, line, line_end);
+            req->state = HTTP_HEADER_LINES;
+        } else if (line_end == line) {
+            req->length = (int)(lf + 1 - buf);
+            req->state = HTTP_COMPLETE;
+            r = HTTP_PARSE_INCOMPLETE;
+        } else {
+            r = http_parse_header_line(req, buf, line, line_end);
+        }
+        if (r == HTTP_PARSE_ERROR) return HTTP_PARSE_ERROR;
+
+        req->line_start = req->scan = (int)(lf + 1 - buf);
+    }
+
+    return HTTP_PARSE_DONE;
+}
+
+
+/* Compares a span with a lower-case string, ignoring case. */
+static int http_span_equals(const char *buf, struct http_span span,
+        const char *s) {
+    int i;
+    for (i = 0; i < span.length; ++i) {
+        char c = buf[span.offset + i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != s[i]) return 0;
+    }
+    return s[i] == 0;
+}
+
+
+/* Checks whether a comma-separated header value such as
+ * "keep-alive, Upgrade" contains token (given in lower case). Parameters
+ * after a ';' are ignored. */
+static int http_span_has_token(const char *buf, struct http_span span,
+        const char *token) {
+    const char *p = buf + span.offset;
+    const char *end = p + span.length;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ';') ++p;
+        const char *stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) --stop;
+
+        struct http_span t;
+        t.offset = (int)(start - buf);
+        t.length = (int)(stop - start);
+        if (t.length && http_span_equals(buf, t, token)) return 1;
+
+        while (p < end && *p != ',') ++p;
+    }
+    return 0;
+}
+
+
+/* Returns the value of the named header (given in lower case), or 0. */
+static const struct http_span *http_get_header(
+        const struct http_request *req, const char *buf, const char *name) {
+    int i;
+    for (i = 0; i < req->header_count; ++i)
+        if (http_span_equals(buf, req->headers[i].name, name))
+            return &req->headers[i].value;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A micro-cache: responses kept for a short time-to-live in one arena
+ * of a fixed size.
+ *
+ * The arena is split into MICRO_PAGE_SIZE pages. Each page is given, on
+ * first need, to one size class and cut into chunks of that class's
+ * size, as memcached's slabs are. Class sizes grow by a quarter from
+ * MICRO_MIN_CHUNK, so an item wastes at most about a fifth of its chunk,
+ * and nothing is allocated per item. Once every page has been given out,
+ * a class that needs a chunk takes back the least recently used item of
+ * its own, so the cache never holds more than its budget.
+ *
+ * An item's chunk holds its header, its key, the response head and the
+ * body, one after the other. An item that is still being sent when it
+ * expires or is evicted is only unlinked; its chunk is reused once the
+ * last reference to it is released.
+ *
+ * The cache isn't locked; it belongs to the one thread that uses it.
+ */
+
+#ifndef MICRO_CACHE_H
+#define MICRO_CACHE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define MICRO_PAGE_SIZE (256 * 1024)
+#define MICRO_MIN_CHUNK 256
+#define MICRO_MAX_CLASSES 40
+#define MICRO_BUCKETS 4096
+
+struct micro_item {
+    struct micro_item *hash_next;   /* or the next free chunk */
+    struct micro_item *lru_prev;
+    struct micro_item *lru_next;
+    unsigned long expires;
+    unsigned long hash;
+    int refs;
+    int linked;
+    int size_class;
+    int key_length;
+    size_t head_length;
+    size_t body_length;
+    char data[1];
+};
+
+struct micro_cache {
+    char *arena;
+    size_t pages;
+    size_t pages_used;
+    int class_count;
+    size_t chunk_size[MICRO_MAX_CLASSES];
+    struct micro_item *free_chunks[MICRO_MAX_CLASSES];
+    struct micro_item *lru_head[MICRO_MAX_CLASSES];
+    struct micro_item *lru_tail[MICRO_MAX_CLASSES];
+    struct micro_item *buckets[MICRO_BUCKETS];
+};
+
+
+/* Sets the cache up with budget bytes of arena. Returns 0 if it can't
+ * be allocated. */
+static int micro_init(struct micro_cache *c, size_t budget) {
+    memset(c, 0, sizeof(*c));
+    c->pages = budget / MICRO_PAGE_SIZE;
+    if (!c->pages) c->pages = 1;
+    c->arena = (char*) malloc(c->pages * MICRO_PAGE_SIZE);
+    if (!c->arena) return 0;
+
+    size_t size = MICRO_MIN_CHUNK;
+    while (size < MICRO_PAGE_SIZE && c->class_count < MICRO_MAX_CLASSES - 1) {
+        c->chunk_size[c->class_count++] = size;
+        size = (size + size / 4 + 15) & ~(size_t)15;
+    }
+    c->chunk_size[c->class_count++] = MICRO_PAGE_SIZE;
+    return 1;
+}
+
+
+static unsigned long micro_hash(const char *key, int length) {
+    unsigned long h = 2166136261UL;
+    int i;
+    for (i = 0; i < length; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+
+static char *micro_head(struct micro_item *it) {
+    return it->data + it->key_length;
+}
+
+static char *micro_body(struct micro_item *it) {
+    return it->data + it->key_length + it->head_length;
+}
+
+
+static void micro_free_chunk(struct micro_cache *c, struct micro_item *it) {
+    it->hash_next = c->free_chunks[it->size_class];
+    c->free_chunks[it->size_class] = it;
+}
+
+
+static void micro_lru_remove(struct micro_cache *c, struct micro_item *it) {
+    if (it->lru_prev) it->lru_prev->lru_next = it->lru_next;
+    else c->lru_head[it->size_class] = it->lru_next;
+    if (it->lru_next) it->lru_next->lru_prev = it->lru_prev;
+    else c->lru_tail[it->size_class] = it->lru_prev;
+}
+
+
+static void micro_lru_push(struct micro_cache *c, struct micro_item *it) {
+    int k = it->size_class;
+    it->lru_prev = 0;
+    it->lru_next = c->lru_head[k];
+    if (c->lru_head[k]) c->lru_head[k]->lru_prev = it;
+    else c->lru_tail[k] = it;
+    c->lru_head[k] = it;
+}
+
+
+/* Takes an item out of the table and its LRU list. */
+static void micro_unlink(struct micro_cache *c, struct micro_item *it) {
+    struct micro_item **p = &c->buckets[it->hash % MICRO_BUCKETS];
+    while (*p != it) p = &(*p)->hash_next;
+    *p = it->hash_next;
+    micro_lru_remove(c, it);
+
+    it->linked = 0;
+    if (!it->refs) micro_free_chunk(c, it);
+}
+
+
+static void micro_release(struct micro_cache *c, struct micro_item *it) {
+    if (--it->refs == 0 && !it->linked) micro_free_chunk(c, it);
+}
+
+
+/* Returns the live item for key, now in milliseconds, or 0. */
+static struct micro_item *micro_find(struct micro_cache *c,
+        const char *key, int length, unsigned long now) {
+    unsigned long hash = micro_hash(key, length);
+    struct micro_item *it = c->buckets[hash % MICRO_BUCKETS];
+    while (it && (it->hash != hash || it->key_length != length ||
+                memcmp(it->data, key, length)))
+        it = it->hash_next;
+    if (!it) return 0;
+
+    if ((long)(now - it->expires) >= 0) {
+        micro_unlink(c, it);
+        return 0;
+    }
+
+    if (it->lru_prev) {
+        micro_lru_remove(c, it);
+        micro_lru_push(c, it);
+    }
+    return it;
+}
+
+
+/* Returns an unlinked item with room for a response with the given head
+ * and body, holding one reference and with its key filled in, or 0 if
+ * it is too big or every chunk it could use is in use. */
+static struct micro_item *micro_alloc(struct micro_cache *c,
+        const char *key, int key_length,
+        size_t head_length, size_t body_length) {
+    size_t size = offsetof(struct micro_item, data) + key_length +
+        head_length + body_length;
+    int k = 0;
+    while (k < c->class_count && c->chunk_size[k] < size) ++k;
+    if (k == c->class_count) return 0;
+
+    if (!c->free_chunks[k] && c->pages_used < c->pages) {
+        char *page = c->arena + c->pages_used++ * MICRO_PAGE_SIZE;
+        size_t i;
+        for (i = 0; i + c->chunk_size[k] <= MICRO_PAGE_SIZE;
+                i += c->chunk_size[k]) {
+            struct micro_item *chunk = (struct micro_item*)(page + i);
+            chunk->size_class = k;
+            micro_free_chunk(c, chunk);
+        }
+    }
+
+    if (!c->free_chunks[k]) {
+        struct micro_item *victim = c->lru_tail[k];
+        while (victim && victim->refs) victim = victim->lru_prev;
+        if (!victim) return 0;
+        micro_unlink(c, victim);
+    }
+
+    struct micro_item *it = c->free_chunks[k];
+    c->free_chunks[k] = it->hash_next;
+    it->hash_next = it->lru_prev = it->lru_next = 0;
+    it->hash = micro_hash(key, key_length);
+    it->refs = 1;
+    it->linked = 0;
+    it->size_class = k;
+    it->key_length = key_length;
+    it->head_length = head_length;
+    it->body_length = body_length;
+    memcpy(it->data, key, key_length);
+    return it;
+}
+
+
+/* Makes a filled-in item the one found for its key until expires,
+ * replacing any item already there. */
+static void micro_insert(struct micro_cache *c, struct micro_item *it,
+        unsigned long expires) {
+    struct micro_item *old = c->buckets[it->hash % MICRO_BUCKETS];
+    while (old && (old->hash != it->hash ||
+                old->key_length != it->key_length ||
+                memcmp(old->data, it->data, it->key_length)))
+        old = old->hash_next;
+    if (old) micro_unlink(c, old);
+
+    it->expires = expires;
+    it->linked = 1;
+    it->hash_next = c->buckets[it->hash % MICRO_BUCKETS];
+    c->buckets[it->hash % MICRO_BUCKETS] = it;
+    micro_lru_push(c, it);
+}
+
+#endif
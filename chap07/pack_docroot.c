@@ -0,0 +1,453 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * pack_docroot packs every file under a directory into one docroot pack
+ * (see docroot_pack.h) for web_server -p. Compressed sidecar files, such
+ * as index.html.gz next to index.html, become variants of their file
+ * rather than files of their own.
+ *
+ * The pack is written to a temporary file and renamed over output, so a
+ * server that reloads it never maps half a pack.
+ *
+ * usage: pack_docroot [directory] [output]
+ */
+
+#if defined(_WIN32)
+#error This program does not support Windows.
+#endif
+
+#include "chap07.h"
+#include "docroot_pack.h"
+#include <dirent.h>
+
+
+const char *get_content_type(const char* path) {
+    const char *last_dot = strrchr(path, '.');
+    if (last_dot) {
+        if (strcmp(last_dot, ".css") == 0) return "text/css";
+        if (strcmp(last_dot, ".csv") == 0) return "text/csv";
+        if (strcmp(last_dot, ".gif") == 0) return "image/gif";
+        if (strcmp(last_dot, ".htm") == 0) return "text/html";
+        if (strcmp(last_dot, ".html") == 0) return "text/html";
+        if (strcmp(last_dot, ".ico") == 0) return "image/x-icon";
+        if (strcmp(last_dot, ".jpeg") == 0) return "image/jpeg";
+        if (strcmp(last_dot, ".jpg") == 0) return "image/jpeg";
+        if (strcmp(last_dot, ".js") == 0) return "application/javascript";
+        if (strcmp(last_dot, ".json") == 0) return "application/json";
+        if (strcmp(last_dot, ".png") == 0) return "image/png";
+        if (strcmp(last_dot, ".pdf") == 0) return "application/pdf";
+        if (strcmp(last_dot, ".svg") == 0) return "image/svg+xml";
+        if (strcmp(last_dot, ".txt") == 0) return "text/plain";
+    }
+
+    return "application/octet-stream";
+}
+
+
+int is_compressible(const char *content_type) {
+    return strncmp(content_type, "text/", 5) == 0 ||
+        strcmp(content_type, "application/javascript") == 0 ||
+        strcmp(content_type, "application/json") == 0 ||
+        strcmp(content_type, "image/svg+xml") == 0;
+}
+
+
+/* The sidecar file suffix of each variant, in pack_encodings order. */
+static const char *suffixes[PACK_VARIANTS] = {"", ".br", ".gz"};
+
+#define MAX_PATH_LENGTH 256
+
+struct file {
+    char path[MAX_PATH_LENGTH];
+    const char *content_type;
+    char *data[PACK_VARIANTS];
+    size_t size[PACK_VARIANTS];
+    time_t mtime[PACK_VARIANTS];
+    uint32_t hash;
+    uint32_t slot;
+};
+
+static struct file *files = 0;
+static uint32_t file_count = 0;
+static uint32_t file_capacity = 0;
+
+/* Everything after the index, built up before the pack is written.
+ * Offsets into it start at data_start. */
+static char *blob = 0;
+static size_t blob_size = 0;
+static size_t blob_capacity = 0;
+static size_t data_start = 0;
+
+
+void *must_realloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+
+uint32_t blob_add(const void *data, size_t length) {
+    if (blob_size + length > blob_capacity) {
+        while (blob_size + length > blob_capacity)
+            blob_capacity = blob_capacity ? blob_capacity * 2 : 65536;
+        blob = (char*) must_realloc(blob, blob_capacity);
+    }
+    memcpy(blob + blob_size, data, length);
+    blob_size += length;
+
+    size_t offset = data_start + blob_size - length;
+    if (offset + length > 0xffffffffU) {
+        fprintf(stderr, "The pack would be larger than 4 GiB.\n");
+        exit(1);
+    }
+    return (uint32_t)offset;
+}
+
+
+uint32_t blob_add_string(const char *s) {
+    return blob_add(s, strlen(s) + 1);
+}
+
+
+/* Reads the regular file name. Returns 0 on success. */
+int read_file(const char *name, char **data, size_t *size, time_t *mtime) {
+    struct stat st;
+    if (stat(name, &st) || (st.st_mode & S_IFMT) != S_IFREG)
+        return -1;
+
+    FILE *fp = fopen(name, "rb");
+    if (!fp) return -1;
+
+    *size = (size_t)st.st_size;
+    *mtime = st.st_mtime;
+    *data = (char*) must_realloc(0, *size ? *size : 1);
+    if (fread(*data, 1, *size, fp) != *size) {
+        fclose(fp);
+        free(*data);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+void add_file(const char *name, const char *path) {
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        fprintf(stderr, "Skipping %s: path too long.\n", name);
+        return;
+    }
+
+    if (file_count == file_capacity) {
+        file_capacity = file_capacity ? file_capacity * 2 : 64;
+        files = (struct file*) must_realloc(files,
+                file_capacity * sizeof(*files));
+    }
+
+    struct file *f = &files[file_count];
+    memset(f, 0, sizeof(*f));
+    strcpy(f->path, path);
+    f->content_type = get_content_type(path);
+    if (read_file(name, &f->data[0], &f->size[0], &f->mtime[0])) {
+        fprintf(stderr, "Skipping %s: can't read it.\n", name);
+        return;
+    }
+
+    if (is_compressible(f->content_type)) {
+        char variant[MAX_PATH_LENGTH + 8];
+        int v;
+        for (v = 1; v < PACK_VARIANTS; ++v) {
+            sprintf(variant, "%s%s", name, suffixes[v]);
+            if (read_file(variant, &f->data[v], &f->size[v], &f->mtime[v]))
+                f->data[v] = 0;
+        }
+    }
+
+    ++file_count;
+}
+
+
+/* Checks whether name is a sidecar of a file next to it. */
+int is_sidecar(const char *name) {
+    size_t length = strlen(name);
+    int v;
+    for (v = 1; v < PACK_VARIANTS; ++v) {
+        size_t s = strlen(suffixes[v]);
+        if (length > s && strcmp(name + length - s, suffixes[v]) == 0) {
+            char base[MAX_PATH_LENGTH + 8];
+            struct stat st;
+            sprintf(base, "%.*s", (int)(length - s), name);
+            if (stat(base, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Adds every file under directory, as paths starting with prefix. */
+void scan(const char *directory, const char *prefix) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        fprintf(stderr, "Can't open %s.\n", directory);
+        exit(1);
+    }
+
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        if (d->d_name[0] == '.') continue;
+
+        char name[MAX_PATH_LENGTH + 8], path[MAX_PATH_LENGTH + 8];
+        if (snprintf(name, MAX_PATH_LENGTH, "%s/%s",
+                    directory, d->d_name) >= MAX_PATH_LENGTH ||
+                snprintf(path, MAX_PATH_LENGTH, "%s/%s",
+                    prefix, d->d_name) >= MAX_PATH_LENGTH) {
+            fprintf(stderr, "Skipping %s/%s: path too long.\n",
+                    directory, d->d_name);
+            continue;
+        }
+
+        struct stat st;
+        if (stat(name, &st)) continue;
+        if ((st.st_mode & S_IFMT) == S_IFDIR)
+            scan(name, path);
+        else if ((st.st_mode & S_IFMT) == S_IFREG && !is_sidecar(name))
+            add_file(name, path);
+    }
+    closedir(dir);
+}
+
+
+static uint32_t bucket_count = 0;
+
+int compare_bucket(const void *a, const void *b) {
+    uint32_t x = ((const struct file*)a)->hash % bucket_count;
+    uint32_t y = ((const struct file*)b)->hash % bucket_count;
+    return (x > y) - (x < y);
+}
+
+
+struct bucket {
+    uint32_t first;
+    uint32_t count;
+    uint32_t index;
+};
+
+int compare_size(const void *a, const void *b) {
+    uint32_t x = ((const struct bucket*)a)->count;
+    uint32_t y = ((const struct bucket*)b)->count;
+    return (x < y) - (x > y);
+}
+
+
+/* Finds a seed for every bucket that sends its files to entries no
+ * other file has taken, largest buckets first. Fills in seeds and each
+ * file's slot. */
+void build_hash(uint32_t *seeds) {
+    uint32_t i, j;
+    for (i = 0; i < file_count; ++i)
+        files[i].hash = pack_hash(files[i].path, strlen(files[i].path), 0);
+    qsort(files, file_count, sizeof(*files), compare_bucket);
+
+    struct bucket *buckets = (struct bucket*)
+        must_realloc(0, bucket_count * sizeof(*buckets));
+    for (i = 0; i < bucket_count; ++i) {
+        buckets[i].count = 0;
+        buckets[i].index = i;
+    }
+    for (i = 0; i < file_count; ++i) {
+        struct bucket *b = &buckets[files[i].hash % bucket_count];
+        if (!b->count) b->first = i;
+        b->count++;
+    }
+    qsort(buckets, bucket_count, sizeof(*buckets), compare_size);
+
+    char *taken = (char*) calloc(file_count, 1);
+    if (!taken) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < bucket_count && buckets[i].count; ++i) {
+        struct bucket *b = &buckets[i];
+        uint32_t seed;
+        for (seed = 1; seed; ++seed) {
+            for (j = 0; j < b->count; ++j) {
+                struct file *f = &files[b->first + j];
+                f->slot = pack_hash(f->path, strlen(f->path), seed) %
+                    file_count;
+                if (taken[f->slot]) break;
+                taken[f->slot] = 1;
+            }
+            if (j == b->count) break;
+
+            /* A collision: give back the entries this seed took. */
+            while (j--)
+                taken[files[b->first + j].slot] = 0;
+        }
+
+        if (!seed) {
+            fprintf(stderr, "Can't build the hash.\n");
+            exit(1);
+        }
+        seeds[b->index] = seed;
+    }
+
+    free(taken);
+    free(buckets);
+}
+
+
+void add_variant(struct pack_variant *pv, const struct file *f, int v) {
+    const char *encoding = pack_encodings[v];
+    char etag[PACK_MAX_ETAG], last_modified[PACK_MAX_DATE];
+    char headers[512];
+
+    /* The ETag comes from the content, so it stays the same for as long
+     * as the file does, whenever the pack is rebuilt. */
+    sprintf(etag, "\"%lx-%08lx\"", (unsigned long)f->size[v],
+            (unsigned long)pack_hash(f->data[v], f->size[v], 0));
+    strftime(last_modified, sizeof(last_modified),
+            "%a, %d %b %Y %H:%M:%S GMT", gmtime(&f->mtime[v]));
+    const char *vary = encoding || is_compressible(f->content_type) ?
+        "Vary: Accept-Encoding\r\n" : "";
+
+    pv->body = blob_add(f->data[v], f->size[v]);
+    pv->body_length = (uint32_t)f->size[v];
+    pv->etag = blob_add_string(etag);
+    pv->last_modified = blob_add_string(last_modified);
+    pv->mtime = (uint32_t)f->mtime[v];
+
+    char *o = headers;
+    o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+    o += sprintf(o, "Content-Length: %lu\r\n", (unsigned long)f->size[v]);
+    o += sprintf(o, "Content-Type: %s\r\n", f->content_type);
+    if (encoding)
+        o += sprintf(o, "Content-Encoding: %s\r\n", encoding);
+    o += sprintf(o, "ETag: %s\r\n", etag);
+    o += sprintf(o, "Last-Modified: %s\r\n", last_modified);
+    o += sprintf(o, "%s", vary);
+    o += sprintf(o, "Accept-Ranges: bytes\r\n");
+    pv->headers = blob_add(headers, o - headers);
+    pv->headers_length = (uint32_t)(o - headers);
+
+    o = headers;
+    o += sprintf(o, "HTTP/1.1 304 Not Modified\r\n");
+    o += sprintf(o, "ETag: %s\r\n", etag);
+    o += sprintf(o, "Last-Modified: %s\r\n", last_modified);
+    o += sprintf(o, "%s", vary);
+    pv->not_modified = blob_add(headers, o - headers);
+    pv->not_modified_length = (uint32_t)(o - headers);
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *directory = argc > 1 ? argv[1] : "public";
+    const char *output = argc > 2 ? argv[2] : "public.pack";
+
+    scan(directory, "");
+
+    bucket_count = file_count ? file_count / 2 + 1 : 0;
+    uint32_t *seeds = (uint32_t*)
+        must_realloc(0, (bucket_count + 1) * sizeof(uint32_t));
+    memset(seeds, 0, (bucket_count + 1) * sizeof(uint32_t));
+    if (file_count) build_hash(seeds);
+
+    struct pack_entry *entries = (struct pack_entry*)
+        calloc(file_count + 1, sizeof(*entries));
+    if (!entries) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    data_start = sizeof(struct pack_header) +
+        bucket_count * sizeof(uint32_t) + file_count * sizeof(*entries);
+
+    uint32_t i;
+    int v;
+    for (i = 0; i < file_count; ++i) {
+        struct file *f = &files[i];
+        struct pack_entry *e = &entries[f->slot];
+        e->hash = f->hash;
+        e->path_length = (uint32_t)strlen(f->path);
+        e->path = blob_add_string(f->path);
+        e->content_type = blob_add_string(f->content_type);
+        for (v = 0; v < PACK_VARIANTS; ++v) {
+            if (!f->data[v]) continue;
+            add_variant(&e->variants[v], f, v);
+            free(f->data[v]);
+        }
+    }
+
+    struct pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.size = (uint32_t)(data_start + blob_size);
+    header.entry_count = file_count;
+    header.bucket_count = bucket_count;
+
+    char temporary[MAX_PATH_LENGTH + 16];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", output);
+    FILE *fp = fopen(temporary, "wb");
+    if (!fp) {
+        fprintf(stderr, "Can't create %s.\n", temporary);
+        return 1;
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(seeds, sizeof(uint32_t), bucket_count, fp);
+    fwrite(entries, sizeof(*entries), file_count, fp);
+    fwrite(blob, 1, blob_size, fp);
+    int failed = ferror(fp);
+    if (fclose(fp)) failed = 1;
+    if (failed || rename(temporary, output)) {
+        fprintf(stderr, "Can't write %s.\n", output);
+        remove(temporary);
+        return 1;
+    }
+
+    /* Read the pack back the way the server will, as a check. */
+    struct pack *pack = pack_open(output);
+    for (i = 0; pack && i < file_count; ++i)
+        if (pack_find(pack, files[i].path, strlen(files[i].path)) !=
+                &pack->entries[files[i].slot])
+            break;
+    if (!pack || i < file_count) {
+        fprintf(stderr, "%s doesn't read back.\n", output);
+        return 1;
+    }
+    pack_close(pack);
+
+    printf("Packed %lu files, %lu bytes, into %s.\n",
+            (unsigned long)file_count, (unsigned long)header.size, output);
+
+    free(seeds);
+    free(entries);
+    free(files);
+    free(blob);
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * parser_bench times http_parse() against the strstr() search that
+ * web_server.c used before, on a corpus of recorded requests. Each request
+ * is fed whole, and again in 8-byte fragments as a slow client would send
+ * it.
+ *
+ * usage: parser_bench [corpus_file]
+ *
+ * A corpus file holds raw requests back to back, each ending with a blank
+ * line.
+ */
+
+#include "http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+static const char *default_corpus[] = {
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", "
+    "\"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8,"
+    "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n",
+
+    "GET /smile.png HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+    "Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-Modified-Since: Fri, 29 Oct 2021 06:12:44 GMT\r\n"
+    "If-None-Match: \"4c1a2-1775-617b90cc\"\r\n"
+    "\r\n",
+
+    "GET /page2.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "*/*;q=0.8\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
+    "AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 "
+    "Safari/605.1.15\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "\r\n",
+
+    "GET /test.txt HTTP/1.0\r\n"
+    "Host: 127.0.0.1\r\n"
+    "User-Agent: ApacheBench/2.3\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+
+
+struct corpus {
+    char **requests;
+    int *lengths;
+    int count;
+};
+
+
+void load_default_corpus(struct corpus *c) {
+    c->count = sizeof(default_corpus) / sizeof(*default_corpus);
+    c->requests = (char**) malloc(c->count * sizeof(char*));
+    c->lengths = (int*) malloc(c->count * sizeof(int));
+    if (!c->requests || !c->lengths) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    int i;
+    for (i = 0; i < c->count; ++i) {
+        c->lengths[i] = (int)strlen(default_corpus[i]);
+        c->requests[i] = (char*) malloc(c->lengths[i] + 1);
+        if (!c->requests[i]) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memcpy(c->requests[i], default_corpus[i], c->lengths[i] + 1);
+    }
+}
+
+
+void load_corpus_file(struct corpus *c, const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Unable to open %s.\n", filename);
+        exit(1);
+    }
+
+    fseek(fp, 0L, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+
+    char *data = (char*) malloc(size + 1);
+    if (!data || fread(data, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "Unable to read %s.\n", filename);
+        exit(1);
+    }
+    data[size] = 0;
+    fclose(fp);
+
+    c->count = 0;
+    c->requests = 0;
+    c->lengths = 0;
+
+    char *p = data;
+    char *end;
+    while ((end = strstr(p, "\r\n\r\n"))) {
+        end += 4;
+        c->requests = (char**) realloc(c->requests,
+                (c->count + 1) * sizeof(char*));
+        c->lengths = (int*) realloc(c->lengths,
+                (c->count + 1) * sizeof(int));
+        if (!c->requests || !c->lengths) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        int length = (int)(end - p);
+        c->requests[c->count] = (char*) malloc(length + 1);
+        if (!c->requests[c->count]) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memcpy(c->requests[c->count], p, length);
+        c->requests[c->count][length] = 0;
+        c->lengths[c->count++] = length;
+        p = end;
+    }
+    free(data);
+
+    if (!c->count) {
+        fprintf(stderr, "No requests found in %s.\n", filename);
+        exit(1);
+    }
+}
+
+
+/* The old web_server.c approach: after each recv(), search the whole
+ * buffer for the blank line, then pick the path out of "GET /path ". */
+int parse_strstr(char *buffer, const char *request, int length, int step) {
+    int received = 0;
+    while (received < length) {
+        int n = length - received < step ? length - received : step;
+        memcpy(buffer + received, request + received, n);
+        received += n;
+        buffer[received] = 0;
+
+        char *q = strstr(buffer, "\r\n\r\n");
+        if (q) {
+            char *path = buffer + 4;
+            char *end_path = strstr(path, " ");
+            return end_path ? (int)(end_path - path) : -1;
+        }
+    }
+    return -1;
+}
+
+
+int parse_incremental(char *buffer, const char *request, int length,
+        int step) {
+    struct http_request req;
+    http_reset(&req);
+
+    int received = 0;
+    while (received < length) {
+        int n = length - received < step ? length - received : step;
+        memcpy(buffer + received, request + received, n);
+        received += n;
+
+        int status = http_parse(&req, buffer, received);
+        if (status == HTTP_PARSE_ERROR) return -1;
+        if (status == HTTP_PARSE_DONE) {
+            /* The server also looks at Connection for every request. */
+            const struct http_span *connection =
+                http_get_header(&req, buffer, "connection");
+            if (connection &&
+                    http_span_has_token(buffer, *connection, "close"))
+                return 0;
+            return req.path.length;
+        }
+    }
+    return -1;
+}
+
+
+double run(const struct corpus *c, int iterations, int step,
+        int (*parse)(char *, const char *, int, int)) {
+    static char buffer[65536];
+    long check = 0;
+
+    clock_t start = clock();
+    int i, j;
+    for (i = 0; i < iterations; ++i)
+        for (j = 0; j < c->count; ++j)
+            check += parse(buffer, c->requests[j], c->lengths[j], step);
+    clock_t end = clock();
+
+    if (check < 0) printf("(parse errors in corpus)\n");
+
+    double seconds = (double)(end - start) / CLOCKS_PER_SEC;
+    return seconds * 1e9 / ((double)iterations * c->count);
+}
+
+
+int main(int argc, char *argv[]) {
+    struct corpus c;
+    if (argc > 1)
+        load_corpus_file(&c, argv[1]);
+    else
+        load_default_corpus(&c);
+
+    long bytes = 0;
+    int i;
+    for (i = 0; i < c.count; ++i) {
+        if (c.lengths[i] >= 65536) {
+            fprintf(stderr, "Request %d is too large.\n", i);
+            return 1;
+        }
+        bytes += c.lengths[i];
+    }
+
+#if defined(HTTP_PARSER_AVX2)
+    const char *simd = "AVX2";
+#elif defined(HTTP_PARSER_SSE2)
+    const char *simd = "SSE2";
+#else
+    const char *simd = "none";
+#endif
+
+    printf("%d requests, %ld bytes average, SIMD: %s\n",
+            c.count, bytes / c.count, simd);
+
+    int iterations = 200000 / c.count + 1;
+
+    printf("%-28s %10s\n", "", "ns/request");
+    printf("%-28s %10.1f\n", "strstr, whole request",
+            run(&c, iterations, 65536, parse_strstr));
+    printf("%-28s %10.1f\n", "http_parse, whole request",
+            run(&c, iterations, 65536, parse_incremental));
+    printf("%-28s %10.1f\n", "strstr, 8-byte fragments",
+            run(&c, iterations / 10 + 1, 8, parse_strstr));
+    printf("%-28s %10.1f\n", "http_parse, 8-byte fragments",
+            run(&c, iterations / 10 + 1, 8, parse_incremental));
+
+    return 0;
+}
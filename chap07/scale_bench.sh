@@ -0,0 +1,28 @@
+#!/bin/sh
+# Measures how web_server2 throughput scales with its number of worker
+# processes. Run from chap07; the servers listen on port 8080.
+#
+# usage: ./scale_bench.sh [requests] [clients] [path]
+
+REQUESTS=${1:-20000}
+CLIENTS=${2:-16}
+URLPATH=${3:-/test.txt}
+CC=${CC:-cc}
+
+${CC} -O2 web_server2.c -o /tmp/scale_web_server2 || exit 1
+${CC} -O2 web_bench.c -o /tmp/scale_web_bench || exit 1
+
+echo "cpus: $(getconf _NPROCESSORS_ONLN)"
+for WORKERS in 1 2 4 8; do
+    /tmp/scale_web_server2 -a $WORKERS > /dev/null &
+    SERVER=$!
+    sleep 1
+    printf "workers=%d " $WORKERS
+    /tmp/scale_web_bench -c $CLIENTS 127.0.0.1 8080 0 $REQUESTS $URLPATH \
+        | tail -n 1
+    pkill -P $SERVER
+    kill $SERVER
+    wait $SERVER 2> /dev/null
+done
+
+rm -f /tmp/scale_web_server2 /tmp/scale_web_bench
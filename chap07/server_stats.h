@@ -0,0 +1,248 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Server counters and a request latency histogram.
+ *
+ * Each thread that serves requests updates its own server_stats, so
+ * counting never shares a cache line with another thread and needs no
+ * locked instructions. stats_format() adds up every registered
+ * server_stats when a report is asked for.
+ *
+ * Latencies are kept in microseconds in a log-linear histogram, as HDR
+ * histograms do: values under STATS_SUB are counted exactly, and each
+ * power of two above that is split into STATS_SUB buckets, so any value
+ * is recorded to within 1/STATS_SUB of itself.
+ */
+
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_BIT 30
+#define STATS_BUCKETS ((STATS_MAX_BIT - STATS_SUB_BITS + 2) * STATS_SUB)
+#define STATS_MAX_THREADS 16
+
+/* Each counter has one writer. Other threads only read them, and the
+ * relaxed accesses just keep those reads from being torn. */
+#if defined(_MSC_VER)
+#define stats_load(p) (*(volatile unsigned long*)(p))
+#define stats_add(p, n) (*(volatile unsigned long*)(p) += (n))
+#else
+#define stats_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define stats_add(p, n) \
+    __atomic_store_n((p), *(p) + (n), __ATOMIC_RELAXED)
+#endif
+
+/* Responses are counted by status, in these groups. */
+enum {
+    STATS_200,
+    STATS_206,
+    STATS_304,
+    STATS_400,
+    STATS_404,
+    STATS_416,
+    STATS_502,
+    STATS_503,
+    STATS_504,
+    STATS_OTHER,
+    STATS_STATUSES
+};
+
+static const char *stats_status_names[STATS_STATUSES] = {
+    "200", "206", "304", "400", "404", "416", "502", "503", "504",
+    "other"
+};
+
+struct server_stats {
+    unsigned long accepted;
+    unsigned long closed;
+    unsigned long dropped;
+    unsigned long statuses[STATS_STATUSES];
+    unsigned long bytes_sent;
+    unsigned long upstream_connects;
+    unsigned long upstream_reuses;
+    unsigned long micro_hits;
+    unsigned long micro_coalesced;
+    unsigned long loops;
+    unsigned long latency[STATS_BUCKETS];
+    char pad[64];
+};
+
+static struct server_stats *stats_threads[STATS_MAX_THREADS];
+static int stats_thread_count = 0;
+static time_t stats_started = 0;
+
+
+static void stats_add_thread(struct server_stats *s) {
+    memset(s, 0, sizeof(*s));
+    if (!stats_started) stats_started = time(0);
+    if (stats_thread_count < STATS_MAX_THREADS)
+        stats_threads[stats_thread_count++] = s;
+}
+
+
+/* A monotonic clock in microseconds. */
+static unsigned long stats_now_us() {
+#if defined(_WIN32)
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (unsigned long)(now.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL +
+        (unsigned long)(ts.tv_nsec / 1000);
+#endif
+}
+
+
+static int stats_bucket(unsigned long us) {
+    if (us < STATS_SUB) return (int)us;
+    if (us >= 1UL << STATS_MAX_BIT) us = (1UL << STATS_MAX_BIT) - 1;
+
+    int bit = STATS_SUB_BITS;
+    while (us >> (bit + 1)) ++bit;
+    return (bit - STATS_SUB_BITS + 1) * STATS_SUB +
+        (int)((us >> (bit - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+
+/* The highest value that falls in bucket i. */
+static unsigned long stats_bucket_max(int i) {
+    if (i < STATS_SUB) return (unsigned long)i;
+    int shift = i / STATS_SUB - 1;
+    unsigned long low = (unsigned long)(STATS_SUB + i % STATS_SUB) << shift;
+    return low + (1UL << shift) - 1;
+}
+
+
+static void stats_latency(struct server_stats *s, unsigned long us) {
+    stats_add(&s->latency[stats_bucket(us)], 1);
+}
+
+
+static void stats_status(struct server_stats *s, int status) {
+    int i;
+    switch (status) {
+        case 200: i = STATS_200; break;
+        case 206: i = STATS_206; break;
+        case 304: i = STATS_304; break;
+        case 400: i = STATS_400; break;
+        case 404: i = STATS_404; break;
+        case 416: i = STATS_416; break;
+        case 502: i = STATS_502; break;
+        case 503: i = STATS_503; break;
+        case 504: i = STATS_504; break;
+        default: i = STATS_OTHER;
+    }
+    stats_add(&s->statuses[i], 1);
+}
+
+
+/* Writes a plain text report of every thread's counters, added up, into
+ * buffer. Returns its length. */
+static int stats_format(char *buffer) {
+    static struct server_stats total;
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    int i, t;
+
+    memset(&total, 0, sizeof(total));
+    for (t = 0; t < stats_thread_count; ++t) {
+        struct server_stats *s = stats_threads[t];
+        total.accepted += stats_load(&s->accepted);
+        total.closed += stats_load(&s->closed);
+        total.dropped += stats_load(&s->dropped);
+        for (i = 0; i < STATS_STATUSES; ++i)
+            total.statuses[i] += stats_load(&s->statuses[i]);
+        total.bytes_sent += stats_load(&s->bytes_sent);
+        total.upstream_connects += stats_load(&s->upstream_connects);
+        total.upstream_reuses += stats_load(&s->upstream_reuses);
+        total.micro_hits += stats_load(&s->micro_hits);
+        total.micro_coalesced += stats_load(&s->micro_coalesced);
+        total.loops += stats_load(&s->loops);
+        for (i = 0; i < STATS_BUCKETS; ++i)
+            total.latency[i] += stats_load(&s->latency[i]);
+    }
+
+    char *o = buffer;
+    o += sprintf(o, "uptime %lu\n", (unsigned long)(time(0) - stats_started));
+    o += sprintf(o, "connections_accepted %lu\n", total.accepted);
+    o += sprintf(o, "connections_active %lu\n",
+            total.accepted - total.closed);
+    o += sprintf(o, "connections_dropped %lu\n", total.dropped);
+    for (i = 0; i < STATS_STATUSES; ++i)
+        o += sprintf(o, "responses_%s %lu\n",
+                stats_status_names[i], total.statuses[i]);
+    o += sprintf(o, "bytes_sent %lu\n", total.bytes_sent);
+    o += sprintf(o, "upstream_connects %lu\n", total.upstream_connects);
+    o += sprintf(o, "upstream_reuses %lu\n", total.upstream_reuses);
+    o += sprintf(o, "micro_cache_hits %lu\n", total.micro_hits);
+    o += sprintf(o, "micro_cache_coalesced %lu\n", total.micro_coalesced);
+    o += sprintf(o, "loop_iterations %lu\n", total.loops);
+
+    unsigned long count = 0;
+    for (i = 0; i < STATS_BUCKETS; ++i) count += total.latency[i];
+    o += sprintf(o, "latency_us_count %lu\n", count);
+
+    size_t p;
+    for (p = 0; p < sizeof(percentiles) / sizeof(*percentiles); ++p) {
+        unsigned long rank = (unsigned long)
+            (count * percentiles[p] / 100.0 + 0.5);
+        unsigned long seen = 0;
+        unsigned long value = 0;
+        for (i = 0; i < STATS_BUCKETS && count; ++i) {
+            seen += total.latency[i];
+            if (seen >= rank) {
+                value = stats_bucket_max(i);
+                break;
+            }
+        }
+        o += sprintf(o, "latency_us_p%g %lu\n", percentiles[p], value);
+    }
+
+    unsigned long max = 0;
+    for (i = STATS_BUCKETS - 1; i >= 0; --i) {
+        if (total.latency[i]) {
+            max = stats_bucket_max(i);
+            break;
+        }
+    }
+    o += sprintf(o, "latency_us_max %lu\n", max);
+
+    return (int)(o - buffer);
+}
+
+#endif
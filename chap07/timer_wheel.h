@@ -0,0 +1,244 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A hierarchical timing wheel.
+ *
+ * Time is counted in ticks of TIMER_TICK_MS. Level 0 has one slot per
+ * tick for the next TIMER_SLOTS ticks; each higher level has slots
+ * TIMER_SLOTS times as wide. A timer is filed in the lowest level whose
+ * span reaches its deadline, and it moves down a level each time the
+ * level below wraps around. Arming and cancelling a timer are O(1), and
+ * timers aren't touched again until their slot comes up.
+ *
+ * timer_advance() moves the wheel up to the current time and collects the
+ * timers that have run out in timer_expired, where the caller picks them
+ * up. timer_next_ms() says how long the caller can sleep before the wheel
+ * next needs advancing.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+
+#define TIMER_TICK_MS 10
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+
+/* Timers live on circular lists, so one can be unlinked from whichever
+ * slot it is in without searching. A timer that isn't armed points at
+ * itself. */
+struct timer {
+    unsigned long expires;
+    struct timer *next;
+    struct timer *prev;
+    void *data;
+};
+
+static struct timer timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static struct timer timer_expired;
+static unsigned long timer_base;
+static int timer_count;
+
+
+static unsigned long timer_now_ticks() {
+#if defined(_WIN32)
+    return (unsigned long)(GetTickCount64() / TIMER_TICK_MS);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * (1000 / TIMER_TICK_MS) +
+        (unsigned long)(ts.tv_nsec / (TIMER_TICK_MS * 1000000L));
+#endif
+}
+
+
+static void timer_list_init(struct timer *list) {
+    list->next = list->prev = list;
+}
+
+
+static void timer_init_wheel() {
+    int level, slot;
+    for (level = 0; level < TIMER_LEVELS; ++level)
+        for (slot = 0; slot < TIMER_SLOTS; ++slot)
+            timer_list_init(&timer_wheel[level][slot]);
+    timer_list_init(&timer_expired);
+    timer_base = timer_now_ticks();
+    timer_count = 0;
+}
+
+
+static void timer_init(struct timer *t, void *data) {
+    timer_list_init(t);
+    t->data = data;
+}
+
+
+static void timer_link(struct timer *list, struct timer *t) {
+    t->prev = list->prev;
+    t->next = list;
+    list->prev->next = t;
+    list->prev = t;
+}
+
+
+static void timer_file(struct timer *t) {
+    unsigned long delta = t->expires - timer_base;
+    int level = 0;
+
+    if ((long)delta < 0) {
+        t->expires = timer_base;
+        delta = 0;
+    }
+    while (level < TIMER_LEVELS - 1 &&
+            delta >= 1UL << ((level + 1) * TIMER_BITS))
+        ++level;
+
+    /* Anything past the top level's span waits at its far end. */
+    if (delta >= 1UL << (TIMER_LEVELS * TIMER_BITS)) {
+        delta = (1UL << (TIMER_LEVELS * TIMER_BITS)) - 1;
+        t->expires = timer_base + delta;
+    }
+
+    timer_link(&timer_wheel[level][
+            (t->expires >> (level * TIMER_BITS)) & TIMER_MASK], t);
+}
+
+
+static void timer_cancel(struct timer *t) {
+    if (t->next == t) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    timer_list_init(t);
+    --timer_count;
+}
+
+
+/* Arms t to run out ms milliseconds from now, replacing any earlier
+ * deadline. */
+static void timer_set(struct timer *t, long ms) {
+    timer_cancel(t);
+    t->expires = timer_base + (unsigned long)
+        ((ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    timer_file(t);
+    ++timer_count;
+}
+
+
+/* Moves every timer in a higher level slot down to where it now
+ * belongs. */
+static void timer_cascade(int level, int slot) {
+    struct timer list;
+    struct timer *head = &timer_wheel[level][slot];
+    if (head->next == head) return;
+
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    timer_list_init(head);
+
+    while (list.next != &list) {
+        struct timer *t = list.next;
+        list.next = t->next;
+        t->next->prev = &list;
+        timer_file(t);
+    }
+}
+
+
+/* Runs the wheel forward to the current time. Timers that have run out
+ * are moved to timer_expired, still armed; the caller should
+ * timer_cancel() or timer_set() each one it takes from there. */
+static void timer_advance() {
+    unsigned long now = timer_now_ticks();
+
+    if (!timer_count) {
+        timer_base = now;
+        return;
+    }
+
+    while ((long)(now - timer_base) >= 0) {
+        int level;
+        for (level = 1; level < TIMER_LEVELS &&
+                !(timer_base & ((1UL << (level * TIMER_BITS)) - 1)); ++level)
+            timer_cascade(level,
+                    (int)((timer_base >> (level * TIMER_BITS)) & TIMER_MASK));
+
+        struct timer *head = &timer_wheel[0][timer_base & TIMER_MASK];
+        while (head->next != head) {
+            struct timer *t = head->next;
+            t->prev->next = t->next;
+            t->next->prev = t->prev;
+            timer_link(&timer_expired, t);
+        }
+        ++timer_base;
+    }
+}
+
+
+/* Returns the milliseconds until the wheel next has work to do, or -1 if
+ * no timers are armed. A slot in a higher level is due when it has to be
+ * cascaded, which may be before its timers run out. */
+static long timer_next_ms() {
+    if (timer_expired.next != &timer_expired) return 0;
+    if (!timer_count) return -1;
+
+    unsigned long next = 0;
+    int found = 0;
+    int level, i;
+
+    for (level = 0; level < TIMER_LEVELS; ++level) {
+        int shift = level * TIMER_BITS;
+        unsigned long index = timer_base >> shift;
+        /* A level 0 slot holds one tick. A higher level's current slot
+         * was cascaded when the wheel reached it, so its next turn is a
+         * full rotation away. */
+        int first = level ? 1 : 0;
+        for (i = first; i < first + TIMER_SLOTS; ++i) {
+            struct timer *head =
+                &timer_wheel[level][(index + i) & TIMER_MASK];
+            if (head->next == head) continue;
+
+            unsigned long due = (index + i) << shift;
+            if (!found || (long)(due - next) < 0) next = due;
+            found = 1;
+            break;
+        }
+    }
+
+    long ticks = (long)(next - timer_now_ticks());
+    return ticks > 0 ? ticks * TIMER_TICK_MS : 0;
+}
+
+#endif
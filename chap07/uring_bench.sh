@@ -0,0 +1,49 @@
+#!/bin/sh
+# Compares web_server_uring with web_server built for select(), serving
+# the same public/ tree: fresh connections from several clients, one
+# kept-alive connection, and fresh connections with many idle ones open.
+# Run from chap07; the servers listen on port 8080. If strace is
+# installed, it also counts each server's system calls.
+#
+# usage: ./uring_bench.sh [requests] [clients] [idle] [path]
+
+REQUESTS=${1:-20000}
+CLIENTS=${2:-16}
+IDLE=${3:-500}
+URLPATH=${4:-/test.txt}
+CC=${CC:-cc}
+
+${CC} -O2 -DUSE_SELECT web_server.c -o /tmp/uring_bench_select || exit 1
+${CC} -O2 web_server_uring.c -o /tmp/uring_bench_uring || exit 1
+${CC} -O2 web_bench.c -o /tmp/uring_bench_client || exit 1
+
+if command -v strace > /dev/null; then
+    TRACE="strace -c -f -o /tmp/uring_bench_strace.txt"
+fi
+
+for SERVER in select uring; do
+    $TRACE /tmp/uring_bench_$SERVER > /tmp/uring_bench_$SERVER.log &
+    PID=$!
+    sleep 1
+
+    printf "%-6s %-11s " $SERVER "clients=$CLIENTS"
+    /tmp/uring_bench_client -c $CLIENTS 127.0.0.1 8080 0 $REQUESTS $URLPATH \
+        | tail -n 1
+    printf "%-6s %-11s " $SERVER "keep-alive"
+    /tmp/uring_bench_client -k 127.0.0.1 8080 0 $REQUESTS $URLPATH \
+        | tail -n 1
+    printf "%-6s %-11s " $SERVER "idle=$IDLE"
+    /tmp/uring_bench_client 127.0.0.1 8080 $IDLE $REQUESTS $URLPATH \
+        | tail -n 1
+
+    pkill -TERM -f "^/tmp/uring_bench_$SERVER"
+    wait $PID 2> /dev/null
+
+    grep "io_uring_enter" /tmp/uring_bench_$SERVER.log
+    if [ -n "$TRACE" ]; then
+        printf "%s: " $SERVER
+        tail -n 1 /tmp/uring_bench_strace.txt
+    fi
+done
+
+rm -f /tmp/uring_bench_select /tmp/uring_bench_uring /tmp/uring_bench_client
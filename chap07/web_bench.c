@@ -0,0 +1,479 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * web_bench opens a number of idle connections to a web server and then
+ * times a series of requests made on fresh connections. Each request wakes
+ * the server's event loop, so the per-request latency shows how much the
+ * idle connections cost the loop.
+ *
+ * With -k, the requests are all made on one kept-alive connection
+ * instead. With -c, that many client processes share the requests, each
+ * making its share one after another.
+ *
+ * With -r, each connection reads at most that many bytes a second through
+ * a small receive buffer, like a client on a slow link. With -j, the
+ * results are printed as one JSON object. With -s, every connection,
+ * idle ones included, is made over TLS; this needs a build with
+ * -DUSE_TLS ... -lssl -lcrypto.
+ *
+ * usage: web_bench [-k] [-j] [-s] [-c clients] [-r bytes_per_second]
+ *                  host port idle_connections requests [path]
+ */
+
+#if defined(_WIN32)
+#error This program does not support Windows.
+#endif
+
+#include "chap07.h"
+#include <time.h>
+#include <sys/wait.h>
+
+#if defined(USE_TLS)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* TLS sessions are kept by socket, so the sockets can still be passed
+ * around on their own. */
+#define MAX_TLS_SOCKETS 65536
+static SSL_CTX *tls_context = 0;
+static SSL *tls_sessions[MAX_TLS_SOCKETS];
+#endif
+
+static long read_rate = 0;
+
+
+double now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+SOCKET connect_to_server(struct addrinfo *peer_address, int index) {
+    SOCKET s = socket(peer_address->ai_family,
+            peer_address->ai_socktype, peer_address->ai_protocol);
+    if (!ISVALIDSOCKET(s)) {
+        fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+
+    /* One loopback source address only has ~28k ephemeral ports, so
+     * spread very large idle sets over 127.0.0.2, 127.0.0.3, ... */
+    if (index >= 0 && peer_address->ai_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)peer_address->ai_addr;
+        if (ntohl(sin->sin_addr.s_addr) == 0x7f000001 && index >= 20000) {
+            struct sockaddr_in local;
+            memset(&local, 0, sizeof(local));
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(0x7f000001 + index / 20000);
+            if (bind(s, (struct sockaddr*)&local, sizeof(local))) {
+                fprintf(stderr, "bind() failed. (%d)\n", GETSOCKETERRNO());
+                exit(1);
+            }
+        }
+    }
+
+    /* A small receive buffer keeps a slow reader from taking the whole
+     * response into the kernel at once. */
+    if (read_rate) {
+        int size = 16384;
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+    }
+
+    if (connect(s, peer_address->ai_addr, peer_address->ai_addrlen)) {
+        fprintf(stderr, "connect() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+
+#if defined(USE_TLS)
+    if (tls_context) {
+        SSL *ssl = s < MAX_TLS_SOCKETS ? SSL_new(tls_context) : 0;
+        if (!ssl) {
+            fprintf(stderr, "SSL_new() failed.\n");
+            exit(1);
+        }
+        SSL_set_fd(ssl, s);
+        if (SSL_connect(ssl) != 1) {
+            fprintf(stderr, "SSL_connect() failed.\n");
+            ERR_print_errors_fp(stderr);
+            exit(1);
+        }
+        tls_sessions[s] = ssl;
+    }
+#endif
+    return s;
+}
+
+
+int send_request(SOCKET s, const char *request) {
+#if defined(USE_TLS)
+    if (tls_sessions[s])
+        return SSL_write(tls_sessions[s], request, (int)strlen(request));
+#endif
+    return send(s, request, strlen(request), 0);
+}
+
+
+int receive(SOCKET s, char *buffer, int length) {
+#if defined(USE_TLS)
+    if (tls_sessions[s])
+        return SSL_read(tls_sessions[s], buffer, length);
+#endif
+    return recv(s, buffer, length, 0);
+}
+
+
+void disconnect(SOCKET s) {
+#if defined(USE_TLS)
+    if (tls_sessions[s]) {
+        SSL_shutdown(tls_sessions[s]);
+        SSL_free(tls_sessions[s]);
+        tls_sessions[s] = 0;
+    }
+#endif
+    CLOSESOCKET(s);
+}
+
+
+/* With -r, waits until received bytes are due since t0. */
+void throttle(double t0, long received) {
+    if (!read_rate) return;
+    double due = t0 + received * 1e6 / read_rate;
+    double now = now_usec();
+    if (due > now)
+        usleep((useconds_t)(due - now));
+}
+
+
+/* Reads one response with a Content-Length body from s. Returns the
+ * number of bytes read, or -1 if the connection closed first. */
+long read_response(SOCKET s, double t0) {
+    char buffer[4096];
+    long received = 0;
+    long total = -1;
+
+    while (total < 0 || received < total) {
+        int r = receive(s, buffer + (total < 0 ? received : 0),
+                total < 0 ? (int)(sizeof(buffer) - 1 - received)
+                : (int)sizeof(buffer));
+        if (r < 1) return -1;
+        received += r;
+        throttle(t0, received);
+
+        if (total < 0) {
+            buffer[received] = 0;
+            char *end = strstr(buffer, "\r\n\r\n");
+            if (!end) {
+                if (received == (long)sizeof(buffer) - 1) return -1;
+                continue;
+            }
+            char *cl = strstr(buffer, "Content-Length: ");
+            if (!cl || cl > end) return -1;
+            total = (end - buffer) + 4 + atol(cl + 16);
+        }
+    }
+    return received;
+}
+
+
+/* Makes count requests one after another, storing the latency of each.
+ * Returns the number of response bytes received. */
+long run_requests(struct addrinfo *peer_address, const char *request,
+        int keep_alive, int count, double *latency) {
+    long total_bytes = 0;
+    SOCKET s = keep_alive ? connect_to_server(peer_address, -1) : -1;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        double t0 = now_usec();
+
+        if (keep_alive) {
+            send_request(s, request);
+            long r = read_response(s, t0);
+            if (r < 0) {
+                /* The server closed the connection; open another. */
+                disconnect(s);
+                s = connect_to_server(peer_address, -1);
+                send_request(s, request);
+                r = read_response(s, t0);
+                if (r < 0) {
+                    fprintf(stderr, "Connection closed by server.\n");
+                    exit(1);
+                }
+            }
+            total_bytes += r;
+
+        } else {
+            s = connect_to_server(peer_address, -1);
+            send_request(s, request);
+
+            char buffer[4096];
+            long received = 0;
+            int r;
+            while ((r = receive(s, buffer, sizeof(buffer))) > 0) {
+                received += r;
+                throttle(t0, received);
+            }
+            total_bytes += received;
+
+            disconnect(s);
+        }
+
+        latency[i] = now_usec() - t0;
+    }
+
+    if (keep_alive)
+        disconnect(s);
+
+    return total_bytes;
+}
+
+
+/* Runs count requests split over clients processes. Each child sends its
+ * byte count and latencies back through its own pipe. */
+long run_clients(struct addrinfo *peer_address, const char *request,
+        int keep_alive, int count, int clients, double *latency) {
+    fflush(stdout);
+
+    int *pipes = (int*) calloc(clients, sizeof(int));
+    if (!pipes) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    int i;
+    for (i = 0; i < clients; ++i) {
+        int first = (int)((long)count * i / clients);
+        int share = (int)((long)count * (i + 1) / clients) - first;
+
+        int fds[2];
+        if (pipe(fds)) {
+            fprintf(stderr, "pipe() failed. (%d)\n", errno);
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork() failed. (%d)\n", errno);
+            exit(1);
+        }
+
+        if (pid == 0) {
+            close(fds[0]);
+            long bytes = run_requests(peer_address, request, keep_alive,
+                    share, latency + first);
+            if (write(fds[1], &bytes, sizeof(bytes)) != sizeof(bytes))
+                exit(1);
+            const char *p = (const char*)(latency + first);
+            size_t left = share * sizeof(double);
+            while (left) {
+                ssize_t w = write(fds[1], p, left);
+                if (w < 1) exit(1);
+                p += w;
+                left -= w;
+            }
+            exit(0);
+        }
+
+        close(fds[1]);
+        pipes[i] = fds[0];
+    }
+
+    long total_bytes = 0;
+    for (i = 0; i < clients; ++i) {
+        int first = (int)((long)count * i / clients);
+        int share = (int)((long)count * (i + 1) / clients) - first;
+
+        long bytes = 0;
+        char *p = (char*)(latency + first);
+        size_t left = share * sizeof(double);
+        if (read(pipes[i], &bytes, sizeof(bytes)) != sizeof(bytes)) {
+            fprintf(stderr, "Client %d failed.\n", i);
+            exit(1);
+        }
+        while (left) {
+            ssize_t r = read(pipes[i], p, left);
+            if (r < 1) {
+                fprintf(stderr, "Client %d failed.\n", i);
+                exit(1);
+            }
+            p += r;
+            left -= r;
+        }
+        total_bytes += bytes;
+        close(pipes[i]);
+    }
+
+    while (wait(0) > 0);
+    free(pipes);
+    return total_bytes;
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int keep_alive = 0;
+    int json = 0;
+    int tls = 0;
+    int clients = 1;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-k") == 0) {
+            keep_alive = 1;
+        } else if (strcmp(argv[1], "-j") == 0) {
+            json = 1;
+        } else if (strcmp(argv[1], "-s") == 0) {
+            tls = 1;
+        } else if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+            clients = atoi(argv[2]);
+            --argc;
+            ++argv;
+        } else if (strcmp(argv[1], "-r") == 0 && argc > 2) {
+            read_rate = atol(argv[2]);
+            --argc;
+            ++argv;
+        } else {
+            break;
+        }
+        --argc;
+        ++argv;
+    }
+
+    if (argc < 5) {
+        fprintf(stderr, "usage: web_bench [-k] [-j] [-s] [-c clients] "
+                "[-r bytes_per_second] host port idle_connections requests "
+                "[path]\n");
+        return 1;
+    }
+
+    if (tls) {
+#if defined(USE_TLS)
+        SSL_library_init();
+        SSL_load_error_strings();
+        tls_context = SSL_CTX_new(TLS_client_method());
+        if (!tls_context) {
+            fprintf(stderr, "SSL_CTX_new() failed.\n");
+            return 1;
+        }
+#else
+        fprintf(stderr, "-s needs a build with -DUSE_TLS.\n");
+        return 1;
+#endif
+    }
+
+    const char *host = argv[1];
+    const char *port = argv[2];
+    int idle_count = atoi(argv[3]);
+    int request_count = atoi(argv[4]);
+    const char *path = argc > 5 ? argv[5] : "/test.txt";
+
+    if (idle_count < 0 || request_count < 1 ||
+            clients < 1 || clients > request_count || read_rate < 0) {
+        fprintf(stderr, "Invalid connection, request or client count.\n");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *peer_address;
+    if (getaddrinfo(host, port, &hints, &peer_address)) {
+        fprintf(stderr, "getaddrinfo() failed.\n");
+        return 1;
+    }
+
+    if (!json)
+        printf("Opening %d idle connections...\n", idle_count);
+    SOCKET *idle = (SOCKET*) calloc(idle_count + 1, sizeof(SOCKET));
+    double *latency = (double*) calloc(request_count, sizeof(double));
+    if (!idle || !latency) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    int i;
+    for (i = 0; i < idle_count; ++i)
+        idle[i] = connect_to_server(peer_address, i);
+
+    /* Give the server a moment to accept the backlog. */
+    sleep(1);
+
+    char request[512];
+    snprintf(request, sizeof(request),
+            "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+            path, host, keep_alive ? "keep-alive" : "close");
+
+    if (!json)
+        printf("Sending %d requests...\n", request_count);
+    double start = now_usec();
+
+    long total_bytes = clients > 1 ?
+        run_clients(peer_address, request, keep_alive,
+                request_count, clients, latency) :
+        run_requests(peer_address, request, keep_alive,
+                request_count, latency);
+
+    double elapsed = now_usec() - start;
+
+    qsort(latency, request_count, sizeof(double), compare_double);
+    double sum = 0;
+    for (i = 0; i < request_count; ++i)
+        sum += latency[i];
+
+    double rate = request_count / (elapsed / 1e6);
+    double mean = sum / request_count;
+    double p50 = latency[request_count / 2];
+    double p99 = latency[(int)(request_count * 0.99)];
+    double p999 = latency[(int)(request_count * 0.999)];
+    double max = latency[request_count - 1];
+
+    if (json) {
+        printf("{\"idle\": %d, \"requests\": %d, \"clients\": %d, "
+                "\"bytes\": %ld, \"req_s\": %.0f, \"mean_us\": %.1f, "
+                "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+                "\"max_us\": %.1f}\n",
+                idle_count, request_count, clients, total_bytes,
+                rate, mean, p50, p99, p999, max);
+    } else {
+        printf("idle=%d requests=%d clients=%d bytes=%ld\n",
+                idle_count, request_count, clients, total_bytes);
+        printf("req/s=%.0f mean=%.1fus p50=%.1fus p99=%.1fus "
+                "p99.9=%.1fus max=%.1fus\n",
+                rate, mean, p50, p99, p999, max);
+    }
+
+    for (i = 0; i < idle_count; ++i)
+        disconnect(idle[i]);
+
+    free(idle);
+    free(latency);
+    freeaddrinfo(peer_address);
+    return 0;
+}
@@ -22,7 +22,32 @@
  * SOFTWARE.
  */
 
+/* For accept4(). */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "chap07.h"
+#include "http_parser.h"
+#include "http_chunked.h"
+#include "timer_wheel.h"
+#include "access_log.h"
+#include "server_stats.h"
+#include "buffer_pool.h"
+#include "micro_cache.h"
+#include "websocket.h"
+#if defined(USE_PACK)
+#include "docroot_pack.h"
+#endif
+
+#if defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
 
 
 const char *get_content_type(const char* path) {
@@ -48,6 +73,121 @@ const char *get_content_type(const char* path) {
 }
 
 
+/* Text formats shrink several times over when compressed; images and
+ * PDFs are compressed already. */
+int is_compressible(const char *content_type) {
+    return strncmp(content_type, "text/", 5) == 0 ||
+        strcmp(content_type, "application/javascript") == 0 ||
+        strcmp(content_type, "application/json") == 0 ||
+        strcmp(content_type, "image/svg+xml") == 0;
+}
+
+
+/* Content codings in order of preference, and the suffix of the sidecar
+ * file that holds a precompressed copy, as in index.html.gz. */
+struct encoding {
+    const char *name;
+    const char *suffix;
+};
+
+static const struct encoding encodings[] = {
+    {"br", ".br"},
+    {"gzip", ".gz"},
+};
+
+#define ENCODINGS (sizeof(encodings) / sizeof(*encodings))
+
+
+/* Builds the file name of path, plus an optional suffix, under public. */
+void get_full_path(char *full_path, const char *path, const char *suffix) {
+    sprintf(full_path, "public%s%s", path, suffix);
+
+#if defined(_WIN32)
+    char *p = full_path;
+    while (*p) {
+        if (*p == '/') *p = '\\';
+        ++p;
+    }
+#endif
+}
+
+
+/* What a response says about the file it came from. The ETag is built
+ * from the inode, size and modification time, so it changes whenever
+ * the file is rewritten or replaced. */
+struct file_info {
+    size_t size;
+    time_t mtime;
+    char etag[64];
+    char last_modified[32];
+};
+
+
+void format_http_date(char *buffer, size_t size, time_t t) {
+    strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+}
+
+
+/* Parses an HTTP date in the preferred format, such as
+ * "Sun, 06 Nov 1994 08:49:37 GMT". Returns -1 for anything else. */
+time_t parse_http_date(const char *date, int length) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char text[64], month[4];
+    int day, year, hour, minute, second;
+
+    if (length >= (int)sizeof(text)) return -1;
+    memcpy(text, date, length);
+    text[length] = 0;
+
+    if (sscanf(text, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+                &day, month, &year, &hour, &minute, &second) != 6)
+        return -1;
+
+    const char *m = strstr(months, month);
+    if (!m || (m - months) % 3 || strlen(month) != 3) return -1;
+    int mon = (int)(m - months) / 3 + 1;
+
+    /* Days since 1970-01-01 in the proleptic Gregorian calendar. */
+    int y = year - (mon <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = (long)era * 146097 + doe - 719468;
+
+    return (time_t)(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+
+/* Fills in info for a regular file. Returns 0 on success, or -1 if
+ * there is no such file. */
+int get_file_info(const char *full_path, struct file_info *info) {
+    struct stat st;
+    if (stat(full_path, &st) || (st.st_mode & S_IFMT) != S_IFREG)
+        return -1;
+
+    info->size = (size_t)st.st_size;
+    info->mtime = st.st_mtime;
+    sprintf(info->etag, "\"%lx-%lx-%lx\"", (unsigned long)st.st_ino,
+            (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+    format_http_date(info->last_modified, sizeof(info->last_modified),
+            st.st_mtime);
+    return 0;
+}
+
+
+/* Writes the headers that a 200 and a 304 response for the same file
+ * share. Returns the end of what was written. */
+char *write_validators(char *o, const struct file_info *info,
+        const char *content_type, const char *encoding) {
+    o += sprintf(o, "ETag: %s\r\n", info->etag);
+    o += sprintf(o, "Last-Modified: %s\r\n", info->last_modified);
+    if (encoding || is_compressible(content_type))
+        o += sprintf(o, "Vary: Accept-Encoding\r\n");
+    return o;
+}
+
+
 SOCKET create_socket(const char* host, const char *port) {
     printf("Configuring local address...\n");
     struct addrinfo hints;
@@ -68,6 +208,12 @@ SOCKET create_socket(const char* host, const char *port) {
         exit(1);
     }
 
+    int yes = 1;
+    if (setsockopt(socket_listen, SOL_SOCKET, SO_REUSEADDR,
+                (const char*)&yes, sizeof(yes)) < 0) {
+        fprintf(stderr, "setsockopt() failed. (%d)\n", GETSOCKETERRNO());
+    }
+
     printf("Binding socket to local address...\n");
     if (bind(socket_listen,
                 bind_address->ai_addr, bind_address->ai_addrlen)) {
@@ -76,281 +222,4514 @@ SOCKET create_socket(const char* host, const char *port) {
     }
     freeaddrinfo(bind_address);
 
+    /* A burst of connections can outrun the loop, and a SYN dropped from
+     * a full backlog waits a second or more to be retried. */
     printf("Listening...\n");
-    if (listen(socket_listen, 10) < 0) {
+    if (listen(socket_listen, SOMAXCONN) < 0) {
         fprintf(stderr, "listen() failed. (%d)\n", GETSOCKETERRNO());
         exit(1);
     }
 
+    /* Connections are accepted until accept() would block. */
+#if defined(_WIN32)
+    unsigned long nonblocking = 1;
+    ioctlsocket(socket_listen, FIONBIO, &nonblocking);
+#else
+    fcntl(socket_listen, F_SETFL, fcntl(socket_listen, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
     return socket_listen;
 }
 
 
 
-#define MAX_REQUEST_SIZE 2047
+/* The longest request head accepted. */
+#if !defined(MAX_REQUEST_SIZE)
+#define MAX_REQUEST_SIZE 8191
+#endif
+#define OUTPUT_SIZE 1024
+#define MAX_RANGES 4
+#define MAX_PARTS (2 + 2 * MAX_RANGES)
+
+/* A piece of the response: length bytes at data or, when data is 0,
+ * length bytes of the response file starting at offset. */
+struct response_part {
+    const char *data;
+    size_t offset;
+    size_t length;
+};
+
+struct body_handler;
+
+/* A request body that is being read, see begin_body(). */
+struct request_body {
+    const struct body_handler *handler;
+    int chunked;
+    struct http_chunked decoder;
+    unsigned long remaining;
+    unsigned long bytes;
+    unsigned long started;
+    void *context;
+};
+
+/* What a client needs only while it has a request or a response in
+ * progress. It is taken from buffer_pool.h when the client's first bytes
+ * arrive and given back once the client is idle again, so an idle
+ * kept-alive connection holds no more than its client_info. The request
+ * runs on past the end of the struct into the rest of the block, and a
+ * longer one moves to a block from the next class up, to at most
+ * MAX_REQUEST_SIZE bytes. */
+struct request_buffer {
+    struct http_request parser;
+
+    /* The response being written, as parts sent in order. A part points
+     * into output, into the cache entry held by cached, into the docroot
+     * pack held by pack, into the micro-cache item held by micro, into a
+     * backend connection's buffer, or at a range of file. */
+    char output[OUTPUT_SIZE];
+    struct response_part parts[MAX_PARTS];
+
+    /* Set while the request waits for another client's fetch of the
+     * same response into the micro-cache. */
+    struct micro_fill *fill;
+    struct client_info *fill_next;
+    unsigned long fill_started;
+
+    /* The request's body, while it is being read. */
+    struct request_body body;
+
+    int size;
+    char request[1];
+};
+
+/* grow_buffer() takes a buffer for a whole MAX_REQUEST_SIZE request from
+ * buffer_pool.h's largest class, so a -DMAX_REQUEST_SIZE too big for it
+ * gives this array a negative size and stops the build. */
+typedef char max_request_size_fits_pool[
+    offsetof(struct request_buffer, request) + 1 + MAX_REQUEST_SIZE +
+    sizeof(union pool_block) <=
+    ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1)) ? 1 : -1];
+
+struct cache_entry;
+struct io_job;
+struct upstream_conn;
+struct micro_fill;
+struct ws_client;
 
 struct client_info {
-    socklen_t address_length;
-    struct sockaddr_storage address;
+    char address_text[48];
     SOCKET socket;
-    char request[MAX_REQUEST_SIZE + 1];
+    struct request_buffer *buffer;
     int received;
+    int keep_alive;
+    int requests;
+    struct timer timeout;
+
+    /* When the loop last finished with this client, in microseconds. */
+    unsigned long served;
+
+    int part_count;
+    int part_sent;
+    struct cache_entry *cached;
+    struct pack *pack;
+    struct micro_item *micro;
+    FILE *file;
+    int writing;
+#if defined(USE_IO_POOL)
+    /* The job the client is waiting on, if any, and the part of file
+     * that the I/O pool has read in. */
+    struct io_job *io;
+    int io_warmed;
+    size_t ready_start;
+    size_t ready_end;
+#endif
+
+    /* The backend connection a proxied request is waiting on. */
+    struct upstream_conn *upstream;
+
+    /* Set once the client has asked to become a WebSocket client. */
+    struct ws_client *ws;
+
+    /* Set by drop_client(). The client stays out of free_clients until
+     * the loop has finished with the events it is handling, as some of
+     * them may still be for this client. */
+    int dropped;
+    struct client_info *next_dropped;
+
     struct client_info *next;
+    struct client_info *prev;
 };
 
 static struct client_info *clients = 0;
+static int client_count = 0;
 
-struct client_info *get_client(SOCKET s) {
-    struct client_info *ci = clients;
+/* Clients are looked up by socket through client_table, which is indexed
+ * by the socket descriptor and grows as higher descriptors show up.
+ * Dropped clients go onto free_clients and are reused by later
+ * connections; new ones are carved out of CLIENT_SLAB sized blocks. */
+static struct client_info **client_table = 0;
+static size_t client_table_size = 0;
+static struct client_info *free_clients = 0;
+static struct client_info *dropped_clients = 0;
 
-    while(ci) {
-        if (ci->socket == s)
-            break;
-        ci = ci->next;
+#define CLIENT_SLAB 64
+
+struct client_info *alloc_client() {
+    if (!free_clients) {
+        struct client_info *slab = (struct client_info*)
+            calloc(CLIENT_SLAB, sizeof(struct client_info));
+        if (!slab) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        int i;
+        for (i = 0; i < CLIENT_SLAB; ++i) {
+            slab[i].next = free_clients;
+            free_clients = &slab[i];
+        }
     }
 
-    if (ci) return ci;
-    struct client_info *n =
-        (struct client_info*) calloc(1, sizeof(struct client_info));
+    struct client_info *n = free_clients;
+    free_clients = n->next;
+    return n;
+}
 
-    if (!n) {
-        fprintf(stderr, "Out of memory.\n");
-        exit(1);
+
+struct client_info *get_client(SOCKET s) {
+    size_t i = (size_t)s;
+
+    if (i < client_table_size && client_table[i])
+        return client_table[i];
+
+    if (i >= client_table_size) {
+        size_t size = client_table_size ? client_table_size : 1024;
+        while (size <= i) size *= 2;
+
+        struct client_info **table = (struct client_info**)
+            realloc(client_table, size * sizeof(*table));
+        if (!table) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memset(table + client_table_size, 0,
+                (size - client_table_size) * sizeof(*table));
+        client_table = table;
+        client_table_size = size;
     }
 
-    n->address_length = sizeof(n->address);
+    struct client_info *n = alloc_client();
+    n->socket = s;
+    n->buffer = 0;
+    n->received = 0;
+    n->keep_alive = 0;
+    n->requests = 0;
+    timer_init(&n->timeout, n);
+    n->served = stats_now_us();
+    n->part_count = 0;
+    n->part_sent = 0;
+    n->cached = 0;
+    n->pack = 0;
+    n->micro = 0;
+    n->file = 0;
+    n->writing = 0;
+#if defined(USE_IO_POOL)
+    n->io = 0;
+    n->io_warmed = 0;
+    n->ready_start = n->ready_end = 0;
+#endif
+    n->upstream = 0;
+    n->ws = 0;
+    n->dropped = 0;
+
+    n->prev = 0;
     n->next = clients;
+    if (clients) clients->prev = n;
     clients = n;
+    client_count++;
+
+    client_table[i] = n;
     return n;
 }
 
 
-void drop_client(struct client_info *client) {
-    CLOSESOCKET(client->socket);
+/* Gives client a buffer that holds at least size bytes of request,
+ * carrying over what it has received so far. */
+void grow_buffer(struct client_info *client, int size) {
+    size_t header = offsetof(struct request_buffer, request) + 1;
+    size_t capacity;
+    struct request_buffer *b = (struct request_buffer*)
+        pool_get(header + size, &capacity);
+    if (!b) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    capacity -= header;
+    b->size = capacity > MAX_REQUEST_SIZE ? MAX_REQUEST_SIZE : (int)capacity;
+    b->fill = 0;
+
+    if (client->buffer) {
+        b->parser = client->buffer->parser;
+        b->body = client->buffer->body;
+        memcpy(b->request, client->buffer->request, client->received + 1);
+        pool_put(client->buffer);
+    } else {
+        http_reset(&b->parser);
+        b->body.handler = 0;
+        b->request[0] = 0;
+    }
+    client->buffer = b;
+}
 
-    struct client_info **p = &clients;
 
-    while(*p) {
-        if (*p == client) {
-            *p = client->next;
-            free(client);
-            return;
-        }
-        p = &(*p)->next;
+void release_buffer(struct client_info *client) {
+    if (client->buffer) {
+        pool_put(client->buffer);
+        client->buffer = 0;
     }
+}
+
+
+#if defined(USE_CACHE)
+
+/* Files served from public/ are kept in memory together with their
+ * prebuilt status line and headers, so a repeated request is answered
+ * with one writev() and no filesystem calls. Compressed variants are
+ * keyed by path, a tab and the coding, as in "/index.html\tgzip"; an
+ * entry marked missing records that a variant doesn't exist. Small files are copied into
+ * the heap; larger ones are mapped. The cache holds at most
+ * CACHE_MAX_BYTES, evicting the least recently used entries first, and
+ * inotify tells us when a cached file changes. */
 
-    fprintf(stderr, "drop_client not found.\n");
-    exit(1);
+#define CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define CACHE_MAX_FILE (4 * 1024 * 1024)
+#define CACHE_MMAP_MIN (64 * 1024)
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_DIRS 64
+
+struct cache_entry {
+    char path[128];
+    unsigned long hash;
+    struct file_info info;
+    const char *content_type;
+    const char *encoding;
+    char headers[320];
+    int headers_length;
+    char not_modified[256];
+    int not_modified_length;
+    char *body;
+    size_t body_length;
+    size_t size;
+    int mapped;
+    int missing;
+
+    /* An entry that is invalidated while clients are still sending it
+     * is unlinked at once but freed when the last of them finishes. */
+    int refs;
+    int linked;
+
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+};
+
+static struct cache_entry *cache_table[CACHE_BUCKETS];
+static struct cache_entry *cache_lru_head = 0;
+static struct cache_entry *cache_lru_tail = 0;
+static size_t cache_bytes = 0;
+static int cache_inotify = -1;
+
+/* inotify names a changed file by watch descriptor and file name, so
+ * each watched directory's path under public is remembered here. */
+struct cache_dir {
+    int wd;
+    char path[128];
+};
+
+static struct cache_dir cache_dirs[CACHE_MAX_DIRS];
+static int cache_dir_count = 0;
+
+
+unsigned long cache_hash(const char *path) {
+    unsigned long h = 2166136261UL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619UL;
+    }
+    return h;
 }
 
 
-const char *get_client_address(struct client_info *ci) {
-    static char address_buffer[100];
-    getnameinfo((struct sockaddr*)&ci->address,
-            ci->address_length,
-            address_buffer, sizeof(address_buffer), 0, 0,
-            NI_NUMERICHOST);
-    return address_buffer;
+void cache_free(struct cache_entry *e) {
+    if (e->mapped)
+        munmap(e->body, e->body_length);
+    else
+        free(e->body);
+    free(e);
 }
 
 
+void cache_unlink(struct cache_entry *e) {
+    struct cache_entry **p = &cache_table[e->hash % CACHE_BUCKETS];
+    while (*p != e) p = &(*p)->hash_next;
+    *p = e->hash_next;
 
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else cache_lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else cache_lru_tail = e->lru_prev;
 
-fd_set wait_on_clients(SOCKET server) {
-    fd_set reads;
-    FD_ZERO(&reads);
-    FD_SET(server, &reads);
-    SOCKET max_socket = server;
+    cache_bytes -= e->size;
+    e->linked = 0;
+    if (!e->refs) cache_free(e);
+}
 
-    struct client_info *ci = clients;
 
-    while(ci) {
-        FD_SET(ci->socket, &reads);
-        if (ci->socket > max_socket)
-            max_socket = ci->socket;
-        ci = ci->next;
+void cache_release(struct cache_entry *e) {
+    if (--e->refs == 0 && !e->linked)
+        cache_free(e);
+}
+
+
+void cache_flush() {
+    while (cache_lru_head)
+        cache_unlink(cache_lru_head);
+}
+
+
+struct cache_entry *cache_lookup(const char *path) {
+    unsigned long hash = cache_hash(path);
+    struct cache_entry *e = cache_table[hash % CACHE_BUCKETS];
+    while (e && (e->hash != hash || strcmp(e->path, path)))
+        e = e->hash_next;
+    if (!e || e == cache_lru_head) return e;
+
+    e->lru_prev->lru_next = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else cache_lru_tail = e->lru_prev;
+
+    e->lru_prev = 0;
+    e->lru_next = cache_lru_head;
+    cache_lru_head->lru_prev = e;
+    cache_lru_head = e;
+    return e;
+}
+
+
+/* Makes sure the directory holding path is watched. Returns 0 if it
+ * can't be, in which case the file must not be cached. */
+int cache_watch_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    int length = (int)(slash - path);
+
+    int i;
+    for (i = 0; i < cache_dir_count; ++i)
+        if ((int)strlen(cache_dirs[i].path) == length &&
+                strncmp(cache_dirs[i].path, path, length) == 0)
+            return 1;
+
+    if (cache_dir_count == CACHE_MAX_DIRS) return 0;
+
+    char full_path[128];
+    sprintf(full_path, "public%.*s", length, path);
+
+    int wd = inotify_add_watch(cache_inotify, full_path,
+            IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) return 0;
+
+    struct cache_dir *d = &cache_dirs[cache_dir_count++];
+    d->wd = wd;
+    sprintf(d->path, "%.*s", length, path);
+    return 1;
+}
+
+
+/* Adds body to the cache under key, taking ownership of it. Without a
+ * content_type, the entry records a missing variant. */
+struct cache_entry *cache_add(const char *key, char *body, size_t size,
+        int mapped, const struct file_info *info,
+        const char *content_type, const char *encoding) {
+    struct cache_entry *e = (struct cache_entry*) malloc(sizeof(*e));
+    if (!e) {
+        if (mapped) munmap(body, size);
+        else free(body);
+        return 0;
     }
 
-    if (select(max_socket+1, &reads, 0, 0, 0) < 0) {
-        fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
-        exit(1);
+    strcpy(e->path, key);
+    e->hash = cache_hash(key);
+    e->body = body;
+    e->body_length = size;
+    e->mapped = mapped;
+    e->missing = !content_type;
+    e->content_type = content_type;
+    e->encoding = encoding;
+    e->size = sizeof(*e) + size;
+    e->refs = 0;
+    e->linked = 1;
+
+    /* The Connection header differs between responses, so it is sent
+     * from a separate part after these. */
+    e->headers_length = 0;
+    e->not_modified_length = 0;
+    if (content_type) {
+        e->info = *info;
+        e->info.size = size;
+
+        char *o = e->headers;
+        o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+        o += sprintf(o, "Content-Length: %lu\r\n", (unsigned long)size);
+        o += sprintf(o, "Content-Type: %s\r\n", content_type);
+        if (encoding)
+            o += sprintf(o, "Content-Encoding: %s\r\n", encoding);
+        o = write_validators(o, &e->info, content_type, encoding);
+        o += sprintf(o, "Accept-Ranges: bytes\r\n");
+        e->headers_length = (int)(o - e->headers);
+
+        o = e->not_modified;
+        o += sprintf(o, "HTTP/1.1 304 Not Modified\r\n");
+        o = write_validators(o, &e->info, content_type, encoding);
+        e->not_modified_length = (int)(o - e->not_modified);
     }
 
-    return reads;
+    while (cache_lru_tail && cache_bytes + e->size > CACHE_MAX_BYTES)
+        cache_unlink(cache_lru_tail);
+
+    struct cache_entry **bucket = &cache_table[e->hash % CACHE_BUCKETS];
+    e->hash_next = *bucket;
+    *bucket = e;
+
+    e->lru_prev = 0;
+    e->lru_next = cache_lru_head;
+    if (cache_lru_head) cache_lru_head->lru_prev = e;
+    else cache_lru_tail = e;
+    cache_lru_head = e;
+
+    cache_bytes += e->size;
+    return e;
 }
 
 
-void send_400(struct client_info *client) {
-    const char *c400 = "HTTP/1.1 400 Bad Request\r\n"
-        "Connection: close\r\n"
-        "Content-Length: 11\r\n\r\nBad Request";
-    send(client->socket, c400, strlen(c400), 0);
-    drop_client(client);
+/* Reads the open file fp of size bytes into a new cache entry. Returns
+ * 0 if the file isn't cached. */
+struct cache_entry *cache_insert(const char *key, FILE *fp,
+        const struct file_info *info,
+        const char *content_type, const char *encoding) {
+    size_t size = info->size;
+    if (cache_inotify < 0 || size > CACHE_MAX_FILE ||
+            strlen(key) >= sizeof(((struct cache_entry*)0)->path))
+        return 0;
+
+    /* Watch before reading, so a change made while we read is still
+     * reported. */
+    if (!cache_watch_dir(key)) return 0;
+
+    char *body;
+    int mapped = size >= CACHE_MMAP_MIN;
+    if (mapped) {
+        void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map == MAP_FAILED) return 0;
+        body = (char*)map;
+    } else {
+        body = (char*) malloc(size ? size : 1);
+        if (!body || fread(body, 1, size, fp) != size) {
+            free(body);
+            return 0;
+        }
+    }
+
+    return cache_add(key, body, size, mapped, info, content_type, encoding);
 }
 
-void send_404(struct client_info *client) {
-    const char *c404 = "HTTP/1.1 404 Not Found\r\n"
-        "Connection: close\r\n"
-        "Content-Length: 9\r\n\r\nNot Found";
-    send(client->socket, c404, strlen(c404), 0);
-    drop_client(client);
+
+/* Records that the variant key doesn't exist, so later requests don't
+ * look for it on disk again. */
+void cache_add_missing(const char *key) {
+    if (cache_inotify < 0 ||
+            strlen(key) >= sizeof(((struct cache_entry*)0)->path))
+        return;
+    if (cache_watch_dir(key))
+        cache_add(key, 0, 0, 0, 0, 0, 0);
 }
 
 
+void cache_remove(const char *key) {
+    struct cache_entry *e = cache_lookup(key);
+    if (e) cache_unlink(e);
+}
 
-void serve_resource(struct client_info *client, const char *path) {
 
-    printf("serve_resource %s %s\n", get_client_address(client), path);
+/* Drops everything cached from the file at path: the file itself, the
+ * variants compressed from it and, if it is a sidecar such as
+ * index.html.gz, the variant it holds. */
+void cache_invalidate(const char *path) {
+    char key[256];
+    size_t length = strlen(path);
 
-    if (strcmp(path, "/") == 0) path = "/index.html";
+    cache_remove(path);
 
-    if (strlen(path) > 100) {
-        send_400(client);
-        return;
+    size_t i;
+    for (i = 0; i < ENCODINGS; ++i) {
+        snprintf(key, sizeof(key), "%s\t%s", path, encodings[i].name);
+        cache_remove(key);
+
+        size_t suffix = strlen(encodings[i].suffix);
+        if (length > suffix &&
+                strcmp(path + length - suffix, encodings[i].suffix) == 0) {
+            snprintf(key, sizeof(key), "%.*s\t%s",
+                    (int)(length - suffix), path, encodings[i].name);
+            cache_remove(key);
+        }
     }
+}
 
-    if (strstr(path, "..")) {
-        send_404(client);
-        return;
+
+/* Drops the entries for files that inotify reports as changed. Changes
+ * to directories and lost events flush the whole cache. */
+void cache_handle_events() {
+    char buffer[4096];
+    ssize_t r;
+
+    while ((r = read(cache_inotify, buffer, sizeof(buffer))) > 0) {
+        char *p = buffer;
+        while (p < buffer + r) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                int i;
+                for (i = 0; i < cache_dir_count; ++i) {
+                    if (cache_dirs[i].wd == event->wd) {
+                        inotify_rm_watch(cache_inotify, event->wd);
+                        cache_dirs[i--] = cache_dirs[--cache_dir_count];
+                    }
+                }
+                cache_flush();
+                continue;
+            }
+
+            if (event->mask & (IN_Q_OVERFLOW | IN_ISDIR) || !event->len) {
+                cache_flush();
+                continue;
+            }
+
+            int i;
+            for (i = 0; i < cache_dir_count; ++i) {
+                if (cache_dirs[i].wd != event->wd) continue;
+
+                char path[256];
+                snprintf(path, sizeof(path), "%s/%s",
+                        cache_dirs[i].path, event->name);
+                cache_invalidate(path);
+            }
+        }
     }
+}
 
-    char full_path[128];
-    sprintf(full_path, "public%s", path);
 
-#if defined(_WIN32)
-    char *p = full_path;
-    while (*p) {
-        if (*p == '/') *p = '\\';
-        ++p;
+#if defined(USE_ZLIB)
+#define COMPRESS_MAX_FILE (1024 * 1024)
+
+/* Compresses data with gzip into a new buffer. Returns 0 if that fails
+ * or doesn't make it any smaller. */
+char *gzip_compress(const char *data, size_t length, size_t *compressed) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    size_t bound = deflateBound(&z, (uLong)length);
+    char *out = (char*) malloc(bound);
+    if (!out) {
+        deflateEnd(&z);
+        return 0;
     }
-#endif
 
-    FILE *fp = fopen(full_path, "rb");
+    z.next_in = (Bytef*)data;
+    z.avail_in = (uInt)length;
+    z.next_out = (Bytef*)out;
+    z.avail_out = (uInt)bound;
+    int r = deflate(&z, Z_FINISH);
+    *compressed = z.total_out;
+    deflateEnd(&z);
 
-    if (!fp) {
-        send_404(client);
-        return;
+    if (r != Z_STREAM_END || *compressed >= length) {
+        free(out);
+        return 0;
+    }
+    return out;
+}
+
+
+/* Compresses the file at path the first time a client asks for it with
+ * gzip and there is no .gz sidecar. Later requests get the cached
+ * result. */
+struct cache_entry *cache_compress(const char *key, const char *path,
+        const char *content_type) {
+    struct cache_entry *source = cache_lookup(path);
+    if (!source) {
+        char full_path[128];
+        struct file_info info;
+        get_full_path(full_path, path, "");
+        if (get_file_info(full_path, &info)) return 0;
+        FILE *fp = fopen(full_path, "rb");
+        if (!fp) return 0;
+        source = cache_insert(path, fp, &info, content_type, 0);
+        fclose(fp);
     }
+    if (!source || source->missing || source->body_length > COMPRESS_MAX_FILE)
+        return 0;
+
+    size_t length;
+    char *body = gzip_compress(source->body, source->body_length, &length);
+    if (!body) return 0;
+
+    /* The compressed copy is a different representation, so it needs
+     * its own ETag. */
+    struct file_info info = source->info;
+    sprintf(info.etag + strlen(info.etag) - 1, "-gz\"");
+
+    return cache_add(key, body, length, 0, &info, content_type, "gzip");
+}
+#endif
+
+
+void cache_init() {
+    cache_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache_inotify < 0)
+        fprintf(stderr, "inotify_init1() failed. (%d) "
+                "Files will not be cached.\n", errno);
+}
+
+#endif
 
-    fseek(fp, 0L, SEEK_END);
-    size_t cl = ftell(fp);
-    rewind(fp);
 
-    const char *ct = get_content_type(full_path);
+#if defined(USE_PACK)
+/* With -p, every file is served from a docroot pack built by
+ * pack_docroot. SIGHUP maps the pack file again and, if it is sound,
+ * swaps it in between two requests, so each response comes wholly from
+ * the old pack or wholly from the new one. */
+static struct pack *docroot_pack = 0;
+static const char *docroot_pack_name = 0;
+static volatile sig_atomic_t pack_reload_requested = 0;
 
-#define BSIZE 1024
-    char buffer[BSIZE];
 
-    sprintf(buffer, "HTTP/1.1 200 OK\r\n");
-    send(client->socket, buffer, strlen(buffer), 0);
+void pack_release(struct pack *pack) {
+    if (--pack->refs == 0 && pack != docroot_pack)
+        pack_close(pack);
+}
 
-    sprintf(buffer, "Connection: close\r\n");
-    send(client->socket, buffer, strlen(buffer), 0);
 
-    sprintf(buffer, "Content-Length: %u\r\n", cl);
-    send(client->socket, buffer, strlen(buffer), 0);
+void request_pack_reload(int signal_number) {
+    (void)signal_number;
+    pack_reload_requested = 1;
+}
 
-    sprintf(buffer, "Content-Type: %s\r\n", ct);
-    send(client->socket, buffer, strlen(buffer), 0);
 
-    sprintf(buffer, "\r\n");
-    send(client->socket, buffer, strlen(buffer), 0);
+void reload_pack() {
+    pack_reload_requested = 0;
 
-    int r = fread(buffer, 1, BSIZE, fp);
-    while (r) {
-        send(client->socket, buffer, r, 0);
-        r = fread(buffer, 1, BSIZE, fp);
+    struct pack *pack = pack_open(docroot_pack_name);
+    if (!pack) {
+        fprintf(stderr, "Can't load %s; keeping the old pack.\n",
+                docroot_pack_name);
+        return;
     }
 
-    fclose(fp);
-    drop_client(client);
+    struct pack *old = docroot_pack;
+    docroot_pack = pack;
+    if (!old->refs) pack_close(old);
+    fprintf(stderr, "Reloaded %s.\n", docroot_pack_name);
 }
+#endif
 
 
-int main() {
+#if defined(USE_EPOLL)
+static int epoll_fd = -1;
 
-#if defined(_WIN32)
-    WSADATA d;
-    if (WSAStartup(MAKEWORD(2, 2), &d)) {
-        fprintf(stderr, "Failed to initialize.\n");
-        return 1;
+void watch_socket(SOCKET s, void *data) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = data;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &event) < 0) {
+        fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
     }
+}
+
+void unwatch_socket(SOCKET s) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, 0);
+}
 #endif
 
-    SOCKET server = create_socket(0, "8080");
 
-    while(1) {
+/* A client is either waiting for a request or writing a response, and
+ * is only watched for the matching kind of readiness. */
+void set_writing(struct client_info *client, int writing) {
+    client->writing = writing;
+#if defined(USE_EPOLL)
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = writing ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket, &event);
+#endif
+}
 
-        fd_set reads;
-        reads = wait_on_clients(server);
 
-        if (FD_ISSET(server, &reads)) {
-            struct client_info *client = get_client(-1);
+#if defined(USE_IO_POOL)
+/* A cold file would stall every client while the loop waits on the disk,
+ * so the loop only reads files that are in the page cache. Once a file
+ * is open, two reads of a byte with RWF_NOWAIT, which fail rather than
+ * wait, tell whether the start and end of its first IO_WINDOW bytes are
+ * there. If not, the request is parked: its socket is unwatched and an
+ * IO_WARM job opens and reads that much of the file on a worker thread,
+ * which leaves it in the page cache. When the job is done the request is
+ * served again, and this time it finds the file in memory. A file sent
+ * from disk goes out IO_WINDOW bytes at a time, and a window that isn't
+ * in the page cache is read in by an IO_READ_AHEAD job first. Workers
+ * hand finished jobs back through io_eventfd, which the loop watches.
+ *
+ * Responses answered from the cache or the docroot pack never involve
+ * the pool, and neither does opening a file: its metadata is far more
+ * likely to be cached than its data. */
+#define IO_THREADS 4
+#define IO_WINDOW (4 * 1024 * 1024)
+#define IO_CHUNK 65536
 
-            client->socket = accept(server,
-                    (struct sockaddr*) &(client->address),
-                    &(client->address_length));
+enum { IO_WARM, IO_READ_AHEAD };
 
-            if (!ISVALIDSOCKET(client->socket)) {
-                fprintf(stderr, "accept() failed. (%d)\n",
-                        GETSOCKETERRNO());
-                return 1;
-            }
+struct io_job {
+    int type;
+    struct client_info *client;
+    unsigned long started;
 
+    /* IO_WARM reads from full_path and IO_READ_AHEAD from the client's
+     * file, which the job keeps open if the client is dropped meanwhile.
+     * Both read length bytes from offset. */
+    char full_path[128];
+    FILE *file;
+    size_t offset;
+    size_t length;
 
-            printf("New connection from %s.\n",
-                    get_client_address(client));
-        }
+    struct io_job *next;
+};
 
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_wake = PTHREAD_COND_INITIALIZER;
+static struct io_job *io_queue = 0;
+static struct io_job *io_queue_tail = 0;
+static struct io_job *io_done = 0;
+static int io_eventfd = -1;
 
-        struct client_info *client = clients;
-        while(client) {
-            struct client_info *next = client->next;
 
-            if (FD_ISSET(client->socket, &reads)) {
+/* Reads length bytes of fd from offset, or up to its end, into buffer
+ * and throws them away. */
+void io_read(int fd, size_t offset, size_t length, char *buffer) {
+    while (length) {
+        ssize_t r = pread(fd, buffer,
+                length < IO_CHUNK ? length : IO_CHUNK, (off_t)offset);
+        if (r <= 0) break;
+        offset += (size_t)r;
+        length -= (size_t)r;
+    }
+}
 
-                if (MAX_REQUEST_SIZE == client->received) {
-                    send_400(client);
-                    client = next;
-                    continue;
-                }
 
-                int r = recv(client->socket,
-                        client->request + client->received,
-                        MAX_REQUEST_SIZE - client->received, 0);
-
-                if (r < 1) {
-                    printf("Unexpected disconnect from %s.\n",
-                            get_client_address(client));
-                    drop_client(client);
-
-                } else {
-                    client->received += r;
-                    client->request[client->received] = 0;
-
-                    char *q = strstr(client->request, "\r\n\r\n");
-                    if (q) {
-                        *q = 0;
-
-                        if (strncmp("GET /", client->request, 5)) {
-                            send_400(client);
-                        } else {
-                            char *path = client->request + 4;
-                            char *end_path = strstr(path, " ");
-                            if (!end_path) {
-                                send_400(client);
-                            } else {
-                                *end_path = 0;
-                                serve_resource(client, path);
-                            }
-                        }
-                    } //if (q)
-                }
-            }
+void *io_worker(void *arg) {
+    char buffer[IO_CHUNK];
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&io_lock);
+        while (!io_queue)
+            pthread_cond_wait(&io_wake, &io_lock);
+        struct io_job *job = io_queue;
+        io_queue = job->next;
+        pthread_mutex_unlock(&io_lock);
+
+        if (job->type == IO_WARM) {
+            int fd = open(job->full_path, O_RDONLY);
+            if (fd >= 0) {
+                io_read(fd, job->offset, job->length, buffer);
+                close(fd);
+            }
+        } else {
+            io_read(fileno(job->file), job->offset, job->length, buffer);
+        }
+
+        pthread_mutex_lock(&io_lock);
+        job->next = io_done;
+        io_done = job;
+        pthread_mutex_unlock(&io_lock);
+
+        uint64_t one = 1;
+        if (write(io_eventfd, &one, sizeof(one)) < 0) {
+            /* The count is already nonzero, so the loop will look. */
+        }
+    }
+    return 0;
+}
+
+
+/* Starts the workers. Returns 0 on success. */
+int io_start() {
+    io_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io_eventfd < 0) return -1;
+
+    int i;
+    for (i = 0; i < IO_THREADS; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, io_worker, 0)) return -1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+
+struct io_job *io_new_job(int type) {
+    struct io_job *job = (struct io_job*) calloc(1, sizeof(*job));
+    if (!job) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    job->type = type;
+    return job;
+}
+
+
+/* Parks client until job is done. */
+void io_submit(struct client_info *client, struct io_job *job) {
+    job->client = client;
+    job->started = stats_now_us();
+    client->io = job;
+#if defined(USE_EPOLL)
+    unwatch_socket(client->socket);
+#endif
+
+    pthread_mutex_lock(&io_lock);
+    if (io_queue) io_queue_tail->next = job;
+    else io_queue = job;
+    io_queue_tail = job;
+    pthread_cond_signal(&io_wake);
+    pthread_mutex_unlock(&io_lock);
+}
+
+
+/* Says whether length bytes of fd from offset look to be in the page
+ * cache. */
+int io_resident(int fd, size_t offset, size_t length) {
+#if defined(RWF_NOWAIT)
+    char c;
+    struct iovec iov;
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    if (!length) return 1;
+    return preadv2(fd, &iov, 1, (off_t)offset, RWF_NOWAIT) == 1 &&
+        preadv2(fd, &iov, 1, (off_t)(offset + length - 1), RWF_NOWAIT) == 1;
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+    return 0;
+#endif
+}
+
+
+/* Asks whether fp, just opened from full_path to be served to client,
+ * can be read on the loop. If not, the request is parked on an IO_WARM
+ * job, to be served again once the job is done. */
+int io_ready_to_read(struct client_info *client, FILE *fp,
+        const struct file_info *info, const char *full_path) {
+    size_t length = info->size < IO_WINDOW ? info->size : IO_WINDOW;
+    if (client->io_warmed || io_resident(fileno(fp), 0, length)) {
+        client->ready_start = 0;
+        client->ready_end = length;
+        return 1;
+    }
+
+    struct io_job *job = io_new_job(IO_WARM);
+    strcpy(job->full_path, full_path);
+    job->length = length;
+    io_submit(client, job);
+    return 0;
+}
+
+
+/* Asks whether the next bytes of a file part can be read on the loop.
+ * If not, the client is parked on an IO_READ_AHEAD job for them. */
+int io_ready_to_send(struct client_info *client,
+        const struct response_part *part) {
+    if (part->offset >= client->ready_start &&
+            part->offset < client->ready_end)
+        return 1;
+
+    size_t length = part->length < IO_WINDOW ? part->length : IO_WINDOW;
+    if (io_resident(fileno(client->file), part->offset, length)) {
+        client->ready_start = part->offset;
+        client->ready_end = part->offset + length;
+        return 1;
+    }
+
+    struct io_job *job = io_new_job(IO_READ_AHEAD);
+    job->file = client->file;
+    job->offset = part->offset;
+    job->length = length;
+    io_submit(client, job);
+    return 0;
+}
+#endif
+
+
+/* The loop's counters, reported at /server-status. */
+static struct server_stats stats;
+
+
+/* Reverse proxying. Each -x prefix=host:port[,host:port...] sends the
+ * requests whose path starts with prefix to one of the backends listed,
+ * whichever has the fewest requests outstanding, and streams each
+ * response back through a buffer of UPSTREAM_BUFFER bytes rather than
+ * holding it whole. Connections to a backend are kept alive in a pool of
+ * up to UPSTREAM_MAX_IDLE, so a request usually goes out on one that is
+ * already open instead of waiting for a handshake. Idle connections are
+ * watched, so one the backend closes is dropped from the pool; a request
+ * sent on one closed in the moment before it was reused is sent again on
+ * a new connection.
+ *
+ * Connections come from one array of UPSTREAM_CONNECTIONS, which is how
+ * their events and timers are told apart from the clients'. */
+#define MAX_ROUTES 16
+#define MAX_ROUTE_BACKENDS 8
+#define MAX_UPSTREAMS 32
+#define UPSTREAM_CONNECTIONS 256
+#define UPSTREAM_MAX_IDLE 32
+/* A 16 KiB pool block, less the pool's header, so it isn't rounded up to
+ * the next class. */
+#define UPSTREAM_BUFFER ((1 << 14) - (int)sizeof(union pool_block))
+
+/* How long a backend may go quiet while it owes a response, and how long
+ * an idle connection is kept, in milliseconds. The latter is below
+ * KEEPALIVE_TIMEOUT, so a backend that is another web_server doesn't
+ * close connections just as they are reused. */
+#define UPSTREAM_TIMEOUT 30000
+#define UPSTREAM_IDLE_TIMEOUT 4000
+
+struct upstream {
+    char name[64];
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    int outstanding;
+    struct upstream_conn *idle;
+    int idle_count;
+};
+
+struct route {
+    char prefix[64];
+    int prefix_length;
+    struct upstream *backends[MAX_ROUTE_BACKENDS];
+    int backend_count;
+    int next;
+};
+
+enum {
+    UPSTREAM_CONNECTING,
+    UPSTREAM_SENDING,
+    UPSTREAM_HEADERS,
+    UPSTREAM_BODY,
+    UPSTREAM_IDLE
+};
+
+enum {BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_UNTIL_CLOSE};
+enum {WATCH_NONE, WATCH_READ, WATCH_WRITE};
+
+struct upstream_conn {
+    SOCKET socket;
+    struct upstream *upstream;
+    struct client_info *client;
+    int state;
+    int watch;
+    int reused;
+    int keep_alive;
+    struct timer timeout;
+
+    /* Taken from buffer_pool.h while a request is in flight. It holds
+     * the request until that has been sent, then the response as it
+     * streams through: received bytes, of which the first forwarded have
+     * been queued for the client. */
+    char *buffer;
+    int request_length;
+    int sent;
+    int received;
+    int forwarded;
+
+    struct http_request response;
+    int body;
+    unsigned long remaining;
+    struct http_chunked chunked;
+    int done;
+
+    unsigned long started;
+    unsigned long bytes;
+
+    /* The micro-cache fill this response is for, if any. */
+    struct micro_fill *fill;
+
+    struct upstream_conn *next;
+};
+
+static struct route routes[MAX_ROUTES];
+static int route_count = 0;
+static struct upstream upstreams[MAX_UPSTREAMS];
+static int upstream_count = 0;
+static struct upstream_conn *upstream_conns = 0;
+static struct upstream_conn *free_upstream_conns = 0;
+
+
+int is_upstream(const void *p) {
+    uintptr_t first = (uintptr_t)upstream_conns;
+    uintptr_t last = (uintptr_t)(upstream_conns + UPSTREAM_CONNECTIONS);
+    return upstream_conns && (uintptr_t)p >= first && (uintptr_t)p < last;
+}
+
+
+/* Proxied responses can be kept in a micro-cache for -m milliseconds.
+ * Even a TTL of a second turns a burst of requests for a hot path into
+ * one request to the backend. Only GET and HEAD requests without
+ * cookies or credentials are answered from it, and only complete 200,
+ * 301 and 404 responses with a Content-Length, and no Set-Cookie, Vary
+ * or Cache-Control saying otherwise, are kept.
+ *
+ * Responses are kept under the request's path and Host header, as one
+ * backend may serve several sites.
+ *
+ * Requests that miss on a key whose response is already being fetched
+ * don't go to the backend too: they wait on that fetch, its fill, and
+ * are answered from the item it leaves in the cache. If the response
+ * can't be kept, they go to the backend themselves. Waiters are picked
+ * up by micro_resume() once the loop has dealt with the events in hand,
+ * never from within another client's handler. */
+#if !defined(MICRO_CACHE_BYTES)
+#define MICRO_CACHE_BYTES (16 * 1024 * 1024)
+#endif
+#define MICRO_FILL_BUCKETS 256
+
+struct micro_fill {
+    struct micro_item *item;
+    size_t filled;
+    struct client_info *waiters;
+    unsigned long hash;
+    struct micro_fill *next;
+    int key_length;
+    char key[1];
+};
+
+static struct micro_cache micro;
+static long micro_ttl = 0;
+static struct micro_fill *micro_fills[MICRO_FILL_BUCKETS];
+
+/* Clients whose fill has ended, waiting to be picked up. */
+static struct micro_fill micro_woken;
+
+
+unsigned long micro_now() {
+    return stats_now_us() / 1000;
+}
+
+
+struct micro_fill *micro_find_fill(const char *key, int length) {
+    unsigned long hash = micro_hash(key, length);
+    struct micro_fill *f = micro_fills[hash % MICRO_FILL_BUCKETS];
+    while (f && (f->hash != hash || f->key_length != length ||
+                memcmp(f->key, key, length)))
+        f = f->next;
+    return f;
+}
+
+
+struct micro_fill *micro_new_fill(const char *key, int length) {
+    struct micro_fill *f = (struct micro_fill*)
+        malloc(sizeof(struct micro_fill) + length);
+    if (!f) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    f->item = 0;
+    f->filled = 0;
+    f->waiters = 0;
+    f->hash = micro_hash(key, length);
+    f->key_length = length;
+    memcpy(f->key, key, length);
+    f->next = micro_fills[f->hash % MICRO_FILL_BUCKETS];
+    micro_fills[f->hash % MICRO_FILL_BUCKETS] = f;
+    return f;
+}
+
+
+/* Ends a fill. If the response came in complete, its item goes into the
+ * cache; either way the waiters are handed on to micro_resume(), each
+ * holding a reference to the item if there is one. */
+void micro_fill_end(struct micro_fill *fill, int complete) {
+    struct micro_item *item = fill->item;
+    if (item && complete && fill->filled == item->body_length) {
+        micro_insert(&micro, item, micro_now() + micro_ttl);
+    } else if (item) {
+        micro_release(&micro, item);
+        item = 0;
+    }
+
+    while (fill->waiters) {
+        struct client_info *client = fill->waiters;
+        fill->waiters = client->buffer->fill_next;
+        client->micro = item;
+        if (item) item->refs++;
+        client->buffer->fill = &micro_woken;
+        client->buffer->fill_next = micro_woken.waiters;
+        micro_woken.waiters = client;
+    }
+    if (item) micro_release(&micro, item);
+
+    struct micro_fill **p = &micro_fills[fill->hash % MICRO_FILL_BUCKETS];
+    while (*p != fill) p = &(*p)->next;
+    *p = fill->next;
+    free(fill);
+}
+
+
+/* Takes a client that is being dropped off the fill it waits on. */
+void micro_unwait(struct client_info *client) {
+    struct client_info **p = &client->buffer->fill->waiters;
+    while (*p != client) p = &(*p)->buffer->fill_next;
+    *p = client->buffer->fill_next;
+    client->buffer->fill = 0;
+}
+
+
+
+/* Looks a backend up the way connect_to_host() in chap06 does, but only
+ * once, at startup, so the loop never waits on getaddrinfo(). */
+struct upstream *add_upstream(const char *hostname, const char *port) {
+    char name[64];
+    if (snprintf(name, sizeof(name), "%s:%s", hostname, port) >=
+            (int)sizeof(name))
+        return 0;
+
+    int i;
+    for (i = 0; i < upstream_count; ++i)
+        if (strcmp(upstreams[i].name, name) == 0) return &upstreams[i];
+    if (upstream_count == MAX_UPSTREAMS) return 0;
+
+    printf("Configuring remote address...\n");
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *peer_address;
+    if (getaddrinfo(hostname, port, &hints, &peer_address)) {
+        fprintf(stderr, "getaddrinfo() failed. (%d)\n", GETSOCKETERRNO());
+        return 0;
+    }
+
+    printf("Remote address is: ");
+    char address_buffer[100];
+    char service_buffer[100];
+    getnameinfo(peer_address->ai_addr, peer_address->ai_addrlen,
+            address_buffer, sizeof(address_buffer),
+            service_buffer, sizeof(service_buffer),
+            NI_NUMERICHOST);
+    printf("%s %s\n", address_buffer, service_buffer);
+
+    struct upstream *u = &upstreams[upstream_count++];
+    memset(u, 0, sizeof(*u));
+    strcpy(u->name, name);
+    memcpy(&u->address, peer_address->ai_addr, peer_address->ai_addrlen);
+    u->address_length = (socklen_t)peer_address->ai_addrlen;
+    freeaddrinfo(peer_address);
+    return u;
+}
+
+
+/* Adds the route given to -x, as prefix=host:port[,host:port...]. An
+ * IPv6 host is written in brackets. Returns 0 if it can't be used. */
+int add_route(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || *spec != '/' || route_count == MAX_ROUTES ||
+            eq - spec >= (int)sizeof(routes[0].prefix))
+        return 0;
+
+    struct route *r = &routes[route_count];
+    memset(r, 0, sizeof(*r));
+    memcpy(r->prefix, spec, eq - spec);
+    r->prefix_length = (int)(eq - spec);
+
+    const char *p = eq + 1;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        if (!end) end = p + strlen(p);
+
+        char backend[100];
+        if (end - p >= (int)sizeof(backend)) return 0;
+        memcpy(backend, p, end - p);
+        backend[end - p] = 0;
+
+        char *colon = strrchr(backend, ':');
+        if (!colon || colon == backend || !colon[1]) return 0;
+        *colon = 0;
+        char *hostname = backend;
+        if (*hostname == '[' && colon[-1] == ']') {
+            ++hostname;
+            colon[-1] = 0;
+        }
+
+        if (r->backend_count == MAX_ROUTE_BACKENDS) return 0;
+        struct upstream *u = add_upstream(hostname, colon + 1);
+        if (!u) return 0;
+        r->backends[r->backend_count++] = u;
+
+        p = *end ? end + 1 : end;
+    }
+    if (!r->backend_count) return 0;
+
+    if (!upstream_conns) {
+        upstream_conns = (struct upstream_conn*)
+            calloc(UPSTREAM_CONNECTIONS, sizeof(struct upstream_conn));
+        if (!upstream_conns) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        int i;
+        for (i = UPSTREAM_CONNECTIONS - 1; i >= 0; --i) {
+            upstream_conns[i].next = free_upstream_conns;
+            free_upstream_conns = &upstream_conns[i];
+        }
+    }
+
+    route_count++;
+    return 1;
+}
+
+
+/* Routes are tried in the order they were given. */
+struct route *find_route(const char *path) {
+    int i;
+    for (i = 0; i < route_count; ++i)
+        if (strncmp(path, routes[i].prefix, routes[i].prefix_length) == 0)
+            return &routes[i];
+    return 0;
+}
+
+
+/* A backend connection is watched for whatever it is waiting on, and not
+ * at all while the client it is streaming to catches up. */
+void upstream_watch(struct upstream_conn *conn, int watch) {
+#if defined(USE_EPOLL)
+    if (watch == conn->watch) return;
+    if (watch == WATCH_NONE) {
+        unwatch_socket(conn->socket);
+    } else {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = watch == WATCH_READ ? EPOLLIN : EPOLLOUT;
+        event.data.ptr = conn;
+        epoll_ctl(epoll_fd, conn->watch == WATCH_NONE ?
+                EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->socket, &event);
+    }
+#endif
+    conn->watch = watch;
+}
+
+
+void upstream_close(struct upstream_conn *conn) {
+    upstream_watch(conn, WATCH_NONE);
+    CLOSESOCKET(conn->socket);
+    timer_cancel(&conn->timeout);
+    if (conn->buffer) {
+        pool_put(conn->buffer);
+        conn->buffer = 0;
+    }
+
+    if (conn->state == UPSTREAM_IDLE) {
+        struct upstream_conn **p = &conn->upstream->idle;
+        while (*p != conn) p = &(*p)->next;
+        *p = conn->next;
+        conn->upstream->idle_count--;
+    }
+
+    conn->next = free_upstream_conns;
+    free_upstream_conns = conn;
+}
+
+
+int connect_in_progress() {
+#if defined(_WIN32)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+
+/* Opens a new connection to backend u, without waiting for it to be
+ * established. Returns 0 if there are no connections left or it
+ * couldn't be started. */
+struct upstream_conn *upstream_connect(struct upstream *u) {
+    if (!free_upstream_conns) return 0;
+
+    SOCKET s = socket(u->address.ss_family, SOCK_STREAM, 0);
+    if (!ISVALIDSOCKET(s)) return 0;
+
+    int yes = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+#if defined(_WIN32)
+    unsigned long nonblocking = 1;
+    ioctlsocket(s, FIONBIO, &nonblocking);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    if (connect(s, (struct sockaddr*)&u->address, u->address_length) &&
+            !connect_in_progress()) {
+        CLOSESOCKET(s);
+        return 0;
+    }
+    stats_add(&stats.upstream_connects, 1);
+
+    struct upstream_conn *conn = free_upstream_conns;
+    free_upstream_conns = conn->next;
+    memset(conn, 0, sizeof(*conn));
+    conn->socket = s;
+    conn->upstream = u;
+    conn->state = UPSTREAM_CONNECTING;
+    conn->watch = WATCH_NONE;
+    timer_init(&conn->timeout, conn);
+    return conn;
+}
+
+
+/* Takes a connection to u from its pool, or opens a new one. */
+struct upstream_conn *upstream_get(struct upstream *u) {
+    struct upstream_conn *conn = u->idle;
+    if (!conn) return upstream_connect(u);
+
+    u->idle = conn->next;
+    u->idle_count--;
+    conn->state = UPSTREAM_SENDING;
+    conn->reused = 1;
+    stats_add(&stats.upstream_reuses, 1);
+    return conn;
+}
+
+
+/* Puts a connection whose response has been read to the end back in its
+ * backend's pool, or closes it if it can't be reused. */
+void upstream_put(struct upstream_conn *conn) {
+    struct upstream *u = conn->upstream;
+    if (!conn->keep_alive || u->idle_count == UPSTREAM_MAX_IDLE) {
+        upstream_close(conn);
+        return;
+    }
+
+    pool_put(conn->buffer);
+    conn->buffer = 0;
+    conn->client = 0;
+    conn->state = UPSTREAM_IDLE;
+    conn->next = u->idle;
+    u->idle = conn;
+    u->idle_count++;
+    upstream_watch(conn, WATCH_READ);
+    timer_set(&conn->timeout, UPSTREAM_IDLE_TIMEOUT);
+}
+
+
+/* Ends the proxied request of a client that is being dropped. Its
+ * response was cut short, so the connection can't be reused. */
+void upstream_detach(struct client_info *client) {
+    struct upstream_conn *conn = client->upstream;
+    if (conn->fill) micro_fill_end(conn->fill, 0);
+    conn->fill = 0;
+    client->upstream = 0;
+    conn->client = 0;
+    conn->upstream->outstanding--;
+    upstream_close(conn);
+}
+
+
+/* Defined with the rest of the proxy further down. */
+void upstream_failed(struct upstream_conn *conn, int status);
+
+/* Defined with the request body handlers further down. */
+void abort_body(struct client_info *client);
+
+/* Defined with the WebSocket hub further down. */
+void ws_leave(struct client_info *client);
+int ws_idle(struct client_info *client);
+
+
+/* Closes the connection and lets go of everything the client holds. Any
+ * client may be dropped while the loop handles another one's event, so
+ * the client_info itself is only reused once the loop calls
+ * recycle_dropped_clients(); its next link is left as it is, so the
+ * select() loop can still walk on from it. */
+void drop_client(struct client_info *client) {
+    if (client->dropped) return;
+    client->dropped = 1;
+
+#if defined(USE_EPOLL)
+    unwatch_socket(client->socket);
+#endif
+    CLOSESOCKET(client->socket);
+    timer_cancel(&client->timeout);
+    stats_add(&stats.closed, 1);
+
+#if defined(USE_IO_POOL)
+    /* A job still running is left to finish on its own, taking the
+     * file it is reading with it. */
+    if (client->io) {
+        client->io->client = 0;
+        if (client->io->file) client->file = 0;
+        client->io = 0;
+    }
+#endif
+
+    if (client->upstream) upstream_detach(client);
+    if (client->buffer && client->buffer->fill) micro_unwait(client);
+    if (client->buffer && client->buffer->body.handler) abort_body(client);
+    if (client->ws) ws_leave(client);
+    if (client->micro) {
+        micro_release(&micro, client->micro);
+        client->micro = 0;
+    }
+
+    if (client->file) {
+        fclose(client->file);
+        client->file = 0;
+    }
+
+#if defined(USE_CACHE)
+    if (client->cached) {
+        cache_release(client->cached);
+        client->cached = 0;
+    }
+#endif
+#if defined(USE_PACK)
+    if (client->pack) {
+        pack_release(client->pack);
+        client->pack = 0;
+    }
+#endif
+
+    release_buffer(client);
+    client->received = 0;
+    client_table[(size_t)client->socket] = 0;
+
+    if (client->prev) client->prev->next = client->next;
+    else clients = client->next;
+    if (client->next) client->next->prev = client->prev;
+    client_count--;
+
+    client->next_dropped = dropped_clients;
+    dropped_clients = client;
+}
+
+
+/* Called by the loop between batches of events, when none of them can
+ * refer to a dropped client any more. */
+void recycle_dropped_clients() {
+    while (dropped_clients) {
+        struct client_info *client = dropped_clients;
+        dropped_clients = client->next_dropped;
+        client->next = free_clients;
+        free_clients = client;
+    }
+}
+
+
+/* Requests are logged through a ring that the writer thread in
+ * access_log.h drains, so the loop never waits on the log. */
+static struct log_ring access_log;
+
+
+/* Logs and counts the response that has just been queued for client.
+ * Every response starts with its status line, so the status is read
+ * from there. */
+void log_response(struct client_info *client,
+        const char *method, const char *path) {
+    unsigned long bytes = 0;
+    int i;
+    for (i = 0; i < client->part_count; ++i)
+        bytes += (unsigned long)client->buffer->parts[i].length;
+
+    int status = client->part_count ?
+        atoi(client->buffer->parts[0].data + 9) : 0;
+    stats_status(&stats, status);
+    log_request(&access_log, client->address_text, method, path,
+            status, bytes);
+}
+
+
+
+
+#if defined(USE_EPOLL)
+#define MAX_EVENTS 256
+
+/* The listening socket and every client are registered with epoll once,
+ * so a wakeup only costs as much as the number of ready sockets. The
+ * wait ends in time for the nearest client deadline. */
+int wait_on_clients(struct epoll_event *events) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, (int)timer_next_ms());
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "epoll_wait() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+    return n;
+}
+
+#else
+void wait_on_clients(SOCKET server, int accepting,
+        fd_set *reads, fd_set *writes) {
+    FD_ZERO(reads);
+    FD_ZERO(writes);
+    if (accepting) FD_SET(server, reads);
+    SOCKET max_socket = server;
+
+#if defined(USE_CACHE)
+    if (cache_inotify >= 0) {
+        FD_SET(cache_inotify, reads);
+        if (cache_inotify > max_socket)
+            max_socket = cache_inotify;
+    }
+#endif
+
+    struct client_info *ci = clients;
+
+#if defined(USE_IO_POOL)
+    FD_SET(io_eventfd, reads);
+    if (io_eventfd > max_socket)
+        max_socket = io_eventfd;
+#endif
+
+    int i;
+    for (i = 0; upstream_conns && i < UPSTREAM_CONNECTIONS; ++i) {
+        struct upstream_conn *conn = &upstream_conns[i];
+        if (conn->watch == WATCH_NONE) continue;
+        FD_SET(conn->socket, conn->watch == WATCH_READ ? reads : writes);
+        if (conn->socket > max_socket)
+            max_socket = conn->socket;
+    }
+
+    while(ci) {
+#if defined(USE_IO_POOL)
+        if (ci->io) {
+            ci = ci->next;
+            continue;
+        }
+#endif
+        if ((ci->upstream && !ci->writing) ||
+                (ci->buffer && ci->buffer->fill)) {
+            ci = ci->next;
+            continue;
+        }
+        FD_SET(ci->socket, ci->writing ? writes : reads);
+        if (ci->socket > max_socket)
+            max_socket = ci->socket;
+        ci = ci->next;
+    }
+
+    long ms = timer_next_ms();
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+
+    if (select(max_socket+1, reads, writes, 0,
+                ms < 0 ? 0 : &timeout) < 0) {
+        if (GETSOCKETERRNO() == EINTR) {
+            FD_ZERO(reads);
+            FD_ZERO(writes);
+            return;
+        }
+        fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+}
+#endif
+
+
+/* Each client has one deadline, in milliseconds, for what it is doing:
+ * sending the headers of a request (counted from its first byte, so a
+ * trickle of bytes doesn't extend it), waiting idle between requests,
+ * or taking a response that can't be written. */
+#define REQUEST_TIMEOUT 10000
+#define KEEPALIVE_TIMEOUT 5000
+#define WRITE_TIMEOUT 10000
+#define KEEPALIVE_MAX_REQUESTS 100
+
+#if defined(STATS_INTERVAL)
+/* With -DSTATS_INTERVAL=seconds, the status report is also written to
+ * stderr that often. Its timer lives in the same wheel as the clients'. */
+static struct timer stats_timer;
+#endif
+
+void drop_expired_clients() {
+    timer_advance();
+    while (timer_expired.next != &timer_expired) {
+#if defined(STATS_INTERVAL)
+        if (timer_expired.next == &stats_timer) {
+            static char report[1024];
+            fwrite(report, 1, stats_format(report), stderr);
+            timer_set(&stats_timer, STATS_INTERVAL * 1000);
+            continue;
+        }
+#endif
+        void *data = timer_expired.next->data;
+        if (is_upstream(data)) {
+            upstream_failed((struct upstream_conn*)data, 504);
+            continue;
+        }
+        if (ws_idle((struct client_info*)data)) continue;
+        stats_add(&stats.dropped, 1);
+        drop_client((struct client_info*)data);
+    }
+}
+
+
+void queue_output(struct client_info *client,
+        const char *data, size_t length) {
+    if (!length) return;
+    client->buffer->parts[client->part_count].data = data;
+    client->buffer->parts[client->part_count].length = length;
+    client->part_count++;
+}
+
+
+void queue_file(struct client_info *client, size_t offset, size_t length) {
+    if (!length) return;
+    client->buffer->parts[client->part_count].data = 0;
+    client->buffer->parts[client->part_count].offset = offset;
+    client->buffer->parts[client->part_count].length = length;
+    client->part_count++;
+}
+
+
+/* The responders below only queue the response. finish_response()
+ * writes it and then drops the client unless client->keep_alive is
+ * still set. */
+
+void send_400(struct client_info *client) {
+    const char *c400 = "HTTP/1.1 400 Bad Request\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 11\r\n\r\nBad Request";
+    queue_output(client, c400, strlen(c400));
+    client->keep_alive = 0;
+}
+
+void send_404(struct client_info *client) {
+    const char *c404 = client->keep_alive ?
+        "HTTP/1.1 404 Not Found\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 9\r\n\r\nNot Found" :
+        "HTTP/1.1 404 Not Found\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 9\r\n\r\nNot Found";
+    queue_output(client, c404, strlen(c404));
+}
+
+/* Answers a request whose body couldn't be taken. The rest of the body
+ * isn't read, so the connection is closed. */
+void send_500(struct client_info *client) {
+    const char *c500 = "HTTP/1.1 500 Internal Server Error\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 21\r\n\r\nInternal Server Error";
+    queue_output(client, c500, strlen(c500));
+    client->keep_alive = 0;
+}
+
+/* Answers a request shed under overload. It costs next to nothing to
+ * send, and closing the connection sheds the client's next requests
+ * too. */
+void send_503(struct client_info *client) {
+    const char *c503 = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Connection: close\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Length: 19\r\n\r\nService Unavailable";
+    queue_output(client, c503, strlen(c503));
+    client->keep_alive = 0;
+}
+
+
+/* Answers a proxied request whose backend failed, or went quiet for
+ * longer than UPSTREAM_TIMEOUT. */
+void send_502(struct client_info *client) {
+    const char *c502 = client->keep_alive ?
+        "HTTP/1.1 502 Bad Gateway\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 11\r\n\r\nBad Gateway" :
+        "HTTP/1.1 502 Bad Gateway\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 11\r\n\r\nBad Gateway";
+    queue_output(client, c502, strlen(c502));
+}
+
+void send_504(struct client_info *client) {
+    const char *c504 = client->keep_alive ?
+        "HTTP/1.1 504 Gateway Timeout\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 15\r\n\r\nGateway Timeout" :
+        "HTTP/1.1 504 Gateway Timeout\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 15\r\n\r\nGateway Timeout";
+    queue_output(client, c504, strlen(c504));
+}
+
+
+int would_block() {
+#if defined(_WIN32)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+
+#define FILE_BSIZE 65536
+
+/* Sends the next piece of a file part. With sendfile() the kernel copies
+ * straight from the page cache to the socket, starting at the part's
+ * offset. Otherwise, or if sendfile() isn't supported for this file, up
+ * to FILE_BSIZE bytes are read and sent. Returns the number of bytes
+ * sent, 0 if the socket would block, or -1 on error. */
+long send_file_chunk(struct client_info *client,
+        const struct response_part *part) {
+#if defined(USE_SENDFILE)
+    off_t offset = (off_t)part->offset;
+    ssize_t s = sendfile(client->socket, fileno(client->file),
+            &offset, part->length);
+    if (s > 0) return (long)s;
+    if (s == 0) return -1;
+    if (would_block()) return 0;
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+#endif
+
+    char buffer[FILE_BSIZE];
+    size_t n = part->length < FILE_BSIZE ? part->length : FILE_BSIZE;
+
+    if (fseek(client->file, (long)part->offset, SEEK_SET))
+        return -1;
+    n = fread(buffer, 1, n, client->file);
+    if (n == 0) return -1;
+
+    int r = send(client->socket, buffer, (int)n, 0);
+    if (r < 0) return would_block() ? 0 : -1;
+    return r;
+}
+
+
+/* Sends the unsent parts up to the next file part, all at once with
+ * sendmsg() where it exists. Returns the number of bytes sent, or -1
+ * with the error in errno. */
+long send_parts(struct client_info *client) {
+#if defined(_WIN32)
+    struct response_part *part = &client->buffer->parts[client->part_sent];
+    return send(client->socket, part->data, (int)part->length, 0);
+#else
+    struct iovec iov[MAX_PARTS];
+    int i, n = 0;
+    for (i = client->part_sent;
+            i < client->part_count && client->buffer->parts[i].data; ++i) {
+        iov[n].iov_base = (void*)client->buffer->parts[i].data;
+        iov[n].iov_len = client->buffer->parts[i].length;
+        ++n;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    /* When a file part follows, MSG_MORE holds back a partly filled
+     * segment so the headers share it with the start of the body instead
+     * of going out on their own. */
+    int flags = 0;
+#if defined(MSG_MORE)
+    if (i < client->part_count) flags = MSG_MORE;
+#endif
+    return (long)sendmsg(client->socket, &msg, flags);
+#endif
+}
+
+
+/* Writes as much of the queued response as the socket will take.
+ * Returns 1 once all of it has been sent, 0 if the socket would block,
+ * 2 if the client has been parked until the I/O pool reads in more of
+ * the file, or -1 on error. */
+int flush_client(struct client_info *client) {
+    while (client->part_sent < client->part_count) {
+        struct response_part *part = &client->buffer->parts[client->part_sent];
+
+        if (!part->data) {
+            struct response_part chunk = *part;
+#if defined(USE_IO_POOL)
+            if (!io_ready_to_send(client, part)) return 2;
+            if (chunk.length > client->ready_end - chunk.offset)
+                chunk.length = client->ready_end - chunk.offset;
+#endif
+            long r = send_file_chunk(client, &chunk);
+            if (r == 0) return 0;
+            if (r < 0) return -1;
+            stats_add(&stats.bytes_sent, (unsigned long)r);
+            part->offset += r;
+            part->length -= r;
+            if (!part->length) client->part_sent++;
+            continue;
+        }
+
+        long r = send_parts(client);
+        if (r < 0 && would_block()) return 0;
+        if (r < 1) return -1;
+        stats_add(&stats.bytes_sent, (unsigned long)r);
+
+        while (r > 0) {
+            part = &client->buffer->parts[client->part_sent];
+            if ((size_t)r < part->length) {
+                part->data += r;
+                part->length -= r;
+                break;
+            }
+            r -= (long)part->length;
+            client->part_sent++;
+        }
+    }
+
+    if (client->file) {
+        fclose(client->file);
+        client->file = 0;
+    }
+#if defined(USE_CACHE)
+    if (client->cached) {
+        cache_release(client->cached);
+        client->cached = 0;
+    }
+#endif
+#if defined(USE_PACK)
+    if (client->pack) {
+        pack_release(client->pack);
+        client->pack = 0;
+    }
+#endif
+    if (client->micro) {
+        micro_release(&micro, client->micro);
+        client->micro = 0;
+    }
+    client->part_count = 0;
+    client->part_sent = 0;
+    return 1;
+}
+
+
+/* Checks whether the request's If-None-Match or, without one,
+ * If-Modified-Since shows that the client's copy is still current. */
+int not_modified(struct client_info *client, const struct file_info *info) {
+    const char *buf = client->buffer->request;
+    const struct http_span *match =
+        http_get_header(&client->buffer->parser, buf, "if-none-match");
+
+    if (match) {
+        const char *p = buf + match->offset;
+        const char *end = p + match->length;
+        int length = (int)strlen(info->etag);
+
+        /* GET compares ETags weakly, so a W/ prefix is ignored. */
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+            if (p < end && *p == '*') return 1;
+            if (end - p >= 2 && p[0] == 'W' && p[1] == '/') p += 2;
+
+            const char *start = p;
+            if (p < end && *p == '"') ++p;
+            while (p < end && *p != '"') ++p;
+            if (p < end) ++p;
+
+            if (p - start == length && strncmp(start, info->etag, length) == 0)
+                return 1;
+            while (p < end && *p != ',') ++p;
+        }
+        return 0;
+    }
+
+    const struct http_span *since =
+        http_get_header(&client->buffer->parser, buf, "if-modified-since");
+    if (since) {
+        time_t t = parse_http_date(buf + since->offset, since->length);
+        return t != -1 && info->mtime <= t;
+    }
+    return 0;
+}
+
+
+struct byte_range {
+    size_t start;
+    size_t length;
+};
+
+
+/* Reads a decimal number of at most 18 digits, which can't overflow.
+ * Returns the end of it, or 0 if there is none. */
+const char *parse_range_number(const char *p, const char *end,
+        size_t *value) {
+    const char *start = p;
+    *value = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - start < 18)
+        *value = *value * 10 + (size_t)(*p++ - '0');
+    if (p == start || (p < end && *p >= '0' && *p <= '9')) return 0;
+    return p;
+}
+
+
+/* Parses a Range header such as "bytes=0-499, 1000-, -200" against a
+ * body of size bytes. Returns the number of satisfiable ranges stored in
+ * ranges, 0 if none of them can be satisfied, or -1 if the header should
+ * be ignored because it is malformed or asks for more than MAX_RANGES
+ * ranges. */
+int parse_ranges(const char *p, const char *end, size_t size,
+        struct byte_range *ranges) {
+    int specs = 0, count = 0;
+
+    if (end - p < 6 || strncmp(p, "bytes=", 6)) return -1;
+    p += 6;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+        if (p == end) break;
+        if (++specs > MAX_RANGES) return -1;
+
+        size_t first, last;
+        if (*p == '-') {
+            /* A suffix range: the last n bytes. */
+            p = parse_range_number(p + 1, end, &last);
+            if (!p) return -1;
+            if (last == 0 || size == 0) continue;
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        } else {
+            p = parse_range_number(p, end, &first);
+            if (!p || p == end || *p++ != '-') return -1;
+            if (p < end && *p >= '0' && *p <= '9') {
+                p = parse_range_number(p, end, &last);
+                if (!p || last < first) return -1;
+            } else {
+                last = size - 1;
+            }
+            if (first >= size) continue;
+            if (last >= size) last = size - 1;
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        if (p < end && *p != ',') return -1;
+
+        ranges[count].start = first;
+        ranges[count].length = last - first + 1;
+        ++count;
+    }
+
+    return specs ? count : -1;
+}
+
+
+/* Checks the request's If-Range, if any. A range is only sent if the
+ * client's copy is exactly the one we have: the ETag must match
+ * strongly, or the date must be our Last-Modified. */
+int if_range_matches(struct client_info *client,
+        const struct file_info *info) {
+    const char *buf = client->buffer->request;
+    const struct http_span *if_range =
+        http_get_header(&client->buffer->parser, buf, "if-range");
+    if (!if_range) return 1;
+
+    const char *value = buf + if_range->offset;
+    int length = if_range->length;
+    const char *expected = *value == '"' ? info->etag : info->last_modified;
+    return length == (int)strlen(expected) &&
+        strncmp(value, expected, length) == 0;
+}
+
+
+/* Queues a 206 or 416 response if the request asks for a range of body,
+ * which is either in memory or, if body is 0, in client->file. Returns 0
+ * if the whole body should be sent instead. */
+int queue_ranges(struct client_info *client, const struct file_info *info,
+        const char *content_type, const char *encoding, const char *body) {
+    static unsigned long boundary_count = 0;
+
+    const char *buf = client->buffer->request;
+    const struct http_span *range =
+        http_get_header(&client->buffer->parser, buf, "range");
+    if (!range || !if_range_matches(client, info)) return 0;
+
+    struct byte_range ranges[MAX_RANGES];
+    int count = parse_ranges(buf + range->offset,
+            buf + range->offset + range->length, info->size, ranges);
+    if (count < 0) return 0;
+
+    /* A compressed variant is only sent in single ranges, so that
+     * Content-Encoding applies to the whole response body. */
+    if (count > 1 && encoding) return 0;
+
+    const char *connection = client->keep_alive ? "keep-alive" : "close";
+    char *o = client->buffer->output;
+
+    if (count == 0) {
+        o += sprintf(o, "HTTP/1.1 416 Range Not Satisfiable\r\n");
+        o += sprintf(o, "Connection: %s\r\n", connection);
+        o += sprintf(o, "Content-Range: bytes */%lu\r\n",
+                (unsigned long)info->size);
+        o += sprintf(o, "Content-Length: 0\r\n\r\n");
+        queue_output(client, client->buffer->output,
+                o - client->buffer->output);
+        return 1;
+    }
+
+    if (count == 1) {
+        o += sprintf(o, "HTTP/1.1 206 Partial Content\r\n");
+        o += sprintf(o, "Connection: %s\r\n", connection);
+        o += sprintf(o, "Content-Length: %lu\r\n",
+                (unsigned long)ranges[0].length);
+        o += sprintf(o, "Content-Range: bytes %lu-%lu/%lu\r\n",
+                (unsigned long)ranges[0].start,
+                (unsigned long)(ranges[0].start + ranges[0].length - 1),
+                (unsigned long)info->size);
+        o += sprintf(o, "Content-Type: %s\r\n", content_type);
+        if (encoding)
+            o += sprintf(o, "Content-Encoding: %s\r\n", encoding);
+        o = write_validators(o, info, content_type, encoding);
+        o += sprintf(o, "\r\n");
+        queue_output(client, client->buffer->output,
+                o - client->buffer->output);
+
+        if (body)
+            queue_output(client, body + ranges[0].start, ranges[0].length);
+        else
+            queue_file(client, ranges[0].start, ranges[0].length);
+        return 1;
+    }
+
+    /* Several ranges go out as multipart/byteranges. Each part's headers
+     * are written first, so the response headers can give the total
+     * Content-Length, and the headers then go at the front of the
+     * queue. MAX_RANGES is small enough for all of it to fit in output. */
+    char boundary[40];
+    sprintf(boundary, "%08lx%08lx", (unsigned long)time(0),
+            ++boundary_count);
+
+    char *part_headers[MAX_RANGES];
+    int part_lengths[MAX_RANGES];
+    size_t length = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        part_headers[i] = o;
+        o += sprintf(o, "\r\n--%s\r\n", boundary);
+        o += sprintf(o, "Content-Type: %s\r\n", content_type);
+        o += sprintf(o, "Content-Range: bytes %lu-%lu/%lu\r\n\r\n",
+                (unsigned long)ranges[i].start,
+                (unsigned long)(ranges[i].start + ranges[i].length - 1),
+                (unsigned long)info->size);
+        part_lengths[i] = (int)(o - part_headers[i]);
+        length += part_lengths[i] + ranges[i].length;
+    }
+
+    char *closing = o;
+    o += sprintf(o, "\r\n--%s--\r\n", boundary);
+    int closing_length = (int)(o - closing);
+    length += closing_length;
+
+    char *headers = o;
+    o += sprintf(o, "HTTP/1.1 206 Partial Content\r\n");
+    o += sprintf(o, "Connection: %s\r\n", connection);
+    o += sprintf(o, "Content-Length: %lu\r\n", (unsigned long)length);
+    o += sprintf(o, "Content-Type: multipart/byteranges; boundary=%s\r\n",
+            boundary);
+    o = write_validators(o, info, content_type, encoding);
+    o += sprintf(o, "\r\n");
+    queue_output(client, headers, o - headers);
+
+    for (i = 0; i < count; ++i) {
+        queue_output(client, part_headers[i], part_lengths[i]);
+        if (body)
+            queue_output(client, body + ranges[i].start, ranges[i].length);
+        else
+            queue_file(client, ranges[i].start, ranges[i].length);
+    }
+    queue_output(client, closing, closing_length);
+    return 1;
+}
+
+
+#if defined(USE_CACHE)
+void serve_cached(struct client_info *client, struct cache_entry *e) {
+    const char *connection = client->keep_alive ?
+        "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    e->refs++;
+    client->cached = e;
+
+    if (not_modified(client, &e->info)) {
+        queue_output(client, e->not_modified, e->not_modified_length);
+        queue_output(client, connection, strlen(connection));
+        return;
+    }
+
+    if (queue_ranges(client, &e->info, e->content_type, e->encoding, e->body))
+        return;
+
+    queue_output(client, e->headers, e->headers_length);
+    queue_output(client, connection, strlen(connection));
+    queue_output(client, e->body, e->body_length);
+}
+#endif
+
+
+void send_304(struct client_info *client, const struct file_info *info,
+        const char *content_type, const char *encoding) {
+    char *o = client->buffer->output;
+    o += sprintf(o, "HTTP/1.1 304 Not Modified\r\n");
+    o += sprintf(o, "Connection: %s\r\n",
+            client->keep_alive ? "keep-alive" : "close");
+    o = write_validators(o, info, content_type, encoding);
+    o += sprintf(o, "\r\n");
+    queue_output(client, client->buffer->output, o - client->buffer->output);
+}
+
+
+void serve_file(struct client_info *client, FILE *fp,
+        const struct file_info *info,
+        const char *content_type, const char *encoding) {
+    client->file = fp;
+    if (queue_ranges(client, info, content_type, encoding, 0)) return;
+
+    char *o = client->buffer->output;
+    o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+    o += sprintf(o, "Connection: %s\r\n",
+            client->keep_alive ? "keep-alive" : "close");
+    o += sprintf(o, "Content-Length: %lu\r\n", (unsigned long)info->size);
+    o += sprintf(o, "Content-Type: %s\r\n", content_type);
+    if (encoding)
+        o += sprintf(o, "Content-Encoding: %s\r\n", encoding);
+    o = write_validators(o, info, content_type, encoding);
+    o += sprintf(o, "Accept-Ranges: bytes\r\n\r\n");
+    queue_output(client, client->buffer->output, o - client->buffer->output);
+    queue_file(client, 0, info->size);
+}
+
+
+/* Checks whether the request's Accept-Encoding lists coding (given in
+ * lower case) without refusing it with q=0. */
+int accepts_encoding(struct client_info *client, const char *coding) {
+    const char *buf = client->buffer->request;
+    const struct http_span *accept =
+        http_get_header(&client->buffer->parser, buf, "accept-encoding");
+    if (!accept) return 0;
+
+    const char *p = buf + accept->offset;
+    const char *end = p + accept->length;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            ++p;
+
+        struct http_span name;
+        name.offset = (int)(start - buf);
+        name.length = (int)(p - start);
+        int match = name.length && http_span_equals(buf, name, coding);
+
+        int refused = 0;
+        while (p < end && *p != ',') {
+            if (*p++ != ';') continue;
+            while (p < end && (*p == ' ' || *p == '\t')) ++p;
+            if (end - p < 3 || (*p != 'q' && *p != 'Q') || p[1] != '=')
+                continue;
+
+            const char *q = p + 2;
+            refused = *q++ == '0';
+            if (q < end && *q == '.')
+                for (++q; q < end && *q >= '0' && *q <= '9'; ++q)
+                    if (*q != '0') refused = 0;
+        }
+
+        if (match) return !refused;
+    }
+    return 0;
+}
+
+
+/* Serves the variant of path compressed with encoding, from a sidecar
+ * file or, with zlib, compressed here. Returns 0 if there is none. */
+int serve_encoded(struct client_info *client, const char *path,
+        const char *content_type, const struct encoding *encoding) {
+#if defined(USE_CACHE)
+    char key[128];
+    sprintf(key, "%s\t%s", path, encoding->name);
+
+    struct cache_entry *e = cache_lookup(key);
+    if (e) {
+        if (e->missing) return 0;
+        serve_cached(client, e);
+        return 1;
+    }
+#endif
+
+    char full_path[128];
+    get_full_path(full_path, path, encoding->suffix);
+
+    struct file_info info;
+    FILE *fp = 0;
+    if (get_file_info(full_path, &info) == 0) {
+        if (not_modified(client, &info)) {
+            send_304(client, &info, content_type, encoding->name);
+            return 1;
+        }
+        fp = fopen(full_path, "rb");
+    }
+
+#if defined(USE_IO_POOL)
+    if (fp && !io_ready_to_read(client, fp, &info, full_path)) {
+        fclose(fp);
+        return 1;
+    }
+#endif
+
+    if (fp) {
+#if defined(USE_CACHE)
+        e = cache_insert(key, fp, &info, content_type, encoding->name);
+        if (e) {
+            fclose(fp);
+            serve_cached(client, e);
+            return 1;
+        }
+#endif
+        serve_file(client, fp, &info, content_type, encoding->name);
+        return 1;
+    }
+
+#if defined(USE_CACHE)
+#if defined(USE_ZLIB)
+    if (strcmp(encoding->name, "gzip") == 0) {
+        e = cache_compress(key, path, content_type);
+        if (e) {
+            serve_cached(client, e);
+            return 1;
+        }
+    }
+#endif
+    cache_add_missing(key);
+#endif
+    return 0;
+}
+
+
+#if defined(USE_PACK)
+/* Serves path from the docroot pack. Finding it is a hash probe, and
+ * the prebuilt headers and the body are sent straight from the mapping. */
+void serve_packed(struct client_info *client, const char *path) {
+    struct pack *pack = docroot_pack;
+    const struct pack_entry *e = pack_find(pack, path, strlen(path));
+    if (!e) {
+        send_404(client);
+        return;
+    }
+
+    int v = 0;
+    int i;
+    for (i = 1; i < PACK_VARIANTS; ++i) {
+        if (e->variants[i].headers_length &&
+                accepts_encoding(client, pack_encodings[i])) {
+            v = i;
+            break;
+        }
+    }
+
+    const struct pack_variant *pv = &e->variants[v];
+    const char *content_type = pack->data + e->content_type;
+    const char *body = pack->data + pv->body;
+
+    struct file_info info;
+    info.size = pv->body_length;
+    info.mtime = (time_t)pv->mtime;
+    strcpy(info.etag, pack->data + pv->etag);
+    strcpy(info.last_modified, pack->data + pv->last_modified);
+
+    const char *connection = client->keep_alive ?
+        "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    pack->refs++;
+    client->pack = pack;
+
+    if (not_modified(client, &info)) {
+        queue_output(client, pack->data + pv->not_modified,
+                pv->not_modified_length);
+        queue_output(client, connection, strlen(connection));
+        return;
+    }
+
+    if (queue_ranges(client, &info, content_type, pack_encodings[v], body))
+        return;
+
+    queue_output(client, pack->data + pv->headers, pv->headers_length);
+    queue_output(client, connection, strlen(connection));
+    queue_output(client, body, pv->body_length);
+}
+#endif
+
+
+/* Answers /server-status with the counters from server_stats.h. The
+ * report is small enough to share the output buffer with its headers. */
+void send_status(struct client_info *client) {
+    char report[768];
+    int length = stats_format(report);
+
+    char *o = client->buffer->output;
+    o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+    o += sprintf(o, "Connection: %s\r\n",
+            client->keep_alive ? "keep-alive" : "close");
+    o += sprintf(o, "Content-Length: %d\r\n", length);
+    o += sprintf(o, "Content-Type: text/plain\r\n");
+    o += sprintf(o, "Cache-Control: no-store\r\n\r\n");
+    memcpy(o, report, length);
+    o += length;
+    queue_output(client, client->buffer->output, o - client->buffer->output);
+}
+
+
+void serve_resource(struct client_info *client, const char *path) {
+    if (strcmp(path, "/server-status") == 0) {
+        send_status(client);
+        return;
+    }
+
+    if (strcmp(path, "/") == 0) path = "/index.html";
+
+    if (strlen(path) > 100) {
+        send_400(client);
+        return;
+    }
+
+    if (strstr(path, "..")) {
+        send_404(client);
+        return;
+    }
+
+#if defined(USE_PACK)
+    if (docroot_pack) {
+        serve_packed(client, path);
+        return;
+    }
+#endif
+
+    const char *ct = get_content_type(path);
+
+    if (is_compressible(ct)) {
+        size_t i;
+        for (i = 0; i < ENCODINGS; ++i)
+            if (accepts_encoding(client, encodings[i].name) &&
+                    serve_encoded(client, path, ct, &encodings[i]))
+                return;
+    }
+
+#if defined(USE_CACHE)
+    struct cache_entry *e = cache_lookup(path);
+    if (e) {
+        serve_cached(client, e);
+        return;
+    }
+#endif
+
+    char full_path[128];
+    get_full_path(full_path, path, "");
+
+    /* A client revalidating its copy is answered from the file's
+     * metadata alone. */
+    struct file_info info;
+    if (get_file_info(full_path, &info)) {
+        send_404(client);
+        return;
+    }
+
+    if (not_modified(client, &info)) {
+        send_304(client, &info, ct, 0);
+        return;
+    }
+
+    FILE *fp = fopen(full_path, "rb");
+
+    if (!fp) {
+        send_404(client);
+        return;
+    }
+
+#if defined(USE_IO_POOL)
+    if (!io_ready_to_read(client, fp, &info, full_path)) {
+        fclose(fp);
+        return;
+    }
+#endif
+
+#if defined(USE_CACHE)
+    e = cache_insert(path, fp, &info, ct, 0);
+    if (e) {
+        fclose(fp);
+        serve_cached(client, e);
+        return;
+    }
+#endif
+
+    serve_file(client, fp, &info, ct, 0);
+}
+
+
+/* Connections are admitted up to max_connections, which -c sets. At the
+ * ceiling the listening socket is no longer watched, so new connections
+ * wait in the kernel's backlog rather than take descriptors and memory
+ * from the ones being served. By default the ceiling leaves
+ * RESERVED_FDS descriptors of the process's limit for everything else,
+ * and UPSTREAM_CONNECTIONS more when proxying. */
+#define RESERVED_FDS 16
+#define ACCEPT_BATCH 64
+
+static int max_connections = 0;
+static int accepting = 1;
+
+#if !defined(_WIN32)
+/* Held open so that one descriptor can be freed when accept() fails for
+ * lack of them. */
+static int spare_fd = -1;
+#endif
+
+
+int default_max_connections() {
+    long limit = 1L << 20;
+#if !defined(_WIN32)
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+            rl.rlim_cur < (rlim_t)limit)
+        limit = (long)rl.rlim_cur;
+#endif
+#if !defined(USE_EPOLL)
+    /* select() can't watch a descriptor past FD_SETSIZE. */
+    if (limit > FD_SETSIZE) limit = FD_SETSIZE;
+#endif
+    /* Connections to backends come out of the same limit. */
+    if (route_count)
+        limit -= limit > 2 * UPSTREAM_CONNECTIONS ?
+            UPSTREAM_CONNECTIONS : limit / 2;
+    return limit > 2 * RESERVED_FDS ? (int)(limit - RESERVED_FDS) :
+        (int)(limit / 2);
+}
+
+
+void pause_accepting(SOCKET server) {
+    accepting = 0;
+#if defined(USE_EPOLL)
+    unwatch_socket(server);
+#else
+    (void)server;
+#endif
+}
+
+void resume_accepting(SOCKET server) {
+    accepting = 1;
+#if defined(USE_EPOLL)
+    watch_socket(server, 0);
+#else
+    (void)server;
+#endif
+}
+
+
+/* Handles a failed accept(). Returns 1 if there may be more connections
+ * to accept. */
+int accept_failed(SOCKET server) {
+    if (would_block()) return 0;
+
+#if !defined(_WIN32)
+    /* The connection was reset while it waited in the backlog. */
+    if (errno == EINTR || errno == ECONNABORTED) return 1;
+
+    /* Out of descriptors. The connection would stay in the backlog and
+     * wake the loop again at once, so the spare descriptor is given up to
+     * accept and close it, which the client sees as a reset. */
+    if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+        close(spare_fd);
+        SOCKET s = accept(server, 0, 0);
+        if (ISVALIDSOCKET(s)) {
+            CLOSESOCKET(s);
+            stats_add(&stats.dropped, 1);
+        }
+        spare_fd = open("/dev/null", O_RDONLY);
+        return ISVALIDSOCKET(s);
+    }
+#endif
+
+    fprintf(stderr, "accept() failed. (%d)\n", GETSOCKETERRNO());
+    return 0;
+}
+
+
+/* Accepts one connection. Returns 1 if there may be more to accept. */
+int accept_client(SOCKET server) {
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+
+#if defined(__linux__)
+    SOCKET socket_client = accept4(server,
+            (struct sockaddr*) &address, &address_length, SOCK_NONBLOCK);
+#else
+    SOCKET socket_client = accept(server,
+            (struct sockaddr*) &address, &address_length);
+#endif
+
+    if (!ISVALIDSOCKET(socket_client))
+        return accept_failed(server);
+
+    /* Responses on a kept-alive connection must not wait for the
+     * client's delayed ACK of the previous response. */
+    int yes = 1;
+    setsockopt(socket_client, IPPROTO_TCP, TCP_NODELAY,
+            (const char*)&yes, sizeof(yes));
+
+    /* A slow reader must never block the loop, so responses are written
+     * only as fast as each socket accepts them. accept4() has already
+     * made the socket non-blocking. */
+#if defined(_WIN32)
+    unsigned long nonblocking = 1;
+    ioctlsocket(socket_client, FIONBIO, &nonblocking);
+#elif !defined(__linux__)
+    fcntl(socket_client, F_SETFL, fcntl(socket_client, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    stats_add(&stats.accepted, 1);
+    struct client_info *client = get_client(socket_client);
+
+    /* The numeric address is looked up once here and kept for the log. */
+    getnameinfo((struct sockaddr*)&address, address_length,
+            client->address_text, sizeof(client->address_text), 0, 0,
+            NI_NUMERICHOST);
+
+#if defined(USE_EPOLL)
+    watch_socket(client->socket, client);
+#endif
+    timer_set(&client->timeout, REQUEST_TIMEOUT);
+    return 1;
+}
+
+
+/* Drains the backlog, but takes at most ACCEPT_BATCH connections per
+ * pass so that a flood of them can't hold up the clients already being
+ * served. Any left over are still ready on the next pass. */
+void accept_clients(SOCKET server) {
+    int i;
+    for (i = 0; i < ACCEPT_BATCH; ++i) {
+        if (client_count >= max_connections) {
+            pause_accepting(server);
+            return;
+        }
+        if (!accept_client(server)) return;
+    }
+}
+
+
+/* Load shedding, in the style of CoDel. A request's queue delay is how
+ * long it can have waited for the loop to get to it. If the loop slept,
+ * that is since it woke. If it found work already waiting, the request
+ * may have arrived while the pass before was busy, and if that pass's
+ * wait returned a full MAX_EVENTS, the request may have been ready and
+ * left behind even before then. Either way it can't have waited since
+ * before the loop last finished with its client.
+ *
+ * A delay above SHED_TARGET_US that clears within SHED_INTERVAL_US is a
+ * burst being absorbed. One that never drops below the target for a
+ * whole interval is a standing queue: then each request that has waited
+ * longer than the target gets a 503 at once, which is quicker than
+ * serving it and lets the queue drain. Otherwise only requests that have
+ * waited longer than the interval itself are shed. A server whose
+ * requests take milliseconds each can raise the target with
+ * -DSHED_TARGET_US. */
+#if !defined(SHED_TARGET_US)
+#define SHED_TARGET_US 5000
+#endif
+#define SHED_INTERVAL_US 100000
+#define SHED_NO_SLEEP_US 50
+
+static unsigned long queue_start = 0;
+static unsigned long last_woke = 0;
+static int left_behind = 0;
+static unsigned long shed_interval_end = 0;
+static unsigned long shed_min_delay = (unsigned long)-1;
+static int overloaded = 0;
+
+
+/* Called when the wait for events, begun at waited, returns. full is set
+ * if it may have left ready events behind. */
+void loop_woke(unsigned long waited, int full) {
+    unsigned long now = stats_now_us();
+    if (now - waited >= SHED_NO_SLEEP_US)
+        queue_start = now;
+    else if (!left_behind)
+        queue_start = last_woke;
+    left_behind = full;
+    last_woke = now;
+}
+
+
+int should_shed(struct client_info *client, unsigned long now) {
+    unsigned long since = client->served > queue_start ?
+        client->served : queue_start;
+    unsigned long delay = now - since;
+    if (delay < shed_min_delay) shed_min_delay = delay;
+
+    if (now >= shed_interval_end) {
+        overloaded = shed_min_delay > SHED_TARGET_US;
+        shed_min_delay = (unsigned long)-1;
+        shed_interval_end = now + SHED_INTERVAL_US;
+    }
+
+    return delay > (overloaded ? SHED_TARGET_US : SHED_INTERVAL_US);
+}
+
+
+/* HTTP/1.1 connections stay open unless the client asks to close;
+ * HTTP/1.0 connections only stay open if the client asks for it. */
+int wants_keep_alive(struct client_info *client) {
+    const struct http_request *req = &client->buffer->parser;
+    const struct http_span *connection =
+        http_get_header(req, client->buffer->request, "connection");
+
+    if (strncmp(client->buffer->request + req->version.offset,
+                "HTTP/1.1", 8) == 0)
+        return !connection ||
+            !http_span_has_token(client->buffer->request, *connection, "close");
+
+    return connection &&
+        http_span_has_token(client->buffer->request, *connection, "keep-alive");
+}
+
+
+/* Writes the queued response. Returns 1 if it was sent in full and the
+ * connection is ready for the next request. Returns 0 if the client is
+ * now waiting for the socket to become writable, or has been dropped. */
+int finish_response(struct client_info *client) {
+    int r = flush_client(client);
+    if (r == 2) return 0;
+
+    if (r == 0) {
+        if (!client->writing) set_writing(client, 1);
+        timer_set(&client->timeout, WRITE_TIMEOUT);
+        return 0;
+    }
+
+    if (r < 0 || !client->keep_alive) {
+        if (r < 0) stats_add(&stats.dropped, 1);
+        drop_client(client);
+        return 0;
+    }
+
+    if (client->writing) set_writing(client, 0);
+    timer_set(&client->timeout,
+            client->received ? REQUEST_TIMEOUT : KEEPALIVE_TIMEOUT);
+    return 1;
+}
+
+
+/* Removes the request at the front of the client's buffer, leaving
+ * whatever was pipelined after it. */
+void remove_request(struct client_info *client) {
+    struct http_request *req = &client->buffer->parser;
+    int length = req->length;
+    client->received -= length;
+    memmove(client->buffer->request, client->buffer->request + length,
+            client->received + 1);
+    http_reset(req);
+}
+
+
+/* Logs the response queued for the request at the front of the
+ * client's buffer, removes the request from the buffer and writes the
+ * response. Returns 1 if the client is ready for its next request.
+ * Latency runs from parsing the request to the first write of its
+ * response. */
+int complete_request(struct client_info *client,
+        const char *method, const char *path, unsigned long started) {
+    log_response(client, method, path);
+    remove_request(client);
+
+    int sent = finish_response(client);
+    unsigned long finished = stats_now_us();
+    stats_latency(&stats, finished - started);
+    if (!sent) return 0;
+    client->served = finished;
+    return 1;
+}
+
+
+void process_requests(struct client_info *client);
+
+
+/* Reads a Content-Length value into length. Returns 0 if it isn't a
+ * plain decimal number, or doesn't fit. */
+int parse_content_length(const char *buf, const struct http_span *span,
+        unsigned long *length) {
+    const char *p = buf + span->offset;
+    const char *end = p + span->length;
+    if (p == end) return 0;
+    *length = 0;
+    while (p < end) {
+        if (*p < '0' || *p > '9' || *length > ((unsigned long)-1 - 9) / 10)
+            return 0;
+        *length = *length * 10 + (unsigned long)(*p++ - '0');
+    }
+    return 1;
+}
+
+
+/* Returns the value of the named header like http_get_header(), but sets
+ * *twice if the message has it more than once. The headers that frame a
+ * body are looked up this way: a message that gives its length twice
+ * may be read one way here and another by whatever is in front of or
+ * behind the server, so it isn't taken at all. */
+const struct http_span *get_framing_header(const struct http_request *req,
+        const char *buf, const char *name, int *twice) {
+    const struct http_span *value = 0;
+    int i;
+    for (i = 0; i < req->header_count; ++i) {
+        if (!http_span_equals(buf, req->headers[i].name, name)) continue;
+        if (value) *twice = 1;
+        value = &req->headers[i].value;
+    }
+    return value;
+}
+
+
+/* Headers that only concern one connection, which a proxy doesn't pass
+ * on, along with any the message names in its own Connection header.
+ * Transfer-Encoding is kept, as chunked bodies are passed on as they
+ * are, and so is Content-Length, even if Connection names them, since
+ * the body is framed by them. */
+static const char *hop_by_hop[] = {
+    "connection", "keep-alive", "proxy-connection", "te", "trailer",
+    "upgrade"
+};
+
+int is_hop_by_hop(const char *buf, struct http_span name,
+        const struct http_span *connection) {
+    size_t i;
+    for (i = 0; i < sizeof(hop_by_hop) / sizeof(*hop_by_hop); ++i)
+        if (http_span_equals(buf, name, hop_by_hop[i])) return 1;
+    if (!connection || http_span_equals(buf, name, "transfer-encoding") ||
+            http_span_equals(buf, name, "content-length"))
+        return 0;
+
+    const char *p = buf + connection->offset;
+    const char *end = p + connection->length;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+        const char *start = p;
+        while (p < end && *p != ',') ++p;
+        const char *stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) --stop;
+        if (stop - start != name.length) continue;
+
+        int j;
+        for (j = 0; j < name.length; ++j) {
+            char a = start[j], b = buf[name.offset + j];
+            if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+            if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+            if (a != b) break;
+        }
+        if (j == name.length) return 1;
+    }
+    return 0;
+}
+
+
+/* Writes the request at the front of client's buffer to o as it goes to
+ * a backend: without hop-by-hop headers, with the client's address
+ * added to X-Forwarded-For, and asking for the connection to be kept
+ * alive. Returns its length, or 0 if it wouldn't fit in
+ * UPSTREAM_BUFFER. */
+int write_upstream_request(struct client_info *client, char *o) {
+    const char *buf = client->buffer->request;
+    const struct http_request *req = &client->buffer->parser;
+    const struct http_span *forwarded =
+        http_get_header(req, buf, "x-forwarded-for");
+    const struct http_span *connection =
+        http_get_header(req, buf, "connection");
+
+    /* Every header line is written at most 2 bytes longer than it was
+     * received. */
+    size_t bound = (size_t)req->length + 2 * req->header_count +
+        strlen(client->address_text) + 64;
+    if (bound > (size_t)UPSTREAM_BUFFER) return 0;
+
+    char *start = o;
+    o += sprintf(o, "%s %s ", buf + req->method.offset,
+            buf + req->path.offset);
+    memcpy(o, buf + req->version.offset, 8);
+    o += 8;
+    memcpy(o, "\r\n", 2);
+    o += 2;
+
+    int i;
+    for (i = 0; i < req->header_count; ++i) {
+        const struct http_header *h = &req->headers[i];
+        if (is_hop_by_hop(buf, h->name, connection) ||
+                &h->value == forwarded)
+            continue;
+        memcpy(o, buf + h->name.offset, h->name.length);
+        o += h->name.length;
+        memcpy(o, ": ", 2);
+        o += 2;
+        memcpy(o, buf + h->value.offset, h->value.length);
+        o += h->value.length;
+        memcpy(o, "\r\n", 2);
+        o += 2;
+    }
+
+    o += sprintf(o, "X-Forwarded-For: ");
+    if (forwarded) {
+        memcpy(o, buf + forwarded->offset, forwarded->length);
+        o += forwarded->length;
+        o += sprintf(o, ", ");
+    }
+    o += sprintf(o, "%s\r\n", client->address_text);
+    o += sprintf(o, "Connection: keep-alive\r\n\r\n");
+    return (int)(o - start);
+}
+
+
+/* Whether the response to the request at the front of client's buffer
+ * may be answered from the micro-cache: a GET or HEAD without
+ * credentials that doesn't ask for a fresh copy. */
+int micro_request_cacheable(struct client_info *client) {
+    const char *buf = client->buffer->request;
+    const struct http_request *req = &client->buffer->parser;
+    const char *method = buf + req->method.offset;
+    if (strcmp(method, "GET") && strcmp(method, "HEAD")) return 0;
+    if (http_get_header(req, buf, "authorization") ||
+            http_get_header(req, buf, "cookie"))
+        return 0;
+
+    const struct http_span *cache_control =
+        http_get_header(req, buf, "cache-control");
+    const struct http_span *pragma = http_get_header(req, buf, "pragma");
+    if (cache_control &&
+            http_span_has_token(buf, *cache_control, "no-cache"))
+        return 0;
+    if (pragma && http_span_has_token(buf, *pragma, "no-cache")) return 0;
+    return 1;
+}
+
+
+/* Queues a response kept in the micro-cache. The client holds a
+ * reference to the item until the response has been written. */
+void serve_micro(struct client_info *client, struct micro_item *item) {
+    const char *method =
+        client->buffer->request + client->buffer->parser.method.offset;
+    const char *connection = client->keep_alive ?
+        "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    item->refs++;
+    client->micro = item;
+    queue_output(client, micro_head(item), item->head_length);
+    queue_output(client, connection, strlen(connection));
+    if (strcmp(method, "HEAD"))
+        queue_output(client, micro_body(item), item->body_length);
+}
+
+
+/* Sends a new request for client to a backend on route r, copying its
+ * response into fill if fill isn't 0. The client is parked, not
+ * watched, until the backend's response starts to come back. Returns
+ * the backend connection, or 0 if a response has been queued for the
+ * client here instead. */
+struct upstream_conn *proxy_send(struct client_info *client, struct route *r,
+        unsigned long started, struct micro_fill *fill) {
+    /* The least loaded backend wins, and ties are taken in turn. */
+    struct upstream *u = 0;
+    int i;
+    for (i = 0; i < r->backend_count; ++i) {
+        struct upstream *b = r->backends[(r->next + i) % r->backend_count];
+        if (!u || b->outstanding < u->outstanding) u = b;
+    }
+    r->next = (r->next + 1) % r->backend_count;
+
+    if (!u->idle && !free_upstream_conns) {
+        send_503(client);
+        return 0;
+    }
+
+    char *request = (char*)pool_get(UPSTREAM_BUFFER, 0);
+    if (!request) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    int request_length = write_upstream_request(client, request);
+    if (!request_length) {
+        pool_put(request);
+        send_400(client);
+        return 0;
+    }
+
+    struct upstream_conn *conn = upstream_get(u);
+    if (!conn) {
+        pool_put(request);
+        send_502(client);
+        return 0;
+    }
+
+    conn->client = client;
+    conn->buffer = request;
+    conn->request_length = request_length;
+    conn->sent = 0;
+    conn->received = 0;
+    conn->forwarded = 0;
+    conn->done = 0;
+    conn->bytes = 0;
+    conn->started = started;
+    conn->fill = fill;
+    client->upstream = conn;
+    u->outstanding++;
+
+#if defined(USE_EPOLL)
+    unwatch_socket(client->socket);
+#endif
+    timer_cancel(&client->timeout);
+    upstream_watch(conn, WATCH_WRITE);
+    timer_set(&conn->timeout, UPSTREAM_TIMEOUT);
+    return conn;
+}
+
+
+/* Writes the micro-cache key of the request at the front of client's
+ * buffer to key, as its path and its Host header in lower case, and
+ * returns its length. The two come from the request head, so the key
+ * is never longer than MAX_REQUEST_SIZE. */
+int micro_key(struct client_info *client, char *key) {
+    const char *buf = client->buffer->request;
+    const struct http_request *req = &client->buffer->parser;
+    const struct http_span *host = http_get_header(req, buf, "host");
+
+    int length = req->path.length;
+    memcpy(key, buf + req->path.offset, length);
+    key[length++] = '\t';
+    int i;
+    for (i = 0; host && i < host->length; ++i) {
+        char c = buf[host->offset + i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        key[length++] = c;
+    }
+    return length;
+}
+
+
+/* Answers a request on route r from the micro-cache, or waits on the
+ * fill that is already fetching its response, or sends it to a backend.
+ * A waiting client is parked like a proxied one, with its buffer's fill
+ * set. */
+void proxy_request(struct client_info *client, struct route *r,
+        unsigned long started) {
+    const char *buf = client->buffer->request;
+    const struct http_request *req = &client->buffer->parser;
+
+    /* Request bodies aren't forwarded. */
+    int twice = 0;
+    const struct http_span *length =
+        get_framing_header(req, buf, "content-length", &twice);
+    if (twice || http_get_header(req, buf, "transfer-encoding") ||
+            (length && !http_span_equals(buf, *length, "0"))) {
+        send_400(client);
+        return;
+    }
+
+    struct micro_fill *fill = 0;
+    if (micro_ttl && micro_request_cacheable(client)) {
+        char key[MAX_REQUEST_SIZE];
+        int key_length = micro_key(client, key);
+        struct micro_item *item =
+            micro_find(&micro, key, key_length, micro_now());
+        if (item) {
+            stats_add(&stats.micro_hits, 1);
+            serve_micro(client, item);
+            return;
+        }
+
+        /* A HEAD response has no body to fill an item with. */
+        if (strcmp(buf + req->method.offset, "GET") == 0) {
+            fill = micro_find_fill(key, key_length);
+            if (fill) {
+                stats_add(&stats.micro_coalesced, 1);
+                client->buffer->fill = fill;
+                client->buffer->fill_next = fill->waiters;
+                client->buffer->fill_started = started;
+                fill->waiters = client;
+#if defined(USE_EPOLL)
+                unwatch_socket(client->socket);
+#endif
+                timer_cancel(&client->timeout);
+                return;
+            }
+            fill = micro_new_fill(key, key_length);
+        }
+    }
+
+    if (!proxy_send(client, r, started, fill) && fill)
+        micro_fill_end(fill, 0);
+}
+
+
+/* Ends a proxied request once the whole response has been sent, and
+ * picks its client up where it left off. */
+void proxy_finish(struct upstream_conn *conn) {
+    struct client_info *client = conn->client;
+    int status = conn->response.status;
+    unsigned long bytes = conn->bytes;
+
+    if (conn->fill) micro_fill_end(conn->fill, 1);
+    conn->fill = 0;
+    client->upstream = 0;
+    conn->upstream->outstanding--;
+    upstream_put(conn);
+
+    struct http_request *req = &client->buffer->parser;
+    stats_status(&stats, status);
+    log_request(&access_log, client->address_text,
+            client->buffer->request + req->method.offset,
+            client->buffer->request + req->path.offset, status, bytes);
+    remove_request(client);
+
+    if (!client->keep_alive) {
+        drop_client(client);
+        return;
+    }
+
+#if defined(USE_EPOLL)
+    watch_socket(client->socket, client);
+#endif
+    timer_set(&client->timeout,
+            client->received ? REQUEST_TIMEOUT : KEEPALIVE_TIMEOUT);
+    client->served = stats_now_us();
+    process_requests(client);
+}
+
+
+/* Writes what has been queued of a proxied response. Nothing more is
+ * read from the backend until the client has taken all of it, so no
+ * more of a response is ever held than fits in the connection's
+ * buffer. */
+void proxy_flush(struct client_info *client) {
+    struct upstream_conn *conn = client->upstream;
+    int r = flush_client(client);
+
+    if (r < 0) {
+        stats_add(&stats.dropped, 1);
+        drop_client(client);
+        return;
+    }
+
+    if (r == 0) {
+        upstream_watch(conn, WATCH_NONE);
+        timer_cancel(&conn->timeout);
+        if (!client->writing) {
+#if defined(USE_EPOLL)
+            watch_socket(client->socket, client);
+#endif
+            set_writing(client, 1);
+        }
+        timer_set(&client->timeout, WRITE_TIMEOUT);
+        return;
+    }
+
+    if (client->writing) {
+#if defined(USE_EPOLL)
+        unwatch_socket(client->socket);
+#endif
+        client->writing = 0;
+        timer_cancel(&client->timeout);
+    }
+
+    conn->received = conn->forwarded = 0;
+    if (conn->done) {
+        proxy_finish(conn);
+        return;
+    }
+    upstream_watch(conn, WATCH_READ);
+    timer_set(&conn->timeout, UPSTREAM_TIMEOUT);
+}
+
+
+/* Works out from the response head how its body ends and whether the
+ * connection can be reused after it. Returns 0 if the response can't be
+ * proxied. */
+int upstream_framing(struct upstream_conn *conn) {
+    struct client_info *client = conn->client;
+    const char *buf = conn->buffer;
+    const struct http_request *res = &conn->response;
+    const char *method =
+        client->buffer->request + client->buffer->parser.method.offset;
+
+    if (res->status < 200) return 0;
+
+    const struct http_span *connection =
+        http_get_header(res, buf, "connection");
+    if (strncmp(buf, "HTTP/1.1", 8) == 0)
+        conn->keep_alive = !connection ||
+            !http_span_has_token(buf, *connection, "close");
+    else
+        conn->keep_alive = connection &&
+            http_span_has_token(buf, *connection, "keep-alive");
+
+    int twice = 0;
+    const struct http_span *te =
+        http_get_header(res, buf, "transfer-encoding");
+    const struct http_span *length =
+        get_framing_header(res, buf, "content-length", &twice);
+    if (twice) return 0;
+
+    if (strcmp(method, "HEAD") == 0 ||
+            res->status == 204 || res->status == 304) {
+        conn->body = BODY_NONE;
+    } else if (te) {
+        conn->body = http_span_has_token(buf, *te, "chunked") ?
+            BODY_CHUNKED : BODY_UNTIL_CLOSE;
+        http_chunked_reset(&conn->chunked);
+    } else if (length) {
+        if (!parse_content_length(buf, length, &conn->remaining)) return 0;
+        conn->body = conn->remaining ? BODY_LENGTH : BODY_NONE;
+    } else {
+        conn->body = BODY_UNTIL_CLOSE;
+    }
+
+    /* A body that ends when the backend closes can only end for the
+     * client when it is closed too. */
+    if (conn->body == BODY_UNTIL_CLOSE)
+        conn->keep_alive = client->keep_alive = 0;
+    return 1;
+}
+
+
+/* Queues the response head at the front of conn's buffer for the
+ * client, rewritten in place: as HTTP/1.1, and without hop-by-hop
+ * headers. Lines are only taken out, never added, so the head can't
+ * grow; the client's own Connection header is queued after it. Returns
+ * the length of the rewritten head, without that header.
+ *
+ * Which lines go is worked out before any are moved, as moving them
+ * can overwrite the Connection header that names some of them. */
+size_t queue_upstream_head(struct upstream_conn *conn) {
+    struct client_info *client = conn->client;
+    char *buf = conn->buffer;
+    const struct http_request *res = &conn->response;
+    const struct http_span *listed = http_get_header(res, buf, "connection");
+
+    char drop[HTTP_MAX_HEADERS];
+    int i;
+    for (i = 0; i < res->header_count; ++i)
+        drop[i] = (char)is_hop_by_hop(buf, res->headers[i].name, listed);
+
+    memcpy(buf, "HTTP/1.1", 8);
+    char *o = (char*)memchr(buf, '\n', res->length) + 1;
+
+    for (i = 0; i < res->header_count; ++i) {
+        const struct http_header *h = &res->headers[i];
+        if (drop[i]) continue;
+        char *line = buf + h->name.offset;
+        char *value_end = buf + h->value.offset + h->value.length;
+        char *lf = (char*)memchr(value_end, '\n',
+                res->length - (value_end - buf));
+        memmove(o, line, lf + 1 - line);
+        o += lf + 1 - line;
+    }
+
+    const char *connection = client->keep_alive ?
+        "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    queue_output(client, buf, o - buf);
+    queue_output(client, connection, strlen(connection));
+    conn->bytes += (unsigned long)(o - buf) + strlen(connection);
+    return (size_t)(o - buf);
+}
+
+
+/* Whether a response, its head parsed but not yet rewritten, may be
+ * kept in the micro-cache: a plain success, redirect or miss, framed by
+ * Content-Length, that isn't personal and doesn't forbid it. */
+int micro_response_cacheable(struct upstream_conn *conn) {
+    const char *buf = conn->buffer;
+    const struct http_request *res = &conn->response;
+    if (res->status != 200 && res->status != 301 && res->status != 404)
+        return 0;
+    if (conn->body != BODY_LENGTH && conn->body != BODY_NONE) return 0;
+    if (http_get_header(res, buf, "set-cookie") ||
+            http_get_header(res, buf, "vary"))
+        return 0;
+
+    const struct http_span *cache_control =
+        http_get_header(res, buf, "cache-control");
+    if (!cache_control) return 1;
+    return !http_span_has_token(buf, *cache_control, "private") &&
+        !http_span_has_token(buf, *cache_control, "no-store") &&
+        !http_span_has_token(buf, *cache_control, "no-cache") &&
+        !http_span_has_token(buf, *cache_control, "max-age=0") &&
+        !http_span_has_token(buf, *cache_control, "s-maxage=0");
+}
+
+
+/* Gives conn's fill an item to copy the response into, with the
+ * rewritten head of head_length bytes, or ends it if the response can't
+ * be kept. */
+void micro_fill_start(struct upstream_conn *conn, int cacheable,
+        size_t head_length) {
+    struct micro_fill *fill = conn->fill;
+    if (cacheable)
+        fill->item = micro_alloc(&micro, fill->key, fill->key_length,
+                head_length, conn->body == BODY_LENGTH ? conn->remaining : 0);
+    if (!fill->item) {
+        micro_fill_end(fill, 0);
+        conn->fill = 0;
+        return;
+    }
+    memcpy(micro_head(fill->item), conn->buffer, head_length);
+}
+
+
+/* Queues for the client what has arrived of the response since it was
+ * last flushed, and writes it. The head is passed on once it is
+ * complete, and then the body as it comes, up to where it ends. */
+void proxy_forward(struct upstream_conn *conn) {
+    struct client_info *client = conn->client;
+
+    if (conn->state == UPSTREAM_HEADERS) {
+        int r = http_parse(&conn->response, conn->buffer, conn->received);
+        if (r == HTTP_PARSE_INCOMPLETE && conn->received < UPSTREAM_BUFFER)
+            return;
+        if (r != HTTP_PARSE_DONE || !upstream_framing(conn)) {
+            upstream_failed(conn, 502);
+            return;
+        }
+
+        int cacheable = conn->fill && micro_response_cacheable(conn);
+        size_t head_length = queue_upstream_head(conn);
+        if (conn->fill) micro_fill_start(conn, cacheable, head_length);
+        conn->forwarded = conn->response.length;
+        conn->state = UPSTREAM_BODY;
+        conn->done = conn->body == BODY_NONE;
+        stats_latency(&stats, stats_now_us() - conn->started);
+    }
+
+    int available = conn->received - conn->forwarded;
+    int n = available;
+    if (conn->body == BODY_NONE) {
+        n = 0;
+    } else if (conn->body == BODY_LENGTH) {
+        if ((unsigned long)n >= conn->remaining) {
+            n = (int)conn->remaining;
+            conn->done = 1;
+        }
+        conn->remaining -= n;
+    } else if (conn->body == BODY_CHUNKED) {
+        n = http_chunked_scan(&conn->chunked,
+                conn->buffer + conn->forwarded, available);
+        if (n < 0) {
+            upstream_failed(conn, 502);
+            return;
+        }
+        conn->done = conn->chunked.state == HTTP_CHUNK_DONE;
+    }
+
+    /* Anything after the end of the response is out of step with the
+     * requests, so the connection isn't reused. */
+    if (n < available) conn->keep_alive = 0;
+
+    if (conn->fill) {
+        memcpy(micro_body(conn->fill->item) + conn->fill->filled,
+                conn->buffer + conn->forwarded, n);
+        conn->fill->filled += n;
+    }
+    queue_output(client, conn->buffer + conn->forwarded, n);
+    conn->forwarded += n;
+    conn->bytes += (unsigned long)n;
+    proxy_flush(client);
+}
+
+
+/* Whether sending a request twice has the same effect as sending it once
+ * (RFC 9110, section 9.2.2). */
+int is_idempotent(const char *method) {
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 ||
+        strcmp(method, "OPTIONS") == 0 || strcmp(method, "PUT") == 0 ||
+        strcmp(method, "DELETE") == 0;
+}
+
+
+/* Gives up on a backend connection. If it owes a response, the client
+ * gets a 502, or a 504 if the backend went quiet, unless the response
+ * has already started, when all that can be done is drop the client.
+ * A pooled connection that failed before any of the response came back
+ * may have been closed by the backend just as it was reused, so the
+ * request is sent again on a new one, but only if it is idempotent: the
+ * backend may have acted on it before closing. */
+void upstream_failed(struct upstream_conn *conn, int status) {
+    struct client_info *client = conn->client;
+    if (!client) {
+        upstream_close(conn);
+        return;
+    }
+
+    const char *method = client->buffer->request +
+        client->buffer->parser.method.offset;
+
+    if (conn->state == UPSTREAM_BODY) {
+        stats_add(&stats.dropped, 1);
+        drop_client(client);
+        return;
+    }
+
+    if (conn->reused && !conn->received && status == 502 &&
+            is_idempotent(method)) {
+        struct upstream_conn *fresh = upstream_connect(conn->upstream);
+        if (fresh) {
+            fresh->client = client;
+            fresh->buffer = conn->buffer;
+            fresh->request_length = conn->request_length;
+            fresh->started = conn->started;
+            fresh->fill = conn->fill;
+            conn->buffer = 0;
+            conn->fill = 0;
+            client->upstream = fresh;
+            upstream_close(conn);
+            upstream_watch(fresh, WATCH_WRITE);
+            timer_set(&fresh->timeout, UPSTREAM_TIMEOUT);
+            return;
+        }
+    }
+
+    unsigned long started = conn->started;
+    if (conn->fill) micro_fill_end(conn->fill, 0);
+    conn->fill = 0;
+    client->upstream = 0;
+    conn->upstream->outstanding--;
+    upstream_close(conn);
+
+#if defined(USE_EPOLL)
+    watch_socket(client->socket, client);
+#endif
+    if (status == 504) send_504(client);
+    else send_502(client);
+
+    struct http_request *req = &client->buffer->parser;
+    if (complete_request(client, method,
+                client->buffer->request + req->path.offset, started))
+        process_requests(client);
+}
+
+
+/* Sends the request once the connection has been established. */
+void upstream_send(struct upstream_conn *conn) {
+    if (conn->state == UPSTREAM_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(conn->socket, SOL_SOCKET, SO_ERROR,
+                    (char*)&error, &length) || error) {
+            upstream_failed(conn, 502);
+            return;
+        }
+        conn->state = UPSTREAM_SENDING;
+    }
+
+    while (conn->sent < conn->request_length) {
+        int r = send(conn->socket, conn->buffer + conn->sent,
+                conn->request_length - conn->sent, 0);
+        if (r < 0 && would_block()) return;
+        if (r < 1) {
+            upstream_failed(conn, 502);
+            return;
+        }
+        conn->sent += r;
+    }
+
+    conn->state = UPSTREAM_HEADERS;
+    http_reset(&conn->response);
+    conn->response.state = HTTP_STATUS_LINE;
+    upstream_watch(conn, WATCH_READ);
+}
+
+
+void upstream_read(struct upstream_conn *conn) {
+    /* An idle connection has nothing to say unless it is being closed,
+     * or is out of step; either way it is done with. */
+    if (conn->state == UPSTREAM_IDLE) {
+        upstream_close(conn);
+        return;
+    }
+
+    int r = recv(conn->socket, conn->buffer + conn->received,
+            UPSTREAM_BUFFER - conn->received, 0);
+    if (r < 0 && would_block()) return;
+
+    if (r < 1) {
+        if (r == 0 && conn->state == UPSTREAM_BODY &&
+                conn->body == BODY_UNTIL_CLOSE) {
+            conn->done = 1;
+            proxy_flush(conn->client);
+        } else {
+            upstream_failed(conn, 502);
+        }
+        return;
+    }
+
+    conn->received += r;
+    timer_set(&conn->timeout, UPSTREAM_TIMEOUT);
+    proxy_forward(conn);
+}
+
+
+void upstream_ready(struct upstream_conn *conn) {
+    if (conn->watch == WATCH_WRITE)
+        upstream_send(conn);
+    else if (conn->watch == WATCH_READ)
+        upstream_read(conn);
+}
+
+
+/* Picks up the clients whose fill has ended: from the item it left in
+ * the cache if there is one, and otherwise by sending the request to a
+ * backend after all. */
+void micro_resume() {
+    while (micro_woken.waiters) {
+        struct client_info *client = micro_woken.waiters;
+        struct request_buffer *b = client->buffer;
+        micro_woken.waiters = b->fill_next;
+        b->fill = 0;
+
+#if defined(USE_EPOLL)
+        watch_socket(client->socket, client);
+#endif
+        const char *method = b->request + b->parser.method.offset;
+        const char *path = b->request + b->parser.path.offset;
+        unsigned long started = b->fill_started;
+        struct micro_item *item = client->micro;
+        if (item) {
+            client->micro = 0;
+            serve_micro(client, item);
+            micro_release(&micro, item);
+        } else if (proxy_send(client, find_route(path), started, 0)) {
+            continue;
+        }
+
+        if (complete_request(client, method, path, started))
+            process_requests(client);
+    }
+}
+
+
+/* POST bodies are read as they arrive and handed to a body_handler a
+ * piece at a time, decoded if they are chunked, and taken out of the
+ * client's buffer as soon as the handler has had them. However large a
+ * body is, reading it holds no more than a MAX_REQUEST_SIZE buffer and
+ * whatever its handler keeps. */
+struct body_handler {
+    const char *path;
+
+    /* Returns 0 if the body can't be taken. */
+    int (*begin)(struct client_info *client);
+
+    /* Takes the next length bytes of the body. Returns 0 to give up. */
+    int (*data)(struct client_info *client, const char *data, int length);
+
+    /* Queues the response once the whole body has been taken. Returns 0
+     * if it couldn't be kept after all. */
+    int (*end)(struct client_info *client);
+
+    /* The body won't be finished: it was malformed, data() gave up, or
+     * the client went away. */
+    void (*abort)(struct client_info *client);
+};
+
+
+/* form.html posts to /. Uploads are counted and, given -u dir, written
+ * into dir as they arrive, one file each. */
+static const char *upload_dir = 0;
+static unsigned long upload_count = 0;
+
+struct upload {
+    FILE *file;
+    char name[1];
+};
+
+int upload_begin(struct client_info *client) {
+    if (!upload_dir) return 1;
+
+    struct upload *u = (struct upload*)
+        malloc(sizeof(struct upload) + strlen(upload_dir) + 48);
+    if (!u) return 0;
+    sprintf(u->name, "%s/upload-%lu-%lu", upload_dir,
+            (unsigned long)time(0), ++upload_count);
+    u->file = fopen(u->name, "wb");
+    if (!u->file) {
+        free(u);
+        return 0;
+    }
+    client->buffer->body.context = u;
+    return 1;
+}
+
+int upload_data(struct client_info *client, const char *data, int length) {
+    struct upload *u = (struct upload*)client->buffer->body.context;
+    return !u || fwrite(data, 1, length, u->file) == (size_t)length;
+}
+
+int upload_end(struct client_info *client) {
+    struct upload *u = (struct upload*)client->buffer->body.context;
+    if (u) {
+        int saved = fclose(u->file) == 0;
+        if (!saved) remove(u->name);
+        free(u);
+        if (!saved) return 0;
+    }
+
+    char text[64];
+    int text_length = sprintf(text, "Received %lu bytes.\n",
+            client->buffer->body.bytes);
+    char *o = client->buffer->output;
+    o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+    o += sprintf(o, "Connection: %s\r\n",
+            client->keep_alive ? "keep-alive" : "close");
+    o += sprintf(o, "Content-Type: text/plain\r\n");
+    o += sprintf(o, "Content-Length: %d\r\n\r\n%s", text_length, text);
+    queue_output(client, client->buffer->output, o - client->buffer->output);
+    return 1;
+}
+
+void upload_abort(struct client_info *client) {
+    struct upload *u = (struct upload*)client->buffer->body.context;
+    if (!u) return;
+    fclose(u->file);
+    remove(u->name);
+    free(u);
+}
+
+static const struct body_handler body_handlers[] = {
+    {"/", upload_begin, upload_data, upload_end, upload_abort}
+};
+
+
+const struct body_handler *find_body_handler(const char *method,
+        const char *path) {
+    size_t i;
+    if (strcmp(method, "POST")) return 0;
+    for (i = 0; i < sizeof(body_handlers) / sizeof(*body_handlers); ++i)
+        if (strcmp(body_handlers[i].path, path) == 0) return &body_handlers[i];
+    return 0;
+}
+
+
+void abort_body(struct client_info *client) {
+    const struct body_handler *h = client->buffer->body.handler;
+    client->buffer->body.handler = 0;
+    h->abort(client);
+}
+
+
+/* Hands what has arrived of the body to its handler and takes it out of
+ * the buffer, leaving any pipelined request after it. Once the body is
+ * complete, or can't be read, the handler is done with and a response
+ * has been queued. */
+void consume_body(struct client_info *client) {
+    struct request_body *body = &client->buffer->body;
+    const struct body_handler *h = body->handler;
+    int head = client->buffer->parser.length;
+    char *data = client->buffer->request + head;
+    int available = client->received - head;
+    int n = available;
+    int decoded;
+    int done;
+
+    if (body->chunked) {
+        n = http_chunked_decode(&body->decoder, data, available, &decoded);
+        if (n < 0) {
+            abort_body(client);
+            send_400(client);
+            return;
+        }
+        done = body->decoder.state == HTTP_CHUNK_DONE;
+    } else {
+        if ((unsigned long)n > body->remaining) n = (int)body->remaining;
+        decoded = n;
+        body->remaining -= n;
+        done = !body->remaining;
+    }
+
+    if (decoded && !h->data(client, data, decoded)) {
+        abort_body(client);
+        send_500(client);
+        return;
+    }
+    body->bytes += (unsigned long)decoded;
+
+    client->received -= n;
+    memmove(data, data + n, client->received - head + 1);
+
+    if (!done) return;
+    body->handler = 0;
+    if (!h->end(client)) send_500(client);
+}
+
+
+/* Writes what has been queued while a body is being read, which can
+ * only be a 100 Continue. Until it has gone out the client is watched
+ * for writing, and then for the body again. Returns 0 if the client has
+ * been dropped. */
+int flush_interim(struct client_info *client) {
+    int r = flush_client(client);
+    if (r < 0) {
+        stats_add(&stats.dropped, 1);
+        drop_client(client);
+        return 0;
+    }
+
+    if (r == 0) {
+        if (!client->writing) set_writing(client, 1);
+        timer_set(&client->timeout, WRITE_TIMEOUT);
+    } else if (client->writing) {
+        set_writing(client, 0);
+        timer_set(&client->timeout, REQUEST_TIMEOUT);
+    }
+    return 1;
+}
+
+
+/* Starts reading the body of the request at the front of client's
+ * buffer with handler h. Whatever of it has arrived along with the head
+ * is taken straight away; if that is all of it, the response is queued
+ * before this returns, and otherwise body.handler stays set until the
+ * rest has been read. A body framed both ways, or framed twice, is
+ * refused, as something in front of the server might have read it the
+ * other way. */
+void begin_body(struct client_info *client, const struct body_handler *h,
+        unsigned long started) {
+    const char *buf = client->buffer->request;
+    const struct http_request *req = &client->buffer->parser;
+    struct request_body *body = &client->buffer->body;
+    int twice = 0;
+    const struct http_span *te =
+        get_framing_header(req, buf, "transfer-encoding", &twice);
+    const struct http_span *length =
+        get_framing_header(req, buf, "content-length", &twice);
+    const struct http_span *expect = http_get_header(req, buf, "expect");
+
+    body->remaining = 0;
+    if (twice ||
+            (te && (length || !http_span_equals(buf, *te, "chunked"))) ||
+            (length && !parse_content_length(buf, length, &body->remaining))) {
+        send_400(client);
+        return;
+    }
+
+    body->chunked = te != 0;
+    http_chunked_reset(&body->decoder);
+    body->bytes = 0;
+    body->started = started;
+    body->context = 0;
+    if (!h->begin(client)) {
+        send_500(client);
+        return;
+    }
+    body->handler = h;
+
+    /* Clients that ask wait a while for this before sending the body,
+     * so it is written straight away rather than with the response. */
+    if (expect && http_span_equals(buf, *expect, "100-continue") &&
+            strncmp(buf + req->version.offset, "HTTP/1.1", 8) == 0 &&
+            client->received == req->length) {
+        const char *c100 = "HTTP/1.1 100 Continue\r\n\r\n";
+        queue_output(client, c100, strlen(c100));
+        if (!flush_interim(client)) return;
+    }
+
+    consume_body(client);
+}
+
+
+/* Takes the next piece of a body that is being read, and once it has
+ * all been read finishes its request and goes on to the next. */
+void read_body(struct client_info *client) {
+    struct request_buffer *b = client->buffer;
+    consume_body(client);
+    if (b->body.handler) return;
+
+    if (complete_request(client, b->request + b->parser.method.offset,
+                b->request + b->parser.path.offset, b->body.started))
+        process_requests(client);
+}
+
+
+/* GET /chat upgrades the connection to a WebSocket, as chat.html does,
+ * and the client joins the hub. Each text or binary message a client
+ * sends is encoded into a frame once, and that one ws_frame is queued
+ * for every other client in the hub, as tcp_serve_chat.c in chap03
+ * passes a message on to everyone but its sender. A client holds at
+ * most WS_QUEUE frames it hasn't been able to send; one that falls
+ * further behind is dropped rather than held up for. Messages are put
+ * together in the client's request buffer, so one can be at most
+ * MAX_REQUEST_SIZE bytes, headers included. */
+#define WS_QUEUE 64
+#define WS_IDLE_TIMEOUT 60000
+
+struct ws_frame {
+    int refs;
+    size_t length;
+    char data[1];
+};
+
+struct ws_client {
+    struct client_info *client;
+    int open;
+    int closing;
+    int pinged;
+
+    /* The opcode and length so far of a fragmented message, which is
+     * kept at the front of the buffer. */
+    int opcode;
+    int message_length;
+
+    /* Frames waiting to be sent, and how much of the first has gone. */
+    struct ws_frame *queue[WS_QUEUE];
+    int queue_head;
+    int queue_count;
+    size_t sent;
+
+    struct ws_client *next;
+    struct ws_client *prev;
+};
+
+static struct ws_client *ws_hub = 0;
+
+
+struct ws_frame *ws_new_frame(int opcode, const char *payload,
+        unsigned long length) {
+    struct ws_frame *f = (struct ws_frame*)
+        malloc(sizeof(struct ws_frame) + WS_MAX_HEADER + length);
+    if (!f) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    f->refs = 1;
+    f->length = ws_write_header(f->data, opcode, length);
+    memcpy(f->data + f->length, payload, length);
+    f->length += length;
+    return f;
+}
+
+
+void ws_release(struct ws_frame *f) {
+    if (--f->refs == 0) free(f);
+}
+
+
+void ws_leave(struct client_info *client) {
+    struct ws_client *ws = client->ws;
+    if (ws->open) {
+        if (ws->prev) ws->prev->next = ws->next;
+        else ws_hub = ws->next;
+        if (ws->next) ws->next->prev = ws->prev;
+    }
+    while (ws->queue_count--) {
+        ws_release(ws->queue[ws->queue_head]);
+        ws->queue_head = (ws->queue_head + 1) % WS_QUEUE;
+    }
+    free(ws);
+    client->ws = 0;
+}
+
+
+/* Sends what is queued for a WebSocket client, and waits for the socket
+ * to become writable if it can't all go now. A client that has been
+ * sent its close frame is dropped. Returns 0 if the client was
+ * dropped. */
+int ws_flush(struct client_info *client) {
+    struct ws_client *ws = client->ws;
+    while (ws->queue_count) {
+        struct ws_frame *f = ws->queue[ws->queue_head];
+        int r = send(client->socket, f->data + ws->sent,
+                (int)(f->length - ws->sent), 0);
+        if (r < 0 && would_block()) {
+            if (!client->writing) set_writing(client, 1);
+            timer_set(&client->timeout, WRITE_TIMEOUT);
+            return 1;
+        }
+        if (r < 1) {
+            stats_add(&stats.dropped, 1);
+            drop_client(client);
+            return 0;
+        }
+        stats_add(&stats.bytes_sent, (unsigned long)r);
+
+        ws->sent += r;
+        if (ws->sent < f->length) continue;
+        ws->sent = 0;
+        ws_release(f);
+        ws->queue_head = (ws->queue_head + 1) % WS_QUEUE;
+        ws->queue_count--;
+    }
+
+    if (ws->closing) {
+        drop_client(client);
+        return 0;
+    }
+    if (client->writing) {
+        set_writing(client, 0);
+        timer_set(&client->timeout, WS_IDLE_TIMEOUT);
+    }
+    return 1;
+}
+
+
+/* Queues frame f for a client and sends it if nothing else is waiting.
+ * Returns 0 if the client was dropped, because it was too far behind
+ * or the send failed. */
+int ws_queue(struct client_info *client, struct ws_frame *f) {
+    struct ws_client *ws = client->ws;
+    if (ws->queue_count == WS_QUEUE) {
+        stats_add(&stats.dropped, 1);
+        drop_client(client);
+        return 0;
+    }
+    f->refs++;
+    ws->queue[(ws->queue_head + ws->queue_count++) % WS_QUEUE] = f;
+    if (client->writing) return 1;
+    return ws_flush(client);
+}
+
+
+/* Sends a control frame of the client's own. */
+int ws_control(struct client_info *client, int opcode, const char *payload,
+        int length) {
+    struct ws_frame *f = ws_new_frame(opcode, payload, length);
+    int r = ws_queue(client, f);
+    ws_release(f);
+    return r;
+}
+
+
+/* Starts the close handshake, with a status code. Nothing more is read
+ * from the client, and it is dropped once the close frame is sent.
+ * Returns 0 if the client has already been dropped. */
+int ws_close(struct client_info *client, int code) {
+    char payload[2];
+    payload[0] = (char)(code >> 8);
+    payload[1] = (char)code;
+    client->ws->closing = 1;
+    return ws_control(client, WS_CLOSE, payload, 2);
+}
+
+
+void ws_broadcast(struct client_info *sender, int opcode,
+        const char *payload, int length) {
+    struct ws_frame *f = ws_new_frame(opcode, payload, length);
+    struct ws_client *ws = ws_hub;
+    while (ws) {
+        struct ws_client *next = ws->next;
+        if (ws->client != sender && !ws->closing) ws_queue(ws->client, f);
+        ws = next;
+    }
+    ws_release(f);
+}
+
+
+/* A client that has been idle for WS_IDLE_TIMEOUT is pinged, and one
+ * that stays quiet for as long again is dropped. Returns 1 if the
+ * client was pinged, and 0 if it should be dropped. */
+int ws_idle(struct client_info *client) {
+    if (!client->ws || !client->ws->open || client->ws->pinged ||
+            client->writing)
+        return 0;
+    client->ws->pinged = 1;
+    timer_set(&client->timeout, WS_IDLE_TIMEOUT);
+    ws_control(client, WS_PING, "", 0);
+    return 1;
+}
+
+
+/* Takes the complete frames at the front of the client's buffer. The
+ * payload of each data frame is unmasked where it is and moved down to
+ * join the message that is being put together; a message is passed on
+ * as soon as its final frame is in. Control frames are answered
+ * straight away, even between the frames of a message. */
+void ws_read_frames(struct client_info *client) {
+    struct ws_client *ws = client->ws;
+
+    while (!ws->closing) {
+        char *frame = client->buffer->request + ws->message_length;
+        int available = client->received - ws->message_length;
+        struct ws_header h;
+        int n = ws_parse_header(frame, available, &h);
+
+        if (n == WS_ERROR || (n && !h.masked)) {
+            ws_close(client, WS_CLOSE_PROTOCOL);
+            return;
+        }
+        if (n && (unsigned long)(ws->message_length + n) + h.length >
+                MAX_REQUEST_SIZE) {
+            ws_close(client, WS_CLOSE_TOO_BIG);
+            return;
+        }
+        if (!n || (unsigned long)(available - n) < h.length) break;
+
+        int length = (int)h.length;
+        ws_unmask(frame + n, length, h.mask);
+
+        if (h.opcode & 8) {
+            if (!h.fin || length > 125) {
+                ws_close(client, WS_CLOSE_PROTOCOL);
+                return;
+            }
+            int handled = 1;
+            if (h.opcode == WS_CLOSE) {
+                ws->closing = 1;
+                handled = ws_control(client, WS_CLOSE, frame + n,
+                        length < 2 ? length : 2);
+            } else if (h.opcode == WS_PING) {
+                handled = ws_control(client, WS_PONG, frame + n, length);
+            }
+            if (!handled) return;
+
+            client->received -= n + length;
+            memmove(frame, frame + n + length, client->received -
+                    ws->message_length);
+            continue;
+        }
+
+        if ((h.opcode == WS_CONTINUATION) != (ws->opcode != 0) ||
+                (h.opcode != WS_CONTINUATION && h.opcode != WS_TEXT &&
+                 h.opcode != WS_BINARY)) {
+            ws_close(client, WS_CLOSE_PROTOCOL);
+            return;
+        }
+        if (h.opcode) ws->opcode = h.opcode;
+
+        client->received -= n;
+        memmove(frame, frame + n, available - n);
+        ws->message_length += length;
+        if (!h.fin) continue;
+
+        ws_broadcast(client, ws->opcode, client->buffer->request,
+                ws->message_length);
+        client->received -= ws->message_length;
+        memmove(client->buffer->request,
+                client->buffer->request + ws->message_length,
+                client->received);
+        ws->message_length = 0;
+        ws->opcode = 0;
+    }
+
+    if (!client->received) release_buffer(client);
+}
+
+
+void ws_read(struct client_info *client) {
+    if (!client->buffer)
+        grow_buffer(client, 1);
+    if (client->buffer->size == client->received) {
+        if (MAX_REQUEST_SIZE == client->received) {
+            ws_close(client, WS_CLOSE_TOO_BIG);
+            return;
+        }
+        grow_buffer(client, client->received + 1);
+    }
+
+    int r = recv(client->socket,
+            client->buffer->request + client->received,
+            client->buffer->size - client->received, 0);
+
+    if (r < 0 && would_block()) {
+        if (!client->received) release_buffer(client);
+        return;
+    }
+    if (r < 1) {
+        drop_client(client);
+        return;
+    }
+
+    client->received += r;
+    client->ws->pinged = 0;
+    timer_set(&client->timeout, WS_IDLE_TIMEOUT);
+    ws_read_frames(client);
+}
+
+
+/* Answers the handshake of the request at the front of client's buffer.
+ * The client only becomes a WebSocket client, in ws_open(), once the
+ * 101 response has been written. */
+void ws_upgrade(struct client_info *client) {
+    const char *buf = client->buffer->request;
+    const struct http_request *req = &client->buffer->parser;
+    const struct http_span *upgrade = http_get_header(req, buf, "upgrade");
+    const struct http_span *connection =
+        http_get_header(req, buf, "connection");
+    const struct http_span *version =
+        http_get_header(req, buf, "sec-websocket-version");
+    const struct http_span *key =
+        http_get_header(req, buf, "sec-websocket-key");
+
+    if (strncmp(buf + req->version.offset, "HTTP/1.1", 8) ||
+            !upgrade || !http_span_has_token(buf, *upgrade, "websocket") ||
+            !connection || !http_span_has_token(buf, *connection, "upgrade") ||
+            !version || !http_span_equals(buf, *version, "13") ||
+            !key || key->length != WS_KEY_LENGTH) {
+        send_400(client);
+        return;
+    }
+
+    struct ws_client *ws = (struct ws_client*) calloc(1, sizeof(*ws));
+    if (!ws) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    ws->client = client;
+    client->ws = ws;
+    client->keep_alive = 1;
+
+    char accept[WS_ACCEPT_SIZE];
+    ws_accept_key(buf + key->offset, accept);
+    char *o = client->buffer->output;
+    o += sprintf(o, "HTTP/1.1 101 Switching Protocols\r\n");
+    o += sprintf(o, "Upgrade: websocket\r\n");
+    o += sprintf(o, "Connection: Upgrade\r\n");
+    o += sprintf(o, "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    queue_output(client, client->buffer->output, o - client->buffer->output);
+}
+
+
+/* Puts a client whose handshake has been written in the hub, and takes
+ * any frames it sent straight after the handshake. */
+void ws_open(struct client_info *client) {
+    struct ws_client *ws = client->ws;
+    ws->open = 1;
+    ws->next = ws_hub;
+    if (ws_hub) ws_hub->prev = ws;
+    ws_hub = ws;
+
+    timer_set(&client->timeout, WS_IDLE_TIMEOUT);
+    ws_read_frames(client);
+}
+
+
+/* Answers the complete requests in the client's buffer one at a time.
+ * The parser resumes where it stopped on the previous recv(). A client
+ * may pipeline several requests, so every complete request that is
+ * already buffered is answered before waiting for more data, unless one
+ * has to wait for the I/O pool, a backend, the micro-cache or the rest
+ * of its body. Proxied requests may use any method. A client left with nothing buffered
+ * gives its buffer back. */
+void process_requests(struct client_info *client) {
+    while (1) {
+        if (client->ws) {
+            ws_open(client);
+            return;
+        }
+
+        unsigned long started = stats_now_us();
+        struct http_request *req = &client->buffer->parser;
+        int status = http_parse(req, client->buffer->request,
+                client->received);
+        if (status == HTTP_PARSE_INCOMPLETE) {
+            if (!client->received) release_buffer(client);
+            return;
+        }
+
+        if (status == HTTP_PARSE_ERROR) {
+            send_400(client);
+            log_response(client, 0, 0);
+            finish_response(client);
+            stats_latency(&stats, stats_now_us() - started);
+            return;
+        }
+
+        client->requests++;
+        client->keep_alive = wants_keep_alive(client) &&
+            client->requests < KEEPALIVE_MAX_REQUESTS;
+
+        char *method = client->buffer->request + req->method.offset;
+        char *path = client->buffer->request + req->path.offset;
+        method[req->method.length] = 0;
+        path[req->path.length] = 0;
+
+        struct route *route = find_route(path);
+        const struct body_handler *handler =
+            route ? 0 : find_body_handler(method, path);
+        if (strcmp(method, "GET") && !route && !handler) {
+            send_400(client);
+        } else if (strcmp(path, "/server-status") &&
+                should_shed(client, started)) {
+            send_503(client);
+        } else if (route) {
+            proxy_request(client, route, started);
+        } else if (handler) {
+            begin_body(client, handler, started);
+        } else if (strcmp(path, "/chat") == 0) {
+            ws_upgrade(client);
+        } else {
+            serve_resource(client, path);
+        }
+        if (client->dropped) return;
+#if defined(USE_IO_POOL)
+        if (client->io) return;
+#endif
+        if (client->upstream || client->buffer->fill ||
+                client->buffer->body.handler)
+            return;
+
+        if (!complete_request(client, method, path, started)) return;
+    }
+}
+
+
+void read_request(struct client_info *client) {
+    if (client->ws) {
+        ws_read(client);
+        return;
+    }
+
+    if (!client->buffer)
+        grow_buffer(client, 1);
+
+    /* A body is read through the largest buffer a request may have, so
+     * it takes fewer recv() calls. */
+    if (client->buffer->body.handler &&
+            client->buffer->size < MAX_REQUEST_SIZE)
+        grow_buffer(client, MAX_REQUEST_SIZE);
+
+    if (client->buffer->size == client->received) {
+        if (MAX_REQUEST_SIZE == client->received) {
+            send_400(client);
+            log_response(client, 0, 0);
+            finish_response(client);
+            return;
+        }
+        grow_buffer(client, client->received + 1);
+    }
+
+    int r = recv(client->socket,
+            client->buffer->request + client->received,
+            client->buffer->size - client->received, 0);
+
+    if (r < 0 && would_block()) {
+        if (!client->received) release_buffer(client);
+        return;
+    }
+
+    /* A client that goes away halfway through a request is only counted:
+     * printing it here would wait on stdout whenever the log thread has
+     * it locked. */
+    if (r < 1) {
+        if (client->received) stats_add(&stats.dropped, 1);
+        drop_client(client);
+        return;
+    }
+
+    if (!client->received)
+        timer_set(&client->timeout, REQUEST_TIMEOUT);
+
+    client->received += r;
+    client->buffer->request[client->received] = 0;
+
+    /* A body only has to keep arriving, however long it takes in all. */
+    if (client->buffer->body.handler) {
+        timer_set(&client->timeout, REQUEST_TIMEOUT);
+        read_body(client);
+        return;
+    }
+
+    process_requests(client);
+}
+
+
+void write_response(struct client_info *client) {
+    if (client->upstream) {
+        proxy_flush(client);
+        return;
+    }
+    if (client->ws && client->ws->open) {
+        ws_flush(client);
+        return;
+    }
+    if (client->buffer->body.handler) {
+        flush_interim(client);
+        return;
+    }
+    if (finish_response(client)) {
+        client->served = stats_now_us();
+        process_requests(client);
+    }
+}
+
+
+#if defined(USE_IO_POOL)
+/* Picks up a parked client where it left off. */
+void io_finish(struct io_job *job) {
+    struct client_info *client = job->client;
+    if (!client) {
+        if (job->file) fclose(job->file);
+        free(job);
+        return;
+    }
+
+    client->io = 0;
+#if defined(USE_EPOLL)
+    watch_socket(client->socket, client);
+    if (client->writing) set_writing(client, 1);
+#endif
+
+    if (job->type == IO_WARM) {
+        /* The request was left parsed at the front of the buffer, so it
+         * can be served again now that its file is warm. */
+        struct http_request *req = &client->buffer->parser;
+        const char *method = client->buffer->request + req->method.offset;
+        const char *path = client->buffer->request + req->path.offset;
+
+        client->io_warmed = 1;
+        serve_resource(client, path);
+        client->io_warmed = 0;
+        if (complete_request(client, method, path, job->started))
+            process_requests(client);
+    } else {
+        client->ready_start = job->offset;
+        client->ready_end = job->offset + job->length;
+        write_response(client);
+    }
+    free(job);
+}
+
+
+void io_handle_completions() {
+    uint64_t count;
+    if (read(io_eventfd, &count, sizeof(count)) < 0) return;
+
+    pthread_mutex_lock(&io_lock);
+    struct io_job *job = io_done;
+    io_done = 0;
+    pthread_mutex_unlock(&io_lock);
+
+    while (job) {
+        struct io_job *next = job->next;
+        io_finish(job);
+        job = next;
+    }
+}
+#endif
+
+
+#if defined(USE_PACK)
+#define USAGE "usage: web_server [-c max_connections] [-p docroot.pack]\n" \
+    "    [-x /prefix=host:port[,host:port...]]... [-m ttl_ms]\n" \
+    "    [-u upload_dir]\n"
+#else
+#define USAGE "usage: web_server [-c max_connections]\n" \
+    "    [-x /prefix=host:port[,host:port...]]... [-m ttl_ms]\n" \
+    "    [-u upload_dir]\n"
+#endif
+
+int main(int argc, char *argv[]) {
+
+    int i;
+    for (i = 1; i < argc; i += 2) {
+        if (i + 1 < argc && strcmp(argv[i], "-c") == 0 &&
+                atoi(argv[i + 1]) > 0) {
+            max_connections = atoi(argv[i + 1]);
+#if defined(USE_PACK)
+        } else if (i + 1 < argc && strcmp(argv[i], "-p") == 0) {
+            docroot_pack_name = argv[i + 1];
+#endif
+        } else if (i + 1 < argc && strcmp(argv[i], "-x") == 0) {
+            if (!add_route(argv[i + 1])) {
+                fprintf(stderr, "Can't proxy %s.\n", argv[i + 1]);
+                return 1;
+            }
+        } else if (i + 1 < argc && strcmp(argv[i], "-m") == 0 &&
+                atol(argv[i + 1]) > 0) {
+            micro_ttl = atol(argv[i + 1]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-u") == 0) {
+            upload_dir = argv[i + 1];
+        } else {
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+
+    int limit = default_max_connections();
+    if (!max_connections) max_connections = limit;
+#if !defined(USE_EPOLL)
+    if (max_connections > limit) max_connections = limit;
+#endif
+
+#if defined(USE_PACK)
+    if (docroot_pack_name) {
+        docroot_pack = pack_open(docroot_pack_name);
+        if (!docroot_pack) {
+            fprintf(stderr, "Can't load %s.\n", docroot_pack_name);
+            return 1;
+        }
+        signal(SIGHUP, request_pack_reload);
+    }
+#endif
+
+    if (micro_ttl && !micro_init(&micro, MICRO_CACHE_BYTES)) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+#if defined(_WIN32)
+    WSADATA d;
+    if (WSAStartup(MAKEWORD(2, 2), &d)) {
+        fprintf(stderr, "Failed to initialize.\n");
+        return 1;
+    }
+#endif
+
+#if !defined(_WIN32)
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    SOCKET server = create_socket(0, "8080");
+    printf("Admitting up to %d connections.\n", max_connections);
+#if !defined(_WIN32)
+    spare_fd = open("/dev/null", O_RDONLY);
+#endif
+    timer_init_wheel();
+
+    log_add_ring(&access_log);
+    if (log_start(stdout)) {
+        fprintf(stderr, "Failed to start the access log thread.\n");
+        return 1;
+    }
+
+    stats_add_thread(&stats);
+#if defined(STATS_INTERVAL)
+    timer_init(&stats_timer, &stats_timer);
+    timer_set(&stats_timer, STATS_INTERVAL * 1000);
+#endif
+
+#if defined(USE_EPOLL)
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "epoll_create1() failed. (%d)\n", GETSOCKETERRNO());
+        return 1;
+    }
+    watch_socket(server, 0);
+#endif
+
+#if defined(USE_CACHE)
+    cache_init();
+#if defined(USE_EPOLL)
+    if (cache_inotify >= 0)
+        watch_socket(cache_inotify, &cache_inotify);
+#endif
+#endif
+
+#if defined(USE_IO_POOL)
+    if (io_start()) {
+        fprintf(stderr, "Failed to start the I/O threads.\n");
+        return 1;
+    }
+#if defined(USE_EPOLL)
+    watch_socket(io_eventfd, &io_eventfd);
+#endif
+#endif
+
+    while(1) {
+        stats_add(&stats.loops, 1);
+#if defined(USE_PACK)
+        if (pack_reload_requested) reload_pack();
+#endif
+        if (!accepting && client_count < max_connections)
+            resume_accepting(server);
+        unsigned long waited = stats_now_us();
+
+#if defined(USE_EPOLL)
+        struct epoll_event events[MAX_EVENTS];
+        int n = wait_on_clients(events);
+        loop_woke(waited, n == MAX_EVENTS);
+
+        for (i = 0; i < n; ++i) {
+            struct client_info *client =
+                (struct client_info*) events[i].data.ptr;
+            if (!client)
+                accept_clients(server);
+#if defined(USE_CACHE)
+            else if (events[i].data.ptr == (void*)&cache_inotify)
+                cache_handle_events();
+#endif
+#if defined(USE_IO_POOL)
+            else if (events[i].data.ptr == (void*)&io_eventfd)
+                io_handle_completions();
+#endif
+            else if (is_upstream(events[i].data.ptr))
+                upstream_ready((struct upstream_conn*)events[i].data.ptr);
+            else if (client->dropped)
+                continue;
+            else if (client->writing)
+                write_response(client);
+            else
+                read_request(client);
+        }
+
+        micro_resume();
+        drop_expired_clients();
+        recycle_dropped_clients();
+
+#else
+        fd_set reads, writes;
+        wait_on_clients(server, accepting, &reads, &writes);
+        loop_woke(waited, 0);
+
+        if (FD_ISSET(server, &reads)) {
+            accept_clients(server);
+        }
+
+#if defined(USE_CACHE)
+        if (cache_inotify >= 0 && FD_ISSET(cache_inotify, &reads))
+            cache_handle_events();
+#endif
+#if defined(USE_IO_POOL)
+        if (FD_ISSET(io_eventfd, &reads))
+            io_handle_completions();
+#endif
+
+        for (i = 0; upstream_conns && i < UPSTREAM_CONNECTIONS; ++i) {
+            struct upstream_conn *conn = &upstream_conns[i];
+            if (conn->watch != WATCH_NONE && FD_ISSET(conn->socket,
+                        conn->watch == WATCH_READ ? &reads : &writes))
+                upstream_ready(conn);
+        }
+
+        struct client_info *client = clients;
+        while(client) {
+            struct client_info *next = client->next;
+
+            if (client->dropped) {
+                /* Dropped while handling an earlier client. */
+            } else if (FD_ISSET(client->socket, &writes)) {
+                write_response(client);
+            } else if (FD_ISSET(client->socket, &reads)) {
+                read_request(client);
+            }
 
             client = next;
         }
 
+        micro_resume();
+        drop_expired_clients();
+        recycle_dropped_clients();
+#endif
+
     } //while(1)
 
 
@@ -22,8 +22,29 @@
  * SOFTWARE.
  */
 
+/*
+ * usage: web_server2 [-a] [workers]
+ *
+ * With workers > 1, or 0 for one per CPU, web_server2 forks that many
+ * worker processes. Each opens its own SO_REUSEPORT listener on port
+ * 8080 and runs its own event loop, and the kernel spreads incoming
+ * connections across them. -a pins worker i to CPU i (Linux only).
+ * Worker mode is not available on Windows.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "chap07.h"
 
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 
 const char *get_content_type(const char* path) {
     const char *last_dot = strrchr(path, '.');
@@ -48,7 +69,7 @@ const char *get_content_type(const char* path) {
 }
 
 
-SOCKET create_socket(const char* host, const char *port) {
+SOCKET create_socket(const char* host, const char *port, int reuse_port) {
     printf("Configuring local address...\n");
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -68,6 +89,25 @@ SOCKET create_socket(const char* host, const char *port) {
         exit(1);
     }
 
+    int yes = 1;
+    if (setsockopt(socket_listen, SOL_SOCKET, SO_REUSEADDR,
+                (const char*)&yes, sizeof(yes)) < 0) {
+        fprintf(stderr, "setsockopt() failed. (%d)\n", GETSOCKETERRNO());
+    }
+
+#if defined(SO_REUSEPORT)
+    if (reuse_port && setsockopt(socket_listen, SOL_SOCKET, SO_REUSEPORT,
+                (const char*)&yes, sizeof(yes)) < 0) {
+        fprintf(stderr, "setsockopt() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+#else
+    if (reuse_port) {
+        fprintf(stderr, "SO_REUSEPORT is not supported.\n");
+        exit(1);
+    }
+#endif
+
     printf("Binding socket to local address...\n");
     if (bind(socket_listen,
                 bind_address->ai_addr, bind_address->ai_addrlen)) {
@@ -77,7 +117,7 @@ SOCKET create_socket(const char* host, const char *port) {
     freeaddrinfo(bind_address);
 
     printf("Listening...\n");
-    if (listen(socket_listen, 10) < 0) {
+    if (listen(socket_listen, SOMAXCONN) < 0) {
         fprintf(stderr, "listen() failed. (%d)\n", GETSOCKETERRNO());
         exit(1);
     }
@@ -94,6 +134,9 @@ struct client_info {
     struct sockaddr_storage address;
     char address_buffer[128];
     SOCKET socket;
+#if defined(USE_EPOLL)
+    int epoll_fd;
+#endif
     char request[MAX_REQUEST_SIZE + 1];
     int received;
     struct client_info *next;
@@ -126,8 +169,29 @@ struct client_info *get_client(struct client_info **client_list,
 }
 
 
+#if defined(USE_EPOLL)
+void watch_socket(int epoll_fd, SOCKET s, void *data) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = data;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &event) < 0) {
+        fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+}
+
+void unwatch_socket(int epoll_fd, SOCKET s) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, 0);
+}
+#endif
+
+
 void drop_client(struct client_info **client_list,
         struct client_info *client) {
+#if defined(USE_EPOLL)
+    unwatch_socket(client->epoll_fd, client->socket);
+#endif
     CLOSESOCKET(client->socket);
 
     struct client_info **p = client_list;
@@ -157,6 +221,22 @@ const char *get_client_address(struct client_info *ci) {
 
 
 
+#if defined(USE_EPOLL)
+#define MAX_EVENTS 256
+
+/* The listening socket and every client are registered with epoll once,
+ * so a wakeup only costs as much as the number of ready sockets. */
+int wait_on_clients(int epoll_fd, struct epoll_event *events) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "epoll_wait() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+    return n;
+}
+
+#else
 fd_set wait_on_clients(struct client_info **client_list, SOCKET server) {
     fd_set reads;
     FD_ZERO(&reads);
@@ -179,6 +259,7 @@ fd_set wait_on_clients(struct client_info **client_list, SOCKET server) {
 
     return reads;
 }
+#endif
 
 
 void send_400(struct client_info **client_list,
@@ -242,28 +323,24 @@ void serve_resource(struct client_info **client_list,
 
     const char *ct = get_content_type(full_path);
 
-#define BSIZE 1024
+    /* The headers are assembled in buffer and sent together with the
+     * start of the body, so a small file takes one send() instead of
+     * six. */
+#define BSIZE 8192
     char buffer[BSIZE];
 
-    sprintf(buffer, "HTTP/1.1 200 OK\r\n");
-    send(client->socket, buffer, strlen(buffer), 0);
-
-    sprintf(buffer, "Connection: close\r\n");
-    send(client->socket, buffer, strlen(buffer), 0);
-
-    sprintf(buffer, "Content-Length: %u\r\n", cl);
-    send(client->socket, buffer, strlen(buffer), 0);
-
-    sprintf(buffer, "Content-Type: %s\r\n", ct);
-    send(client->socket, buffer, strlen(buffer), 0);
-
-    sprintf(buffer, "\r\n");
-    send(client->socket, buffer, strlen(buffer), 0);
+    char *o = buffer;
+    o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+    o += sprintf(o, "Connection: close\r\n");
+    o += sprintf(o, "Content-Length: %lu\r\n", (unsigned long)cl);
+    o += sprintf(o, "Content-Type: %s\r\n", ct);
+    o += sprintf(o, "\r\n");
 
-    int r = fread(buffer, 1, BSIZE, fp);
+    int r = (int)(o - buffer);
+    r += (int)fread(o, 1, BSIZE - r, fp);
     while (r) {
         send(client->socket, buffer, r, 0);
-        r = fread(buffer, 1, BSIZE, fp);
+        r = (int)fread(buffer, 1, BSIZE, fp);
     }
 
     fclose(fp);
@@ -271,41 +348,109 @@ void serve_resource(struct client_info **client_list,
 }
 
 
-int main() {
+void accept_client(struct client_info **client_list,
+        int epoll_fd, SOCKET server) {
+    struct client_info *client = get_client(client_list, -1);
 
-#if defined(_WIN32)
-    WSADATA d;
-    if (WSAStartup(MAKEWORD(2, 2), &d)) {
-        fprintf(stderr, "Failed to initialize.\n");
-        return 1;
+    client->socket = accept(server,
+            (struct sockaddr*) &(client->address),
+            &(client->address_length));
+
+    if (!ISVALIDSOCKET(client->socket)) {
+        fprintf(stderr, "accept() failed. (%d)\n",
+                GETSOCKETERRNO());
+        exit(1);
     }
+
+#if defined(USE_EPOLL)
+    client->epoll_fd = epoll_fd;
+    watch_socket(epoll_fd, client->socket, client);
+#else
+    (void)epoll_fd;
 #endif
 
-    SOCKET server = create_socket(0, "8080");
+    printf("New connection from %s.\n",
+            get_client_address(client));
+}
+
+
+void read_request(struct client_info **client_list,
+        struct client_info *client) {
+    if (MAX_REQUEST_SIZE == client->received) {
+        send_400(client_list, client);
+        return;
+    }
+
+    int r = recv(client->socket,
+            client->request + client->received,
+            MAX_REQUEST_SIZE - client->received, 0);
+
+    if (r < 1) {
+        printf("Unexpected disconnect from %s.\n",
+                get_client_address(client));
+        drop_client(client_list, client);
+
+    } else {
+        client->received += r;
+        client->request[client->received] = 0;
+
+        char *q = strstr(client->request, "\r\n\r\n");
+        if (q) {
+            *q = 0;
+
+            if (strncmp("GET /", client->request, 5)) {
+                send_400(client_list, client);
+            } else {
+                char *path = client->request + 4;
+                char *end_path = strstr(path, " ");
+                if (!end_path) {
+                    send_400(client_list, client);
+                } else {
+                    *end_path = 0;
+                    serve_resource(client_list, client, path);
+                }
+            }
+        } //if (q)
+    }
+}
 
+
+/* Runs one event loop on the listening socket server. Each worker has
+ * its own loop, with its own client list. */
+void serve(SOCKET server) {
     struct client_info *client_list = 0;
 
+#if defined(USE_EPOLL)
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "epoll_create1() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+    watch_socket(epoll_fd, server, 0);
+#endif
+
     while(1) {
 
+#if defined(USE_EPOLL)
+        struct epoll_event events[MAX_EVENTS];
+        int n = wait_on_clients(epoll_fd, events);
+
+        int i;
+        for (i = 0; i < n; ++i) {
+            struct client_info *client =
+                (struct client_info*) events[i].data.ptr;
+            if (client)
+                read_request(&client_list, client);
+            else
+                accept_client(&client_list, epoll_fd, server);
+        }
+
+#else
         fd_set reads;
         reads = wait_on_clients(&client_list, server);
 
         if (FD_ISSET(server, &reads)) {
-            struct client_info *client = get_client(&client_list, -1);
-
-            client->socket = accept(server,
-                    (struct sockaddr*) &(client->address),
-                    &(client->address_length));
-
-            if (!ISVALIDSOCKET(client->socket)) {
-                fprintf(stderr, "accept() failed. (%d)\n",
-                        GETSOCKETERRNO());
-                return 1;
-            }
-
-
-            printf("New connection from %s.\n",
-                    get_client_address(client));
+            accept_client(&client_list, -1, server);
         }
 
 
@@ -314,51 +459,114 @@ int main() {
             struct client_info *next = client->next;
 
             if (FD_ISSET(client->socket, &reads)) {
+                read_request(&client_list, client);
+            }
 
-                if (MAX_REQUEST_SIZE == client->received) {
-                    send_400(&client_list, client);
-                    client = next;
-                    continue;
-                }
+            client = next;
+        }
+#endif
 
-                int r = recv(client->socket,
-                        client->request + client->received,
-                        MAX_REQUEST_SIZE - client->received, 0);
+    } //while(1)
+}
 
-                if (r < 1) {
-                    printf("Unexpected disconnect from %s.\n",
-                            get_client_address(client));
-                    drop_client(&client_list, client);
 
-                } else {
-                    client->received += r;
-                    client->request[client->received] = 0;
-
-                    char *q = strstr(client->request, "\r\n\r\n");
-                    if (q) {
-                        *q = 0;
-
-                        if (strncmp("GET /", client->request, 5)) {
-                            send_400(&client_list, client);
-                        } else {
-                            char *path = client->request + 4;
-                            char *end_path = strstr(path, " ");
-                            if (!end_path) {
-                                send_400(&client_list, client);
-                            } else {
-                                *end_path = 0;
-                                serve_resource(&client_list, client, path);
-                            }
-                        }
-                    } //if (q)
-                }
-            }
+#if defined(__linux__)
+/* Pins the calling process to the nth of the CPUs it may run on,
+ * wrapping around if there are more workers than CPUs. */
+void pin_to_cpu(int n) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        fprintf(stderr, "sched_getaffinity() failed. (%d)\n", errno);
+        return;
+    }
+    n %= CPU_COUNT(&allowed);
+
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (n-- > 0) continue;
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus))
+            fprintf(stderr, "sched_setaffinity() failed. (%d)\n", errno);
+        return;
+    }
+}
+#endif
 
-            client = next;
+
+#if !defined(_WIN32)
+void run_workers(int workers, int affinity) {
+    printf("Starting %d workers...\n", workers);
+    fflush(stdout);
+
+    int i;
+    for (i = 0; i < workers; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork() failed. (%d)\n", errno);
+            exit(1);
         }
+        if (pid > 0) continue;
 
-    } //while(1)
+#if defined(__linux__)
+        if (affinity)
+            pin_to_cpu(i);
+#else
+        (void)affinity;
+#endif
+
+        SOCKET server = create_socket(0, "8080", 1);
+        serve(server);
+        exit(0);
+    }
+
+    while (wait(0) > 0);
+}
+#endif
+
+
+int main(int argc, char *argv[]) {
+
+    int affinity = 0;
+    if (argc > 1 && strcmp(argv[1], "-a") == 0) {
+        affinity = 1;
+        --argc;
+        ++argv;
+    }
+
+    int workers = argc > 1 ? atoi(argv[1]) : 1;
+#if !defined(_WIN32)
+    if (workers == 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (workers < 1) {
+        fprintf(stderr, "usage: web_server2 [-a] [workers]\n");
+        return 1;
+    }
+
+#if defined(_WIN32)
+    if (workers > 1 || affinity) {
+        fprintf(stderr, "Worker mode is not supported on Windows.\n");
+        return 1;
+    }
+
+    WSADATA d;
+    if (WSAStartup(MAKEWORD(2, 2), &d)) {
+        fprintf(stderr, "Failed to initialize.\n");
+        return 1;
+    }
+#else
+    if (workers > 1 || affinity) {
+        run_workers(workers, affinity);
+        return 0;
+    }
+#endif
 
+    SOCKET server = create_socket(0, "8080", 0);
+    serve(server);
 
     printf("\nClosing socket...\n");
     CLOSESOCKET(server);
@@ -0,0 +1,1098 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * web_server_uring serves public/ like web_server.c, but does all of its
+ * socket I/O through io_uring (Linux 6.1 or later). The main loop makes
+ * one io_uring_enter() call per pass, which both submits everything the
+ * last batch of completions asked for and waits for the next batch.
+ *
+ * - One multishot accept keeps accepting for as long as the server runs.
+ *   Accepted sockets go straight into the registered file table, so they
+ *   never occupy a normal descriptor.
+ * - Each connection has one multishot recv, which picks its buffers from
+ *   a ring of provided buffers shared by all connections.
+ * - A response is a send of the headers linked to a splice of the file
+ *   into a pipe and a splice from the pipe to the socket, submitted
+ *   together. Open files and the pipes are kept in the registered file
+ *   table as well.
+ *
+ * On SIGINT or SIGTERM it reports how many requests it answered and how
+ * many io_uring_enter() calls that took.
+ */
+
+#if !defined(__linux__)
+#error This program requires Linux.
+#endif
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "chap07.h"
+#include "http_parser.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+const char *get_content_type(const char* path) {
+    const char *last_dot = strrchr(path, '.');
+    if (last_dot) {
+        if (strcmp(last_dot, ".css") == 0) return "text/css";
+        if (strcmp(last_dot, ".csv") == 0) return "text/csv";
+        if (strcmp(last_dot, ".gif") == 0) return "image/gif";
+        if (strcmp(last_dot, ".htm") == 0) return "text/html";
+        if (strcmp(last_dot, ".html") == 0) return "text/html";
+        if (strcmp(last_dot, ".ico") == 0) return "image/x-icon";
+        if (strcmp(last_dot, ".jpeg") == 0) return "image/jpeg";
+        if (strcmp(last_dot, ".jpg") == 0) return "image/jpeg";
+        if (strcmp(last_dot, ".js") == 0) return "application/javascript";
+        if (strcmp(last_dot, ".json") == 0) return "application/json";
+        if (strcmp(last_dot, ".png") == 0) return "image/png";
+        if (strcmp(last_dot, ".pdf") == 0) return "application/pdf";
+        if (strcmp(last_dot, ".svg") == 0) return "image/svg+xml";
+        if (strcmp(last_dot, ".txt") == 0) return "text/plain";
+    }
+
+    return "application/octet-stream";
+}
+
+
+SOCKET create_socket(const char* host, const char *port) {
+    printf("Configuring local address...\n");
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *bind_address;
+    getaddrinfo(host, port, &hints, &bind_address);
+
+    printf("Creating socket...\n");
+    SOCKET socket_listen;
+    socket_listen = socket(bind_address->ai_family,
+            bind_address->ai_socktype, bind_address->ai_protocol);
+    if (!ISVALIDSOCKET(socket_listen)) {
+        fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+
+    int yes = 1;
+    if (setsockopt(socket_listen, SOL_SOCKET, SO_REUSEADDR,
+                (const char*)&yes, sizeof(yes)) < 0) {
+        fprintf(stderr, "setsockopt() failed. (%d)\n", GETSOCKETERRNO());
+    }
+
+    /* Accepted sockets never have a normal descriptor to call
+     * setsockopt() on, but they inherit TCP_NODELAY from the listener. */
+    setsockopt(socket_listen, IPPROTO_TCP, TCP_NODELAY,
+            (const char*)&yes, sizeof(yes));
+
+    printf("Binding socket to local address...\n");
+    if (bind(socket_listen,
+                bind_address->ai_addr, bind_address->ai_addrlen)) {
+        fprintf(stderr, "bind() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+    freeaddrinfo(bind_address);
+
+    printf("Listening...\n");
+    if (listen(socket_listen, SOMAXCONN) < 0) {
+        fprintf(stderr, "listen() failed. (%d)\n", GETSOCKETERRNO());
+        exit(1);
+    }
+
+    return socket_listen;
+}
+
+
+
+/* The registered file table is split into fixed ranges: the listener,
+ * the open files, the pipes (two slots each), and the connections, which
+ * the kernel allocates from as it accepts them. There are more file
+ * slots than open files, so a file can be replaced while responses are
+ * still being sent from the old one. */
+#define LISTENER_SLOT 0
+#define FILE_BASE 1
+#define MAX_FILES 64
+#define MAX_FILE_SLOTS (2 * MAX_FILES)
+#define PIPE_BASE (FILE_BASE + MAX_FILE_SLOTS)
+#define MAX_PIPES 64
+#define CLIENT_BASE (PIPE_BASE + 2 * MAX_PIPES)
+#define MAX_CLIENTS 4096
+#define FILE_SLOTS (CLIENT_BASE + MAX_CLIENTS)
+
+#define RING_ENTRIES 1024
+#define BUFFER_GROUP 0
+#define BUFFER_COUNT 1024
+#define BUFFER_SIZE 2048
+
+#define MAX_REQUEST_SIZE 2047
+#define PIPE_CHUNK 65536
+#define SMALL_FILE 16384
+
+/* What each submission is for, kept in the low bits of its user_data
+ * with the connection's slot above them. */
+enum {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_OTHER
+};
+
+#define USER_DATA(slot, op) (((unsigned long long)(slot) << 8) | (op))
+
+
+struct ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static struct ring ring;
+static struct io_uring_buf_ring *buffer_ring;
+static char *buffers;
+static unsigned short buffer_tail;
+
+static unsigned long enter_calls = 0;
+static unsigned long request_count = 0;
+static volatile sig_atomic_t stopping = 0;
+
+
+int ring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit,
+            min_complete, flags, 0, 0);
+}
+
+int ring_register(unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, count);
+}
+
+
+void ring_init() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    /* Only this thread submits, and completions are only needed when it
+     * asks for them, so the kernel can skip waking it for each one. */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring.fd = ring_setup(RING_ENTRIES, &p);
+    if (ring.fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ring.fd = ring_setup(RING_ENTRIES, &p);
+    }
+    if (ring.fd < 0) {
+        fprintf(stderr, "io_uring_setup() failed. (%d)\n", errno);
+        exit(1);
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+        sq_size = cq_size;
+
+    char *sq = (char*) mmap(0, sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED)
+        cq = (char*) mmap(0, cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = (struct io_uring_sqe*) mmap(0,
+            p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED ||
+            (void*)ring.sqes == MAP_FAILED) {
+        fprintf(stderr, "mmap() failed. (%d)\n", errno);
+        exit(1);
+    }
+
+    ring.entries = p.sq_entries;
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+}
+
+
+/* Hands the queued submissions to the kernel and, if wait is set, waits
+ * for at least one completion, all in one system call. */
+void ring_submit(int wait) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+    ++enter_calls;
+    if (ring_enter(ring.sq_local_tail - head, wait ? 1 : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0) < 0 &&
+            errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        fprintf(stderr, "io_uring_enter() failed. (%d)\n", errno);
+        exit(1);
+    }
+}
+
+
+struct io_uring_sqe *get_sqe(unsigned long long user_data) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sq_local_tail - head == ring.entries)
+        ring_submit(0);
+
+    unsigned index = ring.sq_local_tail++ & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring.sq_array[index] = index;
+    return sqe;
+}
+
+
+/* Registers a sparse file table, reserves the top of it for accepted
+ * sockets, and puts the listener in LISTENER_SLOT. */
+void register_files(SOCKET server) {
+    int *fds = (int*) malloc(FILE_SLOTS * sizeof(int));
+    if (!fds) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    int i;
+    for (i = 0; i < FILE_SLOTS; ++i) fds[i] = -1;
+    fds[LISTENER_SLOT] = server;
+
+    if (ring_register(IORING_REGISTER_FILES, fds, FILE_SLOTS) < 0) {
+        fprintf(stderr, "IORING_REGISTER_FILES failed. (%d)\n", errno);
+        exit(1);
+    }
+    free(fds);
+
+    struct io_uring_file_index_range range;
+    memset(&range, 0, sizeof(range));
+    range.off = CLIENT_BASE;
+    range.len = MAX_CLIENTS;
+    if (ring_register(IORING_REGISTER_FILE_ALLOC_RANGE, &range, 0) < 0) {
+        fprintf(stderr, "IORING_REGISTER_FILE_ALLOC_RANGE failed. (%d)\n",
+                errno);
+        exit(1);
+    }
+}
+
+
+/* Puts fd, or -1 to empty it, in a slot of the registered file table.
+ * Requests already using the old file keep it until they finish. */
+int update_file_slot(int slot, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (unsigned long long)(unsigned long)&fd;
+    return ring_register(IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
+
+
+/* Registers BUFFER_COUNT receive buffers. A multishot recv takes a
+ * buffer from this ring for each chunk it receives, and the buffer goes
+ * back on the ring once its data has been copied out. */
+void register_buffers() {
+    size_t ring_size = BUFFER_COUNT * sizeof(struct io_uring_buf);
+    void *r = mmap(0, ring_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffers = (char*) malloc(BUFFER_COUNT * BUFFER_SIZE);
+    if (r == MAP_FAILED || !buffers) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    buffer_ring = (struct io_uring_buf_ring*)r;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(unsigned long)buffer_ring;
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+    if (ring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "IORING_REGISTER_PBUF_RING failed. (%d)\n", errno);
+        exit(1);
+    }
+
+    buffer_tail = 0;
+    int i;
+    for (i = 0; i < BUFFER_COUNT; ++i) {
+        struct io_uring_buf *b =
+            &buffer_ring->bufs[buffer_tail++ & (BUFFER_COUNT - 1)];
+        b->addr = (unsigned long long)(unsigned long)
+            (buffers + i * BUFFER_SIZE);
+        b->len = BUFFER_SIZE;
+        b->bid = (unsigned short)i;
+    }
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
+
+
+void recycle_buffer(int bid) {
+    struct io_uring_buf *b =
+        &buffer_ring->bufs[buffer_tail++ & (BUFFER_COUNT - 1)];
+    b->addr = (unsigned long long)(unsigned long)(buffers + bid * BUFFER_SIZE);
+    b->len = BUFFER_SIZE;
+    b->bid = (unsigned short)bid;
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
+
+
+
+/* Files are opened once, registered, and then shared by every response
+ * that sends them; splice() reads them at an explicit offset. Each path
+ * has one possible place in the table, and an entry is checked against
+ * the file on disk at most once a second.
+ *
+ * A file's slot is counted like a small file's body: the entry holds one
+ * reference, and so does each response splicing from it. When an entry
+ * is replaced, the new file goes in a free slot, and the old slot is
+ * only emptied once the last response sending it has finished, so no
+ * response ever reads from a file other than the one it started on.
+ *
+ * Splicing is done by the kernel's worker threads, which costs more than
+ * it saves for a small file, so files of up to SMALL_FILE bytes are
+ * instead read into memory and sent from there together with the
+ * headers, and don't need a slot. If every slot is still held by
+ * responses to files that have since been replaced, a large file is
+ * answered with a 503 until one is let go. */
+struct file_body {
+    int refs;
+    char data[1];
+};
+
+struct open_file {
+    char path[128];
+    int slot;
+    size_t size;
+    ino_t ino;
+    time_t mtime;
+    time_t checked;
+    struct file_body *body;
+};
+
+static struct open_file open_files[MAX_FILES];
+
+static int slot_refs[MAX_FILE_SLOTS];
+static int free_slots[MAX_FILE_SLOTS];
+static int free_slot_count = 0;
+
+
+unsigned long path_hash(const char *path) {
+    unsigned long h = 2166136261UL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+
+/* A body is freed once the file has been replaced and the last
+ * response sending it has finished. */
+void release_body(struct file_body *body) {
+    if (body && --body->refs == 0)
+        free(body);
+}
+
+
+/* Takes a free file slot, holding one reference to it, or returns 0 if
+ * every slot is still in use. */
+int take_slot() {
+    if (!free_slot_count) return 0;
+    int slot = free_slots[--free_slot_count];
+    slot_refs[slot - FILE_BASE] = 1;
+    return slot;
+}
+
+
+void release_slot(int slot) {
+    if (--slot_refs[slot - FILE_BASE]) return;
+    update_file_slot(slot, -1);
+    free_slots[free_slot_count++] = slot;
+}
+
+
+void close_file(struct open_file *f) {
+    if (f->slot) release_slot(f->slot);
+    f->slot = 0;
+    release_body(f->body);
+    f->body = 0;
+    f->path[0] = 0;
+}
+
+
+struct file_body *read_body(int fd, size_t size) {
+    struct file_body *body = (struct file_body*)
+        malloc(sizeof(struct file_body) + size);
+    if (!body) return 0;
+    body->refs = 1;
+
+    size_t got = 0;
+    while (got < size) {
+        ssize_t r = pread(fd, body->data + got, size - got, (off_t)got);
+        if (r <= 0) {
+            free(body);
+            return 0;
+        }
+        got += r;
+    }
+    return body;
+}
+
+
+/* Returns the open file for path, or 0 if there is no such file. */
+/* Returns the entry for path, or 0 if it can't be sent. *busy is set if
+ * that is because no slot is free, rather than because there is no such
+ * file. */
+struct open_file *get_file(const char *path, int *busy) {
+    struct open_file *f = &open_files[path_hash(path) % MAX_FILES];
+    time_t now = time(0);
+
+    char full_path[128];
+    sprintf(full_path, "public%s", path);
+
+    if (f->path[0] && strcmp(f->path, path) == 0) {
+        if (f->checked == now) return f;
+
+        struct stat st;
+        if (stat(full_path, &st) == 0 && st.st_ino == f->ino &&
+                (size_t)st.st_size == f->size && st.st_mtime == f->mtime) {
+            f->checked = now;
+            return f;
+        }
+    }
+
+    if (f->path[0]) close_file(f);
+
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    f->body = (size_t)st.st_size <= SMALL_FILE ?
+        read_body(fd, (size_t)st.st_size) : 0;
+    if (!f->body && st.st_size) {
+        f->slot = take_slot();
+        if (!f->slot || update_file_slot(f->slot, fd) < 0) {
+            if (f->slot) release_slot(f->slot);
+            f->slot = 0;
+            close(fd);
+            *busy = 1;
+            return 0;
+        }
+    }
+    close(fd);
+
+    strcpy(f->path, path);
+    f->size = (size_t)st.st_size;
+    f->ino = st.st_ino;
+    f->mtime = st.st_mtime;
+    f->checked = now;
+    return f;
+}
+
+
+
+struct client_info {
+    int slot;
+    int active;
+    char request[MAX_REQUEST_SIZE + 1];
+    int received;
+    int overflow;
+    struct http_request parser;
+    int keep_alive;
+    int recv_armed;
+    int closing;
+
+    /* The response in flight: pending counts its submissions that have
+     * yet to complete. A file body goes through pipe, which holds
+     * pipe_bytes that have still to reach the socket. */
+    int responding;
+    int pending;
+    int failed;
+    char output[512];
+    struct file_body *body;
+    struct iovec iov[2];
+    struct msghdr msg;
+    int file_slot;      /* holding a reference, or 0 */
+    size_t file_offset;
+    size_t file_remaining;
+    int pipe;
+    size_t pipe_bytes;
+
+    struct client_info *next_waiting;
+};
+
+static struct client_info *clients;
+
+/* Pipes not in use, and the clients waiting for one. */
+static int free_pipes[MAX_PIPES];
+static int free_pipe_count = 0;
+static struct client_info *waiting_head = 0;
+static struct client_info *waiting_tail = 0;
+
+
+struct client_info *get_client(int slot) {
+    return &clients[slot - CLIENT_BASE];
+}
+
+
+void init_pipes() {
+    int i;
+    for (i = 0; i < MAX_PIPES; ++i) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC)) {
+            fprintf(stderr, "pipe2() failed. (%d)\n", errno);
+            exit(1);
+        }
+        fcntl(fds[1], F_SETPIPE_SZ, PIPE_CHUNK);
+
+        int slot = PIPE_BASE + 2 * i;
+        if (update_file_slot(slot, fds[0]) < 0 ||
+                update_file_slot(slot + 1, fds[1]) < 0) {
+            fprintf(stderr, "IORING_REGISTER_FILES_UPDATE failed. (%d)\n",
+                    errno);
+            exit(1);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        free_pipes[free_pipe_count++] = slot;
+    }
+
+    for (i = 0; i < MAX_FILES; ++i)
+        open_files[i].path[0] = 0;
+    for (i = MAX_FILE_SLOTS - 1; i >= 0; --i)
+        free_slots[free_slot_count++] = FILE_BASE + i;
+}
+
+
+void arm_accept() {
+    struct io_uring_sqe *sqe = get_sqe(USER_DATA(0, OP_ACCEPT));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = LISTENER_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+}
+
+
+void arm_recv(struct client_info *client) {
+    struct io_uring_sqe *sqe = get_sqe(USER_DATA(client->slot, OP_RECV));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = BUFFER_GROUP;
+    client->recv_armed = 1;
+}
+
+
+/* Queues a send of length bytes at data. The send is retried until it
+ * is complete, so a response never goes out short. */
+void queue_send(struct client_info *client, const char *data, size_t length,
+        int more, int link) {
+    struct io_uring_sqe *sqe = get_sqe(USER_DATA(client->slot, OP_SEND));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client->slot;
+    sqe->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    sqe->addr = (unsigned long long)(unsigned long)data;
+    sqe->len = (unsigned)length;
+    sqe->msg_flags = MSG_WAITALL | (more ? MSG_MORE : 0);
+    client->pending++;
+}
+
+
+/* Queues the headers in output and a small file's body as one send. */
+void queue_sendmsg(struct client_info *client, size_t length) {
+    client->iov[0].iov_base = client->output;
+    client->iov[0].iov_len = strlen(client->output);
+    client->iov[1].iov_base = client->body->data;
+    client->iov[1].iov_len = length;
+    memset(&client->msg, 0, sizeof(client->msg));
+    client->msg.msg_iov = client->iov;
+    client->msg.msg_iovlen = 2;
+
+    struct io_uring_sqe *sqe = get_sqe(USER_DATA(client->slot, OP_SEND));
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long long)(unsigned long)&client->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL;
+    client->pending++;
+}
+
+
+void queue_splice(struct client_info *client, int op, int in_slot,
+        unsigned long long in_offset, int out_slot, size_t length,
+        unsigned flags, int link) {
+    struct io_uring_sqe *sqe = get_sqe(USER_DATA(client->slot, op));
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = out_slot;
+    sqe->off = (unsigned long long)-1;
+    sqe->splice_fd_in = in_slot;
+    sqe->splice_off_in = in_offset;
+    sqe->len = (unsigned)length;
+    sqe->splice_flags = SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE | flags;
+    sqe->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    client->pending++;
+}
+
+
+/* Moves the next piece of the file through the pipe: a splice into it,
+ * linked to a splice out of it, so both go to the kernel at once. If
+ * the first comes up short the second is cancelled, and the rest of the
+ * pipe is sent on its own. */
+void queue_file_chunk(struct client_info *client) {
+    if (client->pipe_bytes) {
+        queue_splice(client, OP_SPLICE_OUT, client->pipe,
+                (unsigned long long)-1, client->slot, client->pipe_bytes,
+                client->file_remaining ? SPLICE_F_MORE : 0, 0);
+        return;
+    }
+
+    size_t n = client->file_remaining < PIPE_CHUNK ?
+        client->file_remaining : PIPE_CHUNK;
+    queue_splice(client, OP_SPLICE_IN, client->file_slot,
+            client->file_offset, client->pipe + 1, n, 0, 1);
+    queue_splice(client, OP_SPLICE_OUT, client->pipe,
+            (unsigned long long)-1, client->slot, n,
+            client->file_remaining > n ? SPLICE_F_MORE : 0, 0);
+}
+
+
+void release_pipe(struct client_info *client) {
+    if (!client->pipe) return;
+
+    /* A pipe left with data in it after an error can't be reused. */
+    if (client->pipe_bytes) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == 0) {
+            fcntl(fds[1], F_SETPIPE_SZ, PIPE_CHUNK);
+            update_file_slot(client->pipe, fds[0]);
+            update_file_slot(client->pipe + 1, fds[1]);
+            close(fds[0]);
+            close(fds[1]);
+        }
+        client->pipe_bytes = 0;
+    }
+    free_pipes[free_pipe_count++] = client->pipe;
+    client->pipe = 0;
+
+    /* Hand the pipe to the longest waiting client. */
+    struct client_info *next = waiting_head;
+    if (next) {
+        waiting_head = next->next_waiting;
+        if (!waiting_head) waiting_tail = 0;
+        next->pipe = free_pipes[--free_pipe_count];
+        queue_send(next, next->output, strlen(next->output), 1, 1);
+        queue_file_chunk(next);
+    }
+}
+
+
+/* Closes the connection once nothing is left in flight for it. Its
+ * multishot recv is cancelled first. */
+void drop_client(struct client_info *client) {
+    if (!client->active) return;
+    client->closing = 1;
+
+    if (client->recv_armed == 1) {
+        struct io_uring_sqe *sqe = get_sqe(USER_DATA(0, OP_OTHER));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = client->slot;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+            IORING_ASYNC_CANCEL_FD_FIXED | IORING_ASYNC_CANCEL_ALL;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        client->recv_armed = -1;
+    }
+    if (client->recv_armed || client->pending) return;
+
+    struct io_uring_sqe *sqe = get_sqe(USER_DATA(0, OP_OTHER));
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = client->slot + 1;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    client->active = 0;
+}
+
+
+void send_400(struct client_info *client) {
+    const char *c400 = "HTTP/1.1 400 Bad Request\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 11\r\n\r\nBad Request";
+    client->keep_alive = 0;
+    queue_send(client, c400, strlen(c400), 0, 0);
+}
+
+void send_404(struct client_info *client) {
+    const char *c404 = client->keep_alive ?
+        "HTTP/1.1 404 Not Found\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 9\r\n\r\nNot Found" :
+        "HTTP/1.1 404 Not Found\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 9\r\n\r\nNot Found";
+    queue_send(client, c404, strlen(c404), 0, 0);
+}
+
+
+void send_503(struct client_info *client) {
+    const char *c503 = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Connection: close\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Length: 19\r\n\r\nService Unavailable";
+    client->keep_alive = 0;
+    queue_send(client, c503, strlen(c503), 0, 0);
+}
+
+
+void serve_resource(struct client_info *client, const char *path) {
+    if (strcmp(path, "/") == 0) path = "/index.html";
+
+    if (strlen(path) > 100) {
+        send_400(client);
+        return;
+    }
+
+    if (strstr(path, "..")) {
+        send_404(client);
+        return;
+    }
+
+    int busy = 0;
+    struct open_file *f = get_file(path, &busy);
+    if (!f) {
+        if (busy) send_503(client);
+        else send_404(client);
+        return;
+    }
+
+    sprintf(client->output, "HTTP/1.1 200 OK\r\n"
+            "Connection: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "Content-Type: %s\r\n\r\n",
+            client->keep_alive ? "keep-alive" : "close",
+            (unsigned long)f->size, get_content_type(path));
+
+    if (!f->size) {
+        queue_send(client, client->output, strlen(client->output), 0, 0);
+        return;
+    }
+
+    if (f->body) {
+        client->body = f->body;
+        client->body->refs++;
+        queue_sendmsg(client, f->size);
+        return;
+    }
+
+    client->file_slot = f->slot;
+    slot_refs[f->slot - FILE_BASE]++;
+    client->file_offset = 0;
+    client->file_remaining = f->size;
+
+    if (!free_pipe_count) {
+        client->next_waiting = 0;
+        if (waiting_tail) waiting_tail->next_waiting = client;
+        else waiting_head = client;
+        waiting_tail = client;
+        return;
+    }
+
+    /* The headers, the splice into the pipe and the splice out of it are
+     * linked, so they run in order and are submitted together. */
+    client->pipe = free_pipes[--free_pipe_count];
+    queue_send(client, client->output, strlen(client->output), 1, 1);
+    queue_file_chunk(client);
+}
+
+
+/* HTTP/1.1 connections stay open unless the client asks to close;
+ * HTTP/1.0 connections only stay open if the client asks for it. */
+int wants_keep_alive(struct client_info *client) {
+    const struct http_request *req = &client->parser;
+    const struct http_span *connection =
+        http_get_header(req, client->request, "connection");
+
+    if (strncmp(client->request + req->version.offset, "HTTP/1.1", 8) == 0)
+        return !connection ||
+            !http_span_has_token(client->request, *connection, "close");
+
+    return connection &&
+        http_span_has_token(client->request, *connection, "keep-alive");
+}
+
+
+/* Starts the response to the next complete request in client->request,
+ * if there is one. Pipelined requests are answered one at a time, each
+ * once the previous response has been sent. */
+void process_request(struct client_info *client) {
+    struct http_request *req = &client->parser;
+    int status = http_parse(req, client->request, client->received);
+
+    if (status == HTTP_PARSE_INCOMPLETE) {
+        if (!client->overflow && client->received < MAX_REQUEST_SIZE)
+            return;
+        status = HTTP_PARSE_ERROR;
+    }
+
+    client->responding = 1;
+    client->failed = 0;
+
+    if (status == HTTP_PARSE_ERROR) {
+        send_400(client);
+        client->received = 0;
+        return;
+    }
+
+    ++request_count;
+    client->keep_alive = wants_keep_alive(client);
+
+    if (req->method.length != 3 ||
+            strncmp(client->request + req->method.offset, "GET", 3)) {
+        send_400(client);
+    } else {
+        char *path = client->request + req->path.offset;
+        path[req->path.length] = 0;
+        serve_resource(client, path);
+    }
+
+    int length = req->length;
+    client->received -= length;
+    memmove(client->request, client->request + length, client->received + 1);
+    http_reset(req);
+}
+
+
+void end_response(struct client_info *client) {
+    release_pipe(client);
+    if (client->file_slot) release_slot(client->file_slot);
+    client->file_slot = 0;
+    release_body(client->body);
+    client->body = 0;
+    client->responding = 0;
+}
+
+
+/* Called as each submission of a response completes. Once none are in
+ * flight, either more of the file is sent or the response is done. */
+void continue_response(struct client_info *client) {
+    if (client->pending) return;
+
+    if (client->failed || client->closing) {
+        end_response(client);
+        drop_client(client);
+        return;
+    }
+
+    if (client->pipe_bytes || client->file_remaining) {
+        queue_file_chunk(client);
+        return;
+    }
+
+    end_response(client);
+
+    if (!client->keep_alive) {
+        drop_client(client);
+        return;
+    }
+    process_request(client);
+}
+
+
+void handle_accept(const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !stopping)
+        arm_accept();
+
+    if (cqe->res < 0) {
+        if (cqe->res != -ENFILE)
+            fprintf(stderr, "accept failed. (%d)\n", -cqe->res);
+        return;
+    }
+
+    struct client_info *client = get_client(cqe->res);
+    memset(client, 0, sizeof(*client));
+    client->slot = cqe->res;
+    client->active = 1;
+    http_reset(&client->parser);
+    arm_recv(client);
+}
+
+
+void handle_recv(struct client_info *client, const struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0 && !client->closing) {
+            int n = cqe->res;
+            if (n > MAX_REQUEST_SIZE - client->received) {
+                n = MAX_REQUEST_SIZE - client->received;
+                client->overflow = 1;
+            }
+            memcpy(client->request + client->received,
+                    buffers + bid * BUFFER_SIZE, n);
+            client->received += n;
+            client->request[client->received] = 0;
+        }
+        recycle_buffer(bid);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        client->recv_armed = 0;
+
+        /* The recv also stops when the buffers run out; it can be armed
+         * again now that they are being returned. */
+        if (client->closing) {
+            drop_client(client);
+            return;
+        }
+        if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+            arm_recv(client);
+        } else {
+            /* The client has closed its side. A response in flight is
+             * still finished, and the connection closed after it. */
+            if (cqe->res < 0) client->failed = 1;
+            client->keep_alive = 0;
+            if (!client->responding) drop_client(client);
+            return;
+        }
+    }
+
+    if (cqe->res > 0 && !client->responding && !client->closing)
+        process_request(client);
+}
+
+
+void handle_completion(const struct io_uring_cqe *cqe) {
+    int op = (int)(cqe->user_data & 0xff);
+    int slot = (int)(cqe->user_data >> 8);
+
+    if (op == OP_ACCEPT) {
+        handle_accept(cqe);
+        return;
+    }
+    if (op == OP_OTHER) return;
+
+    struct client_info *client = get_client(slot);
+    if (op == OP_RECV) {
+        handle_recv(client, cqe);
+        return;
+    }
+
+    /* A splice is cancelled when the one linked before it comes up
+     * short, which isn't an error. */
+    client->pending--;
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) client->failed = 1;
+    } else if (op == OP_SPLICE_IN) {
+        if (cqe->res == 0) client->failed = 1;
+        client->pipe_bytes += cqe->res;
+        client->file_offset += cqe->res;
+        client->file_remaining -= cqe->res;
+    } else if (op == OP_SPLICE_OUT) {
+        if (cqe->res == 0) client->failed = 1;
+        client->pipe_bytes -= cqe->res;
+    }
+    continue_response(client);
+}
+
+
+void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+
+int main() {
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Without SA_RESTART, so the signal ends the wait in io_uring_enter(). */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+
+    SOCKET server = create_socket(0, "8080");
+
+    ring_init();
+    register_files(server);
+    register_buffers();
+    init_pipes();
+
+    clients = (struct client_info*)
+        calloc(MAX_CLIENTS, sizeof(struct client_info));
+    if (!clients) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    arm_accept();
+
+    while (!stopping) {
+        ring_submit(1);
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+            handle_completion(&cqe);
+        }
+    }
+
+    printf("\n%lu requests, %lu io_uring_enter() calls.\n",
+            request_count, enter_calls);
+
+    printf("\nClosing socket...\n");
+    CLOSESOCKET(server);
+    close(ring.fd);
+
+    printf("Finished.\n");
+    return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Lewis Van Winkle
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The WebSocket protocol (RFC 6455), as far as a server needs it: the
+ * handshake's accept key, reading frame headers, unmasking payloads and
+ * writing frame headers.
+ *
+ * Every frame a client sends is masked with a 4-byte key. Unmasking
+ * XORs the payload with the key repeated, 16 bytes at a time with SSE2,
+ * or 32 bytes at a time with AVX2 when the compiler targets it
+ * (-mavx2). Frames a server sends aren't masked, so one encoded frame
+ * can be sent to any number of clients as it is.
+ */
+
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WS_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WS_SSE2
+#endif
+
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_LENGTH 24
+#define WS_ACCEPT_SIZE 29
+#define WS_MAX_HEADER 14
+#define WS_ERROR (-1)
+
+enum {
+    WS_CONTINUATION = 0,
+    WS_TEXT = 1,
+    WS_BINARY = 2,
+    WS_CLOSE = 8,
+    WS_PING = 9,
+    WS_PONG = 10
+};
+
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL 1002
+#define WS_CLOSE_TOO_BIG 1009
+
+struct ws_header {
+    int fin;
+    int opcode;
+    int masked;
+    unsigned char mask[4];
+    unsigned long length;
+};
+
+
+#define ws_rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void ws_sha1_block(uint32_t h[5], const unsigned char *p) {
+    uint32_t w[80];
+    int i;
+    for (i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+            (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+    for (i = 16; i < 80; ++i)
+        w[i] = ws_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = ws_rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ws_rol(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+
+/* SHA-1 is only used for the handshake, where it isn't relied on for
+ * security, so a plain one-shot version will do. */
+static void ws_sha1(const unsigned char *data, size_t length,
+        unsigned char digest[20]) {
+    uint32_t h[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    unsigned char block[64];
+    size_t i;
+    for (i = 0; i + 64 <= length; i += 64)
+        ws_sha1_block(h, data + i);
+
+    size_t rest = length - i;
+    memcpy(block, data + i, rest);
+    block[rest++] = 0x80;
+    if (rest > 56) {
+        memset(block + rest, 0, 64 - rest);
+        ws_sha1_block(h, block);
+        rest = 0;
+    }
+    memset(block + rest, 0, 56 - rest);
+
+    uint32_t high = (uint32_t)(length >> 29);
+    uint32_t low = (uint32_t)(length << 3);
+    for (i = 0; i < 4; ++i) {
+        block[56 + i] = (unsigned char)(high >> (24 - 8 * i));
+        block[60 + i] = (unsigned char)(low >> (24 - 8 * i));
+    }
+    ws_sha1_block(h, block);
+
+    for (i = 0; i < 20; ++i)
+        digest[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+
+static void ws_base64(const unsigned char *p, int length, char *o) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+    for (i = 0; i + 2 < length; i += 3) {
+        *o++ = digits[p[i] >> 2];
+        *o++ = digits[(p[i] & 3) << 4 | p[i + 1] >> 4];
+        *o++ = digits[(p[i + 1] & 15) << 2 | p[i + 2] >> 6];
+        *o++ = digits[p[i + 2] & 63];
+    }
+    if (i < length) {
+        *o++ = digits[p[i] >> 2];
+        if (i + 1 < length) {
+            *o++ = digits[(p[i] & 3) << 4 | p[i + 1] >> 4];
+            *o++ = digits[(p[i + 1] & 15) << 2];
+        } else {
+            *o++ = digits[(p[i] & 3) << 4];
+            *o++ = '=';
+        }
+        *o++ = '=';
+    }
+    *o = 0;
+}
+
+
+/* Writes the Sec-WebSocket-Accept value for a Sec-WebSocket-Key of
+ * WS_KEY_LENGTH bytes into accept, which holds WS_ACCEPT_SIZE bytes. */
+static void ws_accept_key(const char *key, char *accept) {
+    unsigned char input[WS_KEY_LENGTH + sizeof(WS_GUID) - 1];
+    unsigned char digest[20];
+    memcpy(input, key, WS_KEY_LENGTH);
+    memcpy(input + WS_KEY_LENGTH, WS_GUID, sizeof(WS_GUID) - 1);
+    ws_sha1(input, sizeof(input), digest);
+    ws_base64(digest, 20, accept);
+}
+
+
+/* Reads a frame header from the first length bytes at p. Returns its
+ * size, 0 if it isn't all there yet, or WS_ERROR if reserved bits are
+ * set or the payload is too long to be taken at all. */
+static int ws_parse_header(const char *p, size_t length,
+        struct ws_header *h) {
+    const unsigned char *u = (const unsigned char*)p;
+    if (length < 2) return 0;
+    if (u[0] & 0x70) return WS_ERROR;
+
+    h->fin = u[0] >> 7;
+    h->opcode = u[0] & 15;
+    h->masked = u[1] >> 7;
+    h->length = u[1] & 127;
+
+    size_t size = 2;
+    if (h->length == 126) {
+        if (length < 4) return 0;
+        h->length = (unsigned long)u[2] << 8 | u[3];
+        size = 4;
+    } else if (h->length == 127) {
+        if (length < 10) return 0;
+        if (u[2] | u[3] | u[4] | u[5] | (u[6] & 0x80)) return WS_ERROR;
+        h->length = (unsigned long)u[6] << 24 | (unsigned long)u[7] << 16 |
+            (unsigned long)u[8] << 8 | u[9];
+        size = 10;
+    }
+
+    if (h->masked) {
+        if (length < size + 4) return 0;
+        memcpy(h->mask, u + size, 4);
+        size += 4;
+    }
+    return (int)size;
+}
+
+
+/* Unmasks length bytes of payload in place. The key repeats every 4
+ * bytes, so a vector of it lines up with every 16 or 32 bytes. */
+static void ws_unmask(char *p, size_t length, const unsigned char mask[4]) {
+    size_t i = 0;
+#if defined(WS_AVX2)
+    uint32_t m32;
+    memcpy(&m32, mask, 4);
+    const __m256i key32 = _mm256_set1_epi32((int)m32);
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        _mm256_storeu_si256((__m256i*)(p + i), _mm256_xor_si256(v, key32));
+    }
+#endif
+#if defined(WS_SSE2)
+    uint32_t m16;
+    memcpy(&m16, mask, 4);
+    const __m128i key16 = _mm_set1_epi32((int)m16);
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        _mm_storeu_si128((__m128i*)(p + i), _mm_xor_si128(v, key16));
+    }
+#endif
+    for (; i < length; ++i)
+        p[i] ^= mask[i & 3];
+}
+
+
+/* Writes the header of a final, unmasked frame with a payload of length
+ * bytes to o. Returns its size, at most WS_MAX_HEADER. */
+static int ws_write_header(char *o, int opcode, unsigned long length) {
+    unsigned char *u = (unsigned char*)o;
+    u[0] = (unsigned char)(0x80 | opcode);
+    if (length < 126) {
+        u[1] = (unsigned char)length;
+        return 2;
+    }
+    if (length < 65536) {
+        u[1] = 126;
+        u[2] = (unsigned char)(length >> 8);
+        u[3] = (unsigned char)length;
+        return 4;
+    }
+    u[1] = 127;
+    memset(u + 2, 0, 4);
+    u[6] = (unsigned char)(length >> 24);
+    u[7] = (unsigned char)(length >> 16);
+    u[8] = (unsigned char)(length >> 8);
+    u[9] = (unsigned char)length;
+    return 10;
+}
+
+#endif
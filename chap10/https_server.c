@@ -23,6 +23,8 @@
  */
 
 #include "chap10.h"
+#include "../chap07/server_stats.h"
+#include "../chap07/buffer_pool.h"
 
 
 const char *get_content_type(const char* path) {
@@ -68,6 +70,12 @@ SOCKET create_socket(const char* host, const char *port) {
         exit(1);
     }
 
+    int yes = 1;
+    if (setsockopt(socket_listen, SOL_SOCKET, SO_REUSEADDR,
+                (const char*)&yes, sizeof(yes)) < 0) {
+        fprintf(stderr, "setsockopt() failed. (%d)\n", GETSOCKETERRNO());
+    }
+
     printf("Binding socket to local address...\n");
     if (bind(socket_listen,
                 bind_address->ai_addr, bind_address->ai_addrlen)) {
@@ -94,55 +102,108 @@ struct client_info {
     struct sockaddr_storage address;
     SOCKET socket;
     SSL *ssl;
-    char request[MAX_REQUEST_SIZE + 1];
+    char *request; /* from buffer_pool.h once the request starts */
     int received;
     struct client_info *next;
+    struct client_info *prev;
 };
 
 static struct client_info *clients = 0;
 
-struct client_info *get_client(SOCKET s) {
-    struct client_info *ci = clients;
+/* Clients are looked up by socket through client_table, which is indexed
+ * by the socket descriptor and grows as higher descriptors show up.
+ * Dropped clients go onto free_clients and are reused by later
+ * connections; new ones are carved out of CLIENT_SLAB sized blocks. */
+static struct client_info **client_table = 0;
+static size_t client_table_size = 0;
+static struct client_info *free_clients = 0;
+
+#define CLIENT_SLAB 64
+
+struct client_info *alloc_client() {
+    if (!free_clients) {
+        struct client_info *slab = (struct client_info*)
+            calloc(CLIENT_SLAB, sizeof(struct client_info));
+        if (!slab) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
 
-    while(ci) {
-        if (ci->socket == s)
-            break;
-        ci = ci->next;
+        int i;
+        for (i = 0; i < CLIENT_SLAB; ++i) {
+            slab[i].next = free_clients;
+            free_clients = &slab[i];
+        }
     }
 
-    if (ci) return ci;
-    struct client_info *n =
-        (struct client_info*) calloc(1, sizeof(struct client_info));
+    struct client_info *n = free_clients;
+    free_clients = n->next;
+    return n;
+}
+
 
-    if (!n) {
-        fprintf(stderr, "Out of memory.\n");
-        exit(1);
+struct client_info *get_client(SOCKET s) {
+    size_t i = (size_t)s;
+
+    if (i < client_table_size && client_table[i])
+        return client_table[i];
+
+    if (i >= client_table_size) {
+        size_t size = client_table_size ? client_table_size : 1024;
+        while (size <= i) size *= 2;
+
+        struct client_info **table = (struct client_info**)
+            realloc(client_table, size * sizeof(*table));
+        if (!table) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memset(table + client_table_size, 0,
+                (size - client_table_size) * sizeof(*table));
+        client_table = table;
+        client_table_size = size;
     }
 
+    struct client_info *n = alloc_client();
     n->address_length = sizeof(n->address);
+    n->socket = s;
+    n->ssl = 0;
+    n->received = 0;
+    n->request = 0;
+
+    n->prev = 0;
     n->next = clients;
+    if (clients) clients->prev = n;
     clients = n;
+
+    client_table[i] = n;
     return n;
 }
 
 
+/* The loop's counters, reported at /server-status. */
+static struct server_stats stats;
+
+
 void drop_client(struct client_info *client) {
     SSL_shutdown(client->ssl);
     CLOSESOCKET(client->socket);
     SSL_free(client->ssl);
+    stats_add(&stats.closed, 1);
 
-    struct client_info **p = &clients;
-
-    while(*p) {
-        if (*p == client) {
-            *p = client->next;
-            free(client);
-            return;
-        }
-        p = &(*p)->next;
+    if (client->request) {
+        pool_put(client->request);
+        client->request = 0;
     }
 
-    exit(1);
+    client_table[(size_t)client->socket] = 0;
+
+    if (client->prev) client->prev->next = client->next;
+    else clients = client->next;
+    if (client->next) client->next->prev = client->prev;
+
+    client->next = free_clients;
+    free_clients = client;
 }
 
 
@@ -173,7 +234,14 @@ fd_set wait_on_clients(SOCKET server) {
         ci = ci->next;
     }
 
+#if defined(STATS_INTERVAL)
+    struct timeval timeout;
+    timeout.tv_sec = STATS_INTERVAL;
+    timeout.tv_usec = 0;
+    if (select(max_socket+1, &reads, 0, 0, &timeout) < 0) {
+#else
     if (select(max_socket+1, &reads, 0, 0, 0) < 0) {
+#endif
         fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
         exit(1);
     }
@@ -182,11 +250,34 @@ fd_set wait_on_clients(SOCKET server) {
 }
 
 
+#if defined(STATS_INTERVAL)
+/* With -DSTATS_INTERVAL=seconds, the status report is also written to
+ * stderr that often. */
+void dump_stats() {
+    static time_t next_dump = 0;
+    time_t now = time(0);
+    if (now < next_dump) return;
+    next_dump = now + STATS_INTERVAL;
+
+    char report[1024];
+    fwrite(report, 1, stats_format(report), stderr);
+}
+#endif
+
+
+/* Writes data to client and counts what was sent. */
+void send_data(struct client_info *client, const char *data, int length) {
+    int r = SSL_write(client->ssl, data, length);
+    if (r > 0) stats_add(&stats.bytes_sent, (unsigned long)r);
+}
+
+
 void send_400(struct client_info *client) {
     const char *c400 = "HTTP/1.1 400 Bad Request\r\n"
         "Connection: close\r\n"
         "Content-Length: 11\r\n\r\nBad Request";
-    SSL_write(client->ssl, c400, strlen(c400));
+    send_data(client, c400, strlen(c400));
+    stats_status(&stats, 400);
     drop_client(client);
 }
 
@@ -194,7 +285,29 @@ void send_404(struct client_info *client) {
     const char *c404 = "HTTP/1.1 404 Not Found\r\n"
         "Connection: close\r\n"
         "Content-Length: 9\r\n\r\nNot Found";
-    SSL_write(client->ssl, c404, strlen(c404));
+    send_data(client, c404, strlen(c404));
+    stats_status(&stats, 404);
+    drop_client(client);
+}
+
+
+/* Answers /server-status with the counters from server_stats.h. */
+void send_status(struct client_info *client) {
+    char report[1024];
+    int length = stats_format(report);
+
+    char buffer[1280];
+    char *o = buffer;
+    o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+    o += sprintf(o, "Connection: close\r\n");
+    o += sprintf(o, "Content-Length: %d\r\n", length);
+    o += sprintf(o, "Content-Type: text/plain\r\n");
+    o += sprintf(o, "Cache-Control: no-store\r\n\r\n");
+    memcpy(o, report, length);
+    o += length;
+
+    send_data(client, buffer, (int)(o - buffer));
+    stats_status(&stats, 200);
     drop_client(client);
 }
 
@@ -204,6 +317,11 @@ void serve_resource(struct client_info *client, const char *path) {
 
     printf("serve_resource %s %s\n", get_client_address(client), path);
 
+    if (strcmp(path, "/server-status") == 0) {
+        send_status(client);
+        return;
+    }
+
     if (strcmp(path, "/") == 0) path = "/index.html";
 
     if (strlen(path) > 100) {
@@ -240,31 +358,28 @@ void serve_resource(struct client_info *client, const char *path) {
 
     const char *ct = get_content_type(full_path);
 
-#define BSIZE 1024
+    /* The headers are assembled in buffer and sent together with the
+     * start of the body. Each SSL_write() makes one TLS record, and
+     * 16384 bytes is the most a record can carry. */
+#define BSIZE 16384
     char buffer[BSIZE];
 
-    sprintf(buffer, "HTTP/1.1 200 OK\r\n");
-    SSL_write(client->ssl, buffer, strlen(buffer));
-
-    sprintf(buffer, "Connection: close\r\n");
-    SSL_write(client->ssl, buffer, strlen(buffer));
-
-    sprintf(buffer, "Content-Length: %u\r\n", cl);
-    SSL_write(client->ssl, buffer, strlen(buffer));
-
-    sprintf(buffer, "Content-Type: %s\r\n", ct);
-    SSL_write(client->ssl, buffer, strlen(buffer));
+    char *o = buffer;
+    o += sprintf(o, "HTTP/1.1 200 OK\r\n");
+    o += sprintf(o, "Connection: close\r\n");
+    o += sprintf(o, "Content-Length: %lu\r\n", (unsigned long)cl);
+    o += sprintf(o, "Content-Type: %s\r\n", ct);
+    o += sprintf(o, "\r\n");
 
-    sprintf(buffer, "\r\n");
-    SSL_write(client->ssl, buffer, strlen(buffer));
-
-    int r = fread(buffer, 1, BSIZE, fp);
+    int r = (int)(o - buffer);
+    r += (int)fread(o, 1, BSIZE - r, fp);
     while (r) {
-        SSL_write(client->ssl, buffer, r);
-        r = fread(buffer, 1, BSIZE, fp);
+        send_data(client, buffer, r);
+        r = (int)fread(buffer, 1, BSIZE, fp);
     }
 
     fclose(fp);
+    stats_status(&stats, 200);
     drop_client(client);
 }
 
@@ -291,6 +406,10 @@ int main() {
         return 1;
     }
 
+    /* Lets OpenSSL free a connection's record buffers while it has
+     * nothing to read or write. */
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
 
     if (!SSL_CTX_use_certificate_file(ctx, "cert.pem" , SSL_FILETYPE_PEM)
     || !SSL_CTX_use_PrivateKey_file(ctx, "key.pem", SSL_FILETYPE_PEM)) {
@@ -301,26 +420,36 @@ int main() {
 
 
     SOCKET server = create_socket(0, "8080");
+    stats_add_thread(&stats);
 
 
     while(1) {
+        stats_add(&stats.loops, 1);
+#if defined(STATS_INTERVAL)
+        dump_stats();
+#endif
 
         fd_set reads;
         reads = wait_on_clients(server);
 
         if (FD_ISSET(server, &reads)) {
-            struct client_info *client = get_client(-1);
+            struct sockaddr_storage address;
+            socklen_t address_length = sizeof(address);
 
-            client->socket = accept(server,
-                    (struct sockaddr*) &(client->address),
-                    &(client->address_length));
+            SOCKET socket_client = accept(server,
+                    (struct sockaddr*) &address, &address_length);
 
-            if (!ISVALIDSOCKET(client->socket)) {
+            if (!ISVALIDSOCKET(socket_client)) {
                 fprintf(stderr, "accept() failed. (%d)\n",
                         GETSOCKETERRNO());
                 return 1;
             }
 
+            stats_add(&stats.accepted, 1);
+            struct client_info *client = get_client(socket_client);
+            memcpy(&client->address, &address, address_length);
+            client->address_length = address_length;
+
 
             client->ssl = SSL_new(ctx);
             if (!client->ssl) {
@@ -332,6 +461,7 @@ int main() {
             if (SSL_accept(client->ssl) != 1) {
                 //SSL_get_error(client->ssl, SSL_accept(...));
                 ERR_print_errors_fp(stderr);
+                stats_add(&stats.dropped, 1);
                 drop_client(client);
             } else {
                 printf("New connection from %s.\n",
@@ -355,6 +485,15 @@ int main() {
                     continue;
                 }
 
+                if (!client->request) {
+                    client->request = (char*)
+                        pool_get(MAX_REQUEST_SIZE + 1, 0);
+                    if (!client->request) {
+                        fprintf(stderr, "Out of memory.\n");
+                        exit(1);
+                    }
+                }
+
                 int r = SSL_read(client->ssl,
                         client->request + client->received,
                         MAX_REQUEST_SIZE - client->received);
@@ -362,6 +501,7 @@ int main() {
                 if (r < 1) {
                     printf("Unexpected disconnect from %s.\n",
                             get_client_address(client));
+                    stats_add(&stats.dropped, 1);
                     drop_client(client);
 
                 } else {
@@ -370,6 +510,9 @@ int main() {
 
                     char *q = strstr(client->request, "\r\n\r\n");
                     if (q) {
+                        /* Latency runs from finding the whole request
+                         * to the last write of its response. */
+                        unsigned long started = stats_now_us();
                         *q = 0;
 
                         if (strncmp("GET /", client->request, 5)) {
@@ -384,6 +527,7 @@ int main() {
                                 serve_resource(client, path);
                             }
                         }
+                        stats_latency(&stats, stats_now_us() - started);
                     } //if (q)
                 }
             }
@@ -0,0 +1,147 @@
+#!/bin/sh
+# Benchmarks web_server, web_server2 and https_server on loopback and
+# writes the results to a JSON file, one result per line, so that runs
+# from two commits can be compared with diff.
+#
+# Every scenario starts a fresh server and drives it with web_bench:
+#   small_keepalive  /test.txt on kept-alive connections
+#   large_download   a 1 MiB file, one connection per request
+#   churn            /test.txt, one connection per request, 16 clients
+#   slow_clients     /test.txt while 8 clients read the 1 MiB file at
+#                    64 KiB/s
+#   idle_10k         /test.txt with 10000 idle connections open
+# Each result has web_bench's req/s and latency percentiles, and the
+# server's peak RSS and the CPU time it used, across all its processes.
+#
+# Run from the top of the repository. Linux only; https_server needs
+# OpenSSL.
+#
+# usage: test/bench.sh [output.json] [requests]
+
+OUTPUT=${1:-bench-$(git rev-parse --short HEAD 2> /dev/null || echo local).json}
+REQUESTS=${2:-20000}
+CC=${CC:-cc}
+BIN=/tmp/bench_$$
+TICKS=$(getconf CLK_TCK)
+
+mkdir -p $BIN
+${CC} -O2 chap07/web_server.c -o $BIN/web_server -lpthread || exit 1
+${CC} -O2 chap07/web_server2.c -o $BIN/web_server2 || exit 1
+${CC} -O2 chap10/https_server.c -o $BIN/https_server -lssl -lcrypto || exit 1
+${CC} -O2 -DUSE_TLS chap07/web_bench.c -o $BIN/web_bench \
+    -lssl -lcrypto || exit 1
+
+LARGE=chap07/public/bench_large.bin
+head -c 1048576 /dev/urandom > $LARGE
+trap 'rm -rf $BIN $LARGE' EXIT
+
+# 10000 idle connections need as many descriptors in the client and the
+# server.
+ulimit -n 65536 2> /dev/null || ulimit -n 16384 2> /dev/null
+
+# Starts server $1 from the directory it serves from, leaving its pid in
+# PID.
+start_server() {
+    case $1 in
+        web_server) (cd chap07 && exec $BIN/web_server > /dev/null) & ;;
+        web_server2) (cd chap07 && exec $BIN/web_server2 0 > /dev/null) & ;;
+        https_server) (cd chap10 && exec $BIN/https_server > /dev/null) & ;;
+    esac
+    PID=$!
+    sleep 1
+}
+
+# Prints the server's peak RSS in KiB and CPU time in seconds, summed
+# over its worker processes, as JSON fields.
+server_usage() {
+    PIDS="$PID $(pgrep -P $PID)"
+    RSS=0
+    CPU=0
+    for P in $PIDS; do
+        R=$(awk '/^VmHWM:/ { print $2 }' /proc/$P/status 2> /dev/null)
+        C=$(awk '{ print $14 + $15 }' /proc/$P/stat 2> /dev/null)
+        RSS=$((RSS + ${R:-0}))
+        CPU=$((CPU + ${C:-0}))
+    done
+    printf '"rss_kb": %d, "cpu_s": %s' $RSS \
+        $(awk "BEGIN { printf \"%.2f\", $CPU / $TICKS }")
+}
+
+stop_server() {
+    pkill -P $PID 2> /dev/null
+    kill $PID 2> /dev/null
+    wait $PID 2> /dev/null
+}
+
+# Runs one scenario and appends its result line.
+run() {
+    SERVER=$1
+    SCENARIO=$2
+    shift 2
+    printf '%s %s\n' $SERVER $SCENARIO >&2
+
+    if [ "$1" = skip ]; then
+        shift
+        RESULT="\"skipped\": \"$*\""
+    else
+        start_server $SERVER
+        if [ "$SCENARIO" = slow_clients ]; then
+            $BIN/web_bench $TLS -r 65536 -c 8 127.0.0.1 8080 0 1000000 \
+                /bench_large.bin > /dev/null 2>&1 &
+            SLOW=$!
+            sleep 1
+        fi
+
+        RESULT=$(timeout 300 $BIN/web_bench -j $TLS "$@" 2> /dev/null)
+        if [ -n "$RESULT" ]; then
+            RESULT=$(echo "$RESULT" | sed 's/^{//; s/}$//')
+        else
+            RESULT="\"error\": \"web_bench failed\""
+        fi
+        RESULT="$RESULT, $(server_usage)"
+
+        if [ "$SCENARIO" = slow_clients ]; then
+            pkill -P $SLOW 2> /dev/null
+            kill $SLOW 2> /dev/null
+            wait $SLOW 2> /dev/null
+        fi
+        stop_server
+    fi
+
+    [ -n "$FIRST" ] && printf ',\n' >> $OUTPUT
+    FIRST=1
+    printf '  {"server": "%s", "scenario": "%s", %s}' \
+        $SERVER $SCENARIO "$RESULT" >> $OUTPUT
+}
+
+printf '{"commit": "%s", "date": "%s", "cpus": %d, "requests": %d, "results": [\n' \
+    "$(git rev-parse HEAD 2> /dev/null)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+    $(getconf _NPROCESSORS_ONLN) $REQUESTS > $OUTPUT
+FIRST=
+
+SMALL=$REQUESTS
+LARGE_REQUESTS=$((REQUESTS / 20))
+CLOSE="closes every connection after one response"
+
+for SERVER in web_server web_server2 https_server; do
+    TLS=
+    [ $SERVER = https_server ] && TLS=-s
+
+    if [ $SERVER = web_server ]; then
+        run $SERVER small_keepalive -k -c 4 127.0.0.1 8080 0 $SMALL /test.txt
+    else
+        run $SERVER small_keepalive skip $SERVER $CLOSE
+    fi
+    run $SERVER large_download -c 4 127.0.0.1 8080 0 $LARGE_REQUESTS \
+        /bench_large.bin
+    run $SERVER churn -c 16 127.0.0.1 8080 0 $SMALL /test.txt
+    run $SERVER slow_clients -c 4 127.0.0.1 8080 0 $((SMALL / 10)) /test.txt
+    if [ $SERVER = https_server ]; then
+        run $SERVER idle_10k skip "select() can't watch 10000 sockets"
+    else
+        run $SERVER idle_10k 127.0.0.1 8080 10000 $((SMALL / 10)) /test.txt
+    fi
+done
+
+printf '\n]}\n' >> $OUTPUT
+echo "Results written to $OUTPUT." >&2
@@ -273,6 +273,19 @@ del web_server2.cpp
 cd ..
 
 
+cd chap07
+copy parser_bench.c parser_bench.cpp
+echo "%CC%"
+%CC% parser_bench.c -o parser_bench.exe %CEXTRA%
+parser_bench.exe
+del parser_bench.exe
+%CC% parser_bench.cpp -o parser_bench.exe %CEXTRA%
+parser_bench.exe
+del parser_bench.exe
+del parser_bench.cpp
+cd ..
+
+
 cd chap08
 copy smtp_send.c smtp_send.cpp
 echo "%CC%"
@@ -225,6 +225,30 @@ echo
 cd ..
 
 
+cd chap07
+echo
+cp web_bench.c web_bench.cpp
+${CC} -Wall -Wextra web_bench.c -o web_bench; ./web_bench; rm web_bench
+echo
+${CC} -Wall -Wextra web_bench.cpp -o web_bench; ./web_bench; rm web_bench
+rm web_bench.cpp
+echo
+echo
+cd ..
+
+
+cd chap07
+echo
+cp parser_bench.c parser_bench.cpp
+${CC} -Wall -Wextra parser_bench.c -o parser_bench; ./parser_bench; rm parser_bench
+echo
+${CC} -Wall -Wextra parser_bench.cpp -o parser_bench; ./parser_bench; rm parser_bench
+rm parser_bench.cpp
+echo
+echo
+cd ..
+
+
 
 cd chap08
 echo